@@ -0,0 +1,154 @@
+import argparse
+import os
+import re
+import subprocess
+import sys
+
+from typing import Dict, List, Optional, Tuple
+
+# Run from the directory holding dpu.c, common.h and the host binary, like run.sh.
+# Whether a candidate fits the MRAM and WRAM budgets is left to the host, which
+# checks it against common.h as built before allocating anything.
+MAX_TASKLETS = 24
+SDK = "/home/coslab/upmem-sdk"
+
+e2e_re   = re.compile(r"End-to-end DPU time: ([\d.]+) ms \(alloc ([\d.]+), load ([\d.]+)")
+match_re = re.compile(r"Host == DPU")
+error_re = re.compile(r"^Error: (.*)$", re.M)
+
+
+def read_define(header: str, name: str) -> int:
+    """Integer value of a plain #define in the header."""
+    with open(header) as f:
+        m = re.search(r"^#define\s+%s\s+(\d+)\s*$" % name, f.read(), re.M)
+    if m is None:
+        raise SystemExit("%s: no #define %s" % (header, name))
+    return int(m.group(1))
+
+
+def binary_name(q_rows: int, default_q_rows: int) -> str:
+    return "dpus.mpo" if q_rows == default_q_rows else "dpus_q%d.mpo" % q_rows
+
+
+def build_variants(q_rows_list: List[int], default_q_rows: int) -> None:
+    for q in q_rows_list:
+        print("[*] Compiling dpu.c with Q_BLOCK_ROWS=%d -> %s" % (q, binary_name(q, default_q_rows)))
+        subprocess.run(["dpu-upmem-dpurte-clang", "-DNR_TASKLETS=%d" % MAX_TASKLETS, "-DQ_BLOCK_ROWS=%d" % q,
+                        "-I%s/include" % SDK, "-o", binary_name(q, default_q_rows), "dpu.c"], check=True)
+
+
+def benchmark(host: str, args: argparse.Namespace, seq: int, hd: int, kernel: str, q_rows: int, tasklets: int,
+              slots: int, row_block: int) -> Tuple[Optional[float], Optional[str]]:
+    """Milliseconds the batch takes end to end, transfers and unpacking included but not the one-off
+    allocation and load of the set, or None when the run fails or mismatches. Packing more slots per DPU
+    saves DPUs but lengthens the launch, so the batch time and not the cycles per slot decides. The
+    second value is the host's reason for rejecting a candidate that does not fit, None otherwise."""
+    cmd = [host, "-U", "none", "-b", str(args.batch), "-n", str(args.heads), "-s", str(seq), "-d", str(hd),
+           "-k", kernel, "-Q", str(q_rows), "-t", str(tasklets), "-p", str(slots)]
+    if kernel == "full":
+        cmd += ["-r", str(row_block)]
+    if args.causal:
+        cmd += ["-c"]
+    try:
+        run = subprocess.run(cmd, capture_output=True, text=True, timeout=args.timeout)
+    except subprocess.TimeoutExpired:
+        return None, None
+    # The host checks the configuration before printing the shape it runs.
+    if run.returncode != 0 and "Shape:" not in run.stdout:
+        err = error_re.search(run.stderr)
+        if err is not None:
+            return None, err.group(1)
+    m = e2e_re.search(run.stdout)
+    if m is None or match_re.search(run.stdout) is None:
+        return None, None
+    return float(m.group(1)) - float(m.group(2)) - float(m.group(3)), None
+
+
+def parse_list(text: str) -> List[int]:
+    return [int(x) for x in text.split(",") if x]
+
+
+def parse_shapes(text: str) -> List[Tuple[int, int]]:
+    shapes = []
+    for item in text.split(","):
+        seq, hd = item.split("x")
+        shapes.append((int(seq), int(hd)))
+    return shapes
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description="Benchmark DPU launch parameters per shape and write a tuning table.")
+    parser.add_argument("--shapes", default="32x16,64x16,128x16,64x32,128x32,64x64",
+                        help="comma separated SEQ_LENxHEAD_DIM")
+    parser.add_argument("--causal", action="store_true")
+    parser.add_argument("--batch", type=int, default=128, help="batch size the entries are tuned for")
+    parser.add_argument("--heads", type=int, default=16,
+                        help="heads per entry; the table keys entries on BATCH*NUM_HEADS slots")
+    parser.add_argument("--q-rows", default="4,8,16")
+    parser.add_argument("--tasklets", default="8,12,16,20,24")
+    parser.add_argument("--slots", default="1,2,4,8")
+    parser.add_argument("--row-blocks", default="1,2,4")
+    parser.add_argument("--host", default="./host")
+    parser.add_argument("--out", default="tuning.txt")
+    parser.add_argument("--timeout", type=float, default=300.0)
+    parser.add_argument("--common", default="common.h", help="header the host and DPU binaries were built from")
+    parser.add_argument("--no-build", action="store_true", help="reuse the dpus*.mpo variants already built")
+    args = parser.parse_args()
+
+    default_q_rows = read_define(args.common, "Q_BLOCK_ROWS")
+    q_rows_list = parse_list(args.q_rows)
+    if not args.no_build:
+        build_variants(q_rows_list, default_q_rows)
+
+    slots = args.batch * args.heads
+    entries: Dict[Tuple[int, int], Tuple[float, str]] = {}
+    for seq, hd in parse_shapes(args.shapes):
+        best: Optional[Tuple[float, str]] = None
+        candidates = [("full", q, t, p, r) for q in q_rows_list for t in parse_list(args.tasklets)
+                      for p in parse_list(args.slots) for r in parse_list(args.row_blocks)]
+        candidates += [("tiled", default_q_rows, t, p, 1) for t in parse_list(args.tasklets)
+                       for p in parse_list(args.slots)]
+        for kernel, q, t, p, r in candidates:
+            binary = binary_name(q, default_q_rows)
+            if kernel == "full" and not os.path.exists(binary):
+                print("SEQ_LEN=%d HEAD_DIM=%d: %s missing, skipping Q=%d" % (seq, hd, binary, q))
+                continue
+            ms, reason = benchmark(args.host, args, seq, hd, kernel, q, t, p, r)
+            if reason is not None:
+                print("SEQ_LEN=%d HEAD_DIM=%d %s Q=%d T=%d P=%d R=%d: rejected, %s" % (seq, hd, kernel, q, t, p, r, reason))
+                continue
+            print("SEQ_LEN=%d HEAD_DIM=%d %s Q=%d T=%d P=%d R=%d: %s" %
+                  (seq, hd, kernel, q, t, p, r, "failed" if ms is None else "%.3f ms per batch" % ms))
+            if ms is None:
+                continue
+            line = "%d %d %d %d %d %d %d %d %s %.3f" % (seq, hd, 1 if args.causal else 0, slots, q, t, p, r,
+                                                        kernel, ms)
+            if best is None or ms < best[0]:
+                best = (ms, line)
+        if best is not None:
+            entries[(seq, hd)] = best
+
+    # Entries of other masks, shapes or slot counts already in the table are kept.
+    causal = 1 if args.causal else 0
+    kept = []
+    if os.path.exists(args.out):
+        with open(args.out) as f:
+            for line in f:
+                fields = line.split()
+                if line.startswith("#") or len(fields) < 10:
+                    continue
+                if (int(fields[0]), int(fields[1])) in entries and int(fields[2]) == causal and \
+                        int(fields[3]) == slots:
+                    continue
+                kept.append(line.rstrip("\n"))
+
+    with open(args.out, "w") as f:
+        f.write("# seq_len head_dim causal slots q_rows tasklets slots_per_dpu row_block kernel batch_ms\n")
+        for line in kept + [entries[k][1] for k in sorted(entries)]:
+            f.write(line + "\n")
+    print("Tuning table saved →", args.out)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
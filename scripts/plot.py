@@ -14,14 +14,31 @@ os.makedirs(OUTDIR, exist_ok=True)
 exp_seq_re   = re.compile(r"\[EXP_SEQ\]\s*BATCH=(\d+),\s*SEQ_LEN=(\d+)")
 exp_batch_re = re.compile(r"\[EXP_BATCH\]\s*BATCH=(\d+),\s*SEQ_LEN=(\d+)")
 exp_hd_re    = re.compile(r"\[EXP_HD\]\s*BATCH=(\d+),\s*SEQ_LEN=(\d+),\s*HEAD_DIM=(\d+)")
+exp_hd_byte_re = re.compile(r"\[EXP_HD_BYTE\]\s*BATCH=(\d+),\s*SEQ_LEN=(\d+),\s*HEAD_DIM=(\d+)")
+exp_sm_re    = re.compile(r"\[(EXP_SOFTMAX|EXP_SOFTMAX_DIV)\]\s*BATCH=(\d+),\s*SEQ_LEN=(\d+)")
 exp_nh_re    = re.compile(r"\[EXP_NH\]\s*BATCH=(\d+),\s*SEQ_LEN=(\d+),\s*NUM_HEADS=(\d+)")
-exp_tl_re    = re.compile(r"\[EXP_TL\].*NR_TASKLETS=(\d+)")
+exp_tl_re    = re.compile(r"\[(EXP_TL|EXP_TL_STATIC)\].*NR_TASKLETS=(\d+)")
+exp_long_re  = re.compile(r"\[EXP_LONGSEQ\]\s*BATCH=(\d+),\s*SEQ_LEN=(\d+)")
+exp_prof_re  = re.compile(r"\[EXP_PROFILE\]\s*BATCH=(\d+),\s*SEQ_LEN=(\d+)")
+exp_ragged_re = re.compile(r"\[EXP_RAGGED\]\s*BATCH=(\d+),\s*SEQ_LEN=(\d+),.*MIN_LEN=(\d+)")
+exp_gqa_re   = re.compile(r"\[EXP_GQA\]\s*BATCH=(\d+),\s*SEQ_LEN=(\d+),\s*NUM_HEADS=(\d+),.*KV_HEADS=(\d+)")
+exp_dpus_re  = re.compile(r"\[EXP_DPUS\]\s*BATCH=(\d+),\s*SEQ_LEN=(\d+),\s*DPUS=(\d+)")
+exp_kv_re    = re.compile(r"\[EXP_KV_SPLIT\]\s*BATCH=(\d+),\s*SEQ_LEN=(\d+),\s*NUM_HEADS=(\d+),.*KV_PARTS=(\d+)")
+# Any other experiment marker: its runs are not parsed, and must not be
+# filed under the experiment before it.
+exp_any_re   = re.compile(r"\[(EXP_\w+)\]")
 
 host_re      = re.compile(r"Host total computation time:\s*([0-9.]+)\s*ms")
 dpu_re       = re.compile(r"Average cycles per slot:\s*([0-9.]+)\s*\(\s*([0-9.]+)\s*ms\s*\)")
 alloc_re     = re.compile(r"DPUs allocated:\s*(\d+)")
+e2e_re       = re.compile(r"End-to-end DPU time:\s*([0-9.]+)\s*ms")
+profile_re   = re.compile(r"Profile (\w+): mean ([0-9.]+) min ([0-9.]+) max ([0-9.]+) cycles")
+
+PHASES = ["dma", "qk", "softmax", "av", "writeback", "project", "barrier", "other"]
+PROFILE_CSV = os.path.join(OUTDIR, "profile.csv")
 
 rows: List[Dict[str, Any]] = []
+profile_rows: List[Dict[str, Any]] = []
 
 current: Dict[str, Optional[Any]] = {
     "batch": None,
@@ -31,6 +48,7 @@ current: Dict[str, Optional[Any]] = {
     "tasklets": None,
     "host_ms": None,
     "allocated": None,
+    "param": None,
     "exp_type": None,
 }
 
@@ -51,6 +69,20 @@ with open(LOGFILE, "r") as f:
             }
             continue
 
+        m = exp_long_re.search(line)
+        if m:
+            current = {
+                "batch": int(m.group(1)),
+                "seq_len": int(m.group(2)),
+                "head_dim": 64,
+                "num_heads": 16,
+                "tasklets": None,
+                "host_ms": None,
+                "allocated": None,
+                "exp_type": "EXP_LONGSEQ",
+            }
+            continue
+
         m = exp_batch_re.search(line)
         if m:
             current = {
@@ -79,6 +111,34 @@ with open(LOGFILE, "r") as f:
             }
             continue
 
+        m = exp_hd_byte_re.search(line)
+        if m:
+            current = {
+                "batch": int(m.group(1)),
+                "seq_len": int(m.group(2)),
+                "head_dim": int(m.group(3)),
+                "num_heads": None,
+                "tasklets": None,
+                "host_ms": None,
+                "allocated": None,
+                "exp_type": "EXP_HD_BYTE",
+            }
+            continue
+
+        m = exp_sm_re.search(line)
+        if m:
+            current = {
+                "batch": int(m.group(2)),
+                "seq_len": int(m.group(3)),
+                "head_dim": 16,
+                "num_heads": 16,
+                "tasklets": None,
+                "host_ms": None,
+                "allocated": None,
+                "exp_type": m.group(1),
+            }
+            continue
+
         m = exp_nh_re.search(line)
         if m:
             current = {
@@ -100,13 +160,104 @@ with open(LOGFILE, "r") as f:
                 "seq_len": 64,
                 "head_dim": 32,
                 "num_heads": 16,
-                "tasklets": int(m.group(1)),
+                "tasklets": int(m.group(2)),
                 "host_ms": None,
                 "allocated": None,
-                "exp_type": "EXP_TL",
+                "exp_type": m.group(1),
             }
             continue
 
+        m = exp_prof_re.search(line)
+        if m:
+            current = {
+                "batch": int(m.group(1)),
+                "seq_len": int(m.group(2)),
+                "head_dim": 16,
+                "num_heads": 16,
+                "tasklets": 16,
+                "host_ms": None,
+                "allocated": None,
+                "exp_type": "EXP_PROFILE",
+            }
+            continue
+
+        # param: the swept value no other column holds.
+        m = exp_ragged_re.search(line)
+        if m:
+            current = {
+                "batch": int(m.group(1)),
+                "seq_len": int(m.group(2)),
+                "head_dim": 16,
+                "num_heads": 16,
+                "tasklets": 16,
+                "host_ms": None,
+                "allocated": None,
+                "param": int(m.group(3)),
+                "exp_type": "EXP_RAGGED",
+            }
+            continue
+
+        m = exp_gqa_re.search(line)
+        if m:
+            current = {
+                "batch": int(m.group(1)),
+                "seq_len": int(m.group(2)),
+                "head_dim": 16,
+                "num_heads": int(m.group(3)),
+                "tasklets": 16,
+                "host_ms": None,
+                "allocated": None,
+                "param": int(m.group(4)),
+                "exp_type": "EXP_GQA",
+            }
+            continue
+
+        m = exp_dpus_re.search(line)
+        if m:
+            current = {
+                "batch": int(m.group(1)),
+                "seq_len": int(m.group(2)),
+                "head_dim": 16,
+                "num_heads": 16,
+                "tasklets": 16,
+                "host_ms": None,
+                "allocated": None,
+                "param": int(m.group(3)),
+                "exp_type": "EXP_DPUS",
+            }
+            continue
+
+        m = exp_kv_re.search(line)
+        if m:
+            current = {
+                "batch": int(m.group(1)),
+                "seq_len": int(m.group(2)),
+                "head_dim": 64,
+                "num_heads": int(m.group(3)),
+                "tasklets": 16,
+                "host_ms": None,
+                "allocated": None,
+                "param": int(m.group(4)),
+                "exp_type": "EXP_KV_SPLIT",
+            }
+            continue
+
+        m = exp_any_re.search(line)
+        if m:
+            current = {"exp_type": None}
+            continue
+
+        m = profile_re.search(line)
+        if m and current.get("exp_type") == "EXP_PROFILE":
+            profile_rows.append({
+                "seq_len": current.get("seq_len"),
+                "phase": m.group(1),
+                "mean": float(m.group(2)),
+                "min": float(m.group(3)),
+                "max": float(m.group(4)),
+            })
+            continue
+
         m = alloc_re.search(line)
         if m and current.get("exp_type") is not None:
             try:
@@ -115,6 +266,11 @@ with open(LOGFILE, "r") as f:
                 current["allocated"] = None
             continue
 
+        m = e2e_re.search(line)
+        if m and current.get("exp_type") is not None:
+            current["e2e_ms"] = float(m.group(1))
+            continue
+
         m = host_re.search(line)
         if m and current.get("exp_type") is not None:
             try:
@@ -138,7 +294,9 @@ with open(LOGFILE, "r") as f:
                 "tasklets": current.get("tasklets"),
                 "host_ms": current.get("host_ms"),
                 "dpu_ms": dpu_ms,
+                "e2e_ms": current.get("e2e_ms"),
                 "allocated": current.get("allocated"),
+                "param": current.get("param"),
                 "exp_type": current.get("exp_type"),
             }
             rows.append(snapshot)
@@ -147,15 +305,22 @@ with open(LOGFILE, "r") as f:
 with open(CSVFILE, "w", newline="") as f:
     writer = csv.writer(f)
     writer.writerow(["batch", "seq_len", "head_dim", "num_heads", "tasklets",
-                     "host_ms", "dpu_ms", "allocated", "exp_type"])
+                     "host_ms", "dpu_ms", "e2e_ms", "allocated", "param", "exp_type"])
     for r in rows:
         writer.writerow([
             r.get("batch"), r.get("seq_len"), r.get("head_dim"), r.get("num_heads"),
-            r.get("tasklets"), r.get("host_ms"), r.get("dpu_ms"), r.get("allocated"),
-            r.get("exp_type")
+            r.get("tasklets"), r.get("host_ms"), r.get("dpu_ms"), r.get("e2e_ms"), r.get("allocated"),
+            r.get("param"), r.get("exp_type")
         ])
 print("CSV saved →", CSVFILE)
 
+with open(PROFILE_CSV, "w", newline="") as f:
+    writer = csv.writer(f)
+    writer.writerow(["seq_len", "phase", "mean_cycles", "min_cycles", "max_cycles"])
+    for r in profile_rows:
+        writer.writerow([r["seq_len"], r["phase"], r["mean"], r["min"], r["max"]])
+print("CSV saved →", PROFILE_CSV)
+
 def filter_rows(batch=None, seq=None, head_dim=None, num_heads=None, tasklets=None, exp_type=None):
     out = []
     for r in rows:
@@ -229,6 +394,45 @@ def plot_graph_from_rows(rows_list: List[Dict[str, Any]],
     plt.close()
     print("Saved", outpath)
 
+# DPU time per slot of two kernel variants over the same sweep, with the
+# speedup of the new one over the old one on top of its bars.
+def plot_variant_compare(new_rows: List[Dict[str, Any]],
+                         old_rows: List[Dict[str, Any]],
+                         x_key: str,
+                         xlabel: str,
+                         new_label: str,
+                         old_label: str,
+                         title: str,
+                         filename: str):
+    old_ms = {r.get(x_key): r.get("dpu_ms") for r in old_rows}
+    pairs = sorted((r.get(x_key), old_ms[r.get(x_key)], r.get("dpu_ms"))
+                   for r in new_rows if r.get(x_key) in old_ms)
+    if not pairs:
+        print(f"Skipping {title}: no data")
+        return
+
+    x_pos = np.arange(len(pairs))
+    plt.figure(figsize=(9,5))
+    plt.bar(x_pos - bar_offset, [p[1] for p in pairs], bar_width, label=f"{old_label} (ms)", color=COLOR_CPU)
+    new_bars = plt.bar(x_pos + bar_offset, [p[2] for p in pairs], bar_width, label=f"{new_label} (ms)", color=COLOR_DPU)
+    for (_, old, new), bar in zip(pairs, new_bars):
+        if old and new:
+            plt.text(bar.get_x() + bar.get_width()/2.0, bar.get_height(),
+                     f"{old / new:.2f}x", ha='center', va='bottom', fontsize=9)
+
+    plt.xticks(x_pos, [str(p[0]) for p in pairs])
+    plt.xlabel(xlabel)
+    plt.ylabel("DPU time per slot (ms)")
+    plt.title(title)
+    plt.legend()
+    plt.grid(axis='y', linestyle='--', alpha=0.35)
+
+    outpath = os.path.join(OUTDIR, filename)
+    plt.tight_layout()
+    plt.savefig(outpath)
+    plt.close()
+    print("Saved", outpath)
+
 # 1) SEQ 
 seq_rows = filter_rows(batch=128, exp_type="EXP_SEQ")
 plot_graph_from_rows(seq_rows,
@@ -239,6 +443,35 @@ plot_graph_from_rows(seq_rows,
                      use_log=False,
                      show_alloc=False)
 
+# 1b) SEQ, CPU vs the DPU kernel alone vs the DPU run end to end
+def plot_end_to_end(rows_list: List[Dict[str, Any]], x_key: str, xlabel: str, filename: str):
+    rows_sorted = sorted((r for r in rows_list if r.get("e2e_ms") is not None), key=lambda r: r.get(x_key))
+    if not rows_sorted:
+        print("Skipping end-to-end comparison: no data")
+        return
+    x_pos = np.arange(len(rows_sorted))
+    width = 0.26
+    plt.figure(figsize=(9,5))
+    plt.bar(x_pos - width, [r.get("host_ms") or np.nan for r in rows_sorted], width, label="CPU Host (ms)",
+            color=COLOR_CPU)
+    plt.bar(x_pos, [r.get("dpu_ms") for r in rows_sorted], width, label="UPMEM DPU kernel (ms)", color=COLOR_DPU)
+    plt.bar(x_pos + width, [r.get("e2e_ms") for r in rows_sorted], width,
+            label="UPMEM end to end (ms)", color="#5B8DEF")
+    plt.yscale("log")
+    plt.xticks(x_pos, [str(r.get(x_key)) for r in rows_sorted])
+    plt.xlabel(xlabel)
+    plt.ylabel("Time (ms) (log)")
+    plt.title("CPU vs UPMEM-PIM, end to end")
+    plt.legend()
+    plt.grid(axis='y', linestyle='--', alpha=0.35, which='both')
+    outpath = os.path.join(OUTDIR, filename)
+    plt.tight_layout()
+    plt.savefig(outpath)
+    plt.close()
+    print("Saved", outpath)
+
+plot_end_to_end(seq_rows, "seq_len", "SEQ_LEN", "seq_e2e_bar.png")
+
 # 2) BATCH 
 batch_rows = filter_rows(seq=128, exp_type="EXP_BATCH")
 plot_graph_from_rows(batch_rows,
@@ -279,4 +512,103 @@ plot_graph_from_rows(tl_rows,
                      use_log=False,
                      show_alloc=False)
 
+# 6) Long SEQ, tiled kernel
+long_rows = filter_rows(exp_type="EXP_LONGSEQ")
+plot_graph_from_rows(long_rows,
+                     x_key="seq_len",
+                     xlabel="SEQ_LEN (tiled kernel)",
+                     title="CPU vs UPMEM-PIM",
+                     filename="longseq_bar.png",
+                     use_log=True,
+                     show_alloc=False)
+
+# 7) Packed operands vs byte loads over HEAD_DIM
+plot_variant_compare(hd_rows, filter_rows(batch=128, seq=32, exp_type="EXP_HD_BYTE"),
+                     x_key="head_dim",
+                     xlabel="HEAD_DIM",
+                     new_label="Packed words",
+                     old_label="Byte loads",
+                     title="DPU kernels: byte loads vs packed int8 words",
+                     filename="headdim_operands_bar.png")
+
+# 8) Fused softmax vs a division per probability over SEQ_LEN
+plot_variant_compare(filter_rows(exp_type="EXP_SOFTMAX"), filter_rows(exp_type="EXP_SOFTMAX_DIV"),
+                     x_key="seq_len",
+                     xlabel="SEQ_LEN",
+                     new_label="Fused, reciprocal",
+                     old_label="Division per probability",
+                     title="DPU softmax: fused vs unfused",
+                     filename="softmax_seq_bar.png")
+
+# 9) Shared work counter vs fixed row ranges over NR_TASKLETS
+plot_variant_compare(tl_rows, filter_rows(exp_type="EXP_TL_STATIC"),
+                     x_key="tasklets",
+                     xlabel="NR_TASKLETS",
+                     new_label="Work counter",
+                     old_label="Fixed row ranges",
+                     title="DPU full kernel: tasklet scheduling",
+                     filename="tasklets_sched_bar.png")
+
+# 10) DPU phase breakdown over SEQ_LEN, mean cycles per tasklet stacked
+def plot_profile(profile: List[Dict[str, Any]], filename: str):
+    seqs = sorted({r["seq_len"] for r in profile})
+    if not seqs:
+        print("Skipping DPU phase profile: no data")
+        return
+    mean = {(r["seq_len"], r["phase"]): r["mean"] for r in profile}
+    x_pos = np.arange(len(seqs))
+    bottom = np.zeros(len(seqs))
+    plt.figure(figsize=(9,5))
+    for phase in PHASES:
+        y = np.array([mean.get((s, phase), 0.0) for s in seqs])
+        if not y.any():
+            continue
+        plt.bar(x_pos, y, 0.6, bottom=bottom, label=phase)
+        bottom += y
+    plt.xticks(x_pos, [str(s) for s in seqs])
+    plt.xlabel("SEQ_LEN")
+    plt.ylabel("Cycles per tasklet")
+    plt.title("DPU phase profile")
+    plt.legend()
+    plt.grid(axis='y', linestyle='--', alpha=0.35)
+    outpath = os.path.join(OUTDIR, filename)
+    plt.tight_layout()
+    plt.savefig(outpath)
+    plt.close()
+    print("Saved", outpath)
+
+plot_profile(profile_rows, "profile_seq_bar.png")
+
+# 11) Ragged batches over the shortest entry length
+plot_graph_from_rows(filter_rows(exp_type="EXP_RAGGED"),
+                     x_key="param",
+                     xlabel="MIN_LEN (ragged, SEQ_LEN=128)",
+                     title="CPU vs UPMEM-PIM, ragged batch",
+                     filename="ragged_bar.png",
+                     use_log=False,
+                     show_alloc=False)
+
+# 12) Grouped-query attention over the K/V heads
+plot_graph_from_rows(filter_rows(exp_type="EXP_GQA"),
+                     x_key="param",
+                     xlabel="KV_HEADS (NUM_HEADS=16)",
+                     title="CPU vs UPMEM-PIM, grouped-query attention",
+                     filename="gqa_bar.png",
+                     use_log=False,
+                     show_alloc=True)
+
+# 13) DPUs requested with -N, the bars labelled by the DPUs allocated
+plot_graph_from_rows(filter_rows(exp_type="EXP_DPUS"),
+                     x_key="param",
+                     xlabel="DPUs requested",
+                     title="CPU vs UPMEM-PIM, DPU count",
+                     filename="dpus_bar.png",
+                     use_log=False,
+                     show_alloc=True)
+
+# 14) K/V split over KV_PARTS; a split spends more DPUs on the same slots,
+# so its gain shows end to end, not in the DPU time per slot
+plot_end_to_end(filter_rows(exp_type="EXP_KV_SPLIT"), "param", "KV_PARTS (causal, SEQ_LEN=2048)",
+                "kv_split_e2e_bar.png")
+
 print("Done.")
\ No newline at end of file
@@ -1,127 +1,234 @@
 #!/bin/bash
 
-COMMON_H="common.h"
+MAX_TASKLETS=24
 LOGFILE="log.txt"
 
 echo "==== Experiment Log $(date) ====" > $LOGFILE
 
-update_macro() {
-    macro=$1
-    value=$2
-    sed -i "s/#define ${macro} .*/#define ${macro} ${value}/" $COMMON_H
-}
-
 compile_dpu() {
     echo "[*] Compiling dpu.c"
-    dpu-upmem-dpurte-clang -I/home/coslab/upmem-sdk/include -o dpus.mpo dpu.c >> $LOGFILE 2>&1
+    dpu-upmem-dpurte-clang -DNR_TASKLETS=${MAX_TASKLETS} -I/home/coslab/upmem-sdk/include -o dpus.mpo dpu.c >> $LOGFILE 2>&1
 }
 
 compile_host() {
-    echo "[*] Compiling host.c"
-    gcc -O2 -std=c11 -D_POSIX_C_SOURCE=199309L host.c \
+    echo "[*] Compiling host.c host_cpu.c host_trace.c"
+    gcc -O2 -std=c11 -D_POSIX_C_SOURCE=199309L -DNR_TASKLETS=${MAX_TASKLETS} host.c host_cpu.c host_trace.c \
         -I/home/coslab/upmem-sdk/include/dpu \
         -L/home/coslab/upmem-sdk/lib \
         -ldpu -lpthread -lm -o host >> $LOGFILE 2>&1
 }
 
+# Profiling build: per-phase DPU cycles, next to the regular binaries.
+compile_profile() {
+    echo "[*] Compiling dpus_prof.mpo and host_prof with -DMHA_PROFILE"
+    dpu-upmem-dpurte-clang -DMHA_PROFILE -DNR_TASKLETS=${MAX_TASKLETS} -I/home/coslab/upmem-sdk/include -o dpus_prof.mpo dpu.c >> $LOGFILE 2>&1
+    gcc -O2 -std=c11 -D_POSIX_C_SOURCE=199309L -DMHA_PROFILE -DDPU_BINARY=\"dpus_prof.mpo\" -DNR_TASKLETS=${MAX_TASKLETS} \
+        host.c host_cpu.c host_trace.c \
+        -I/home/coslab/upmem-sdk/include/dpu \
+        -L/home/coslab/upmem-sdk/lib \
+        -ldpu -lpthread -lm -o host_prof >> $LOGFILE 2>&1
+}
+
+# Benchmark harness: the host sources without their main, plus bench.c.
+compile_bench() {
+    echo "[*] Compiling bench.c host.c host_cpu.c host_trace.c"
+    gcc -O2 -std=c11 -D_POSIX_C_SOURCE=199309L -DMHA_NO_MAIN -DNR_TASKLETS=${MAX_TASKLETS} \
+        bench.c host.c host_cpu.c host_trace.c \
+        -I/home/coslab/upmem-sdk/include/dpu \
+        -L/home/coslab/upmem-sdk/lib \
+        -ldpu -lpthread -lm -o bench >> $LOGFILE 2>&1
+}
+
 run_host() {
-    echo "[*] Running ./host"
+    local host=${HOST:-./host}
+    echo "[*] Running $host $*"
     echo "---- RUN START ----" >> $LOGFILE
-    ./host >> $LOGFILE 2>&1
+    $host "$@" >> $LOGFILE 2>&1
     echo "---- RUN END ----" >> $LOGFILE
 }
 
-SEQ_LIST=(32 48 64 80 96 112 128)
+compile_dpu
+compile_host
+compile_profile
+compile_bench
 
-update_macro "BATCH_SIZE" 128
-update_macro "EMBED_DIM" 128
-update_macro "HEAD_DIM" 16
-update_macro "NUM_HEADS" 16
+SEQ_LIST=(32 48 64 80 96 112 128)
 
 for SEQ in "${SEQ_LIST[@]}"; do
-    update_macro "SEQ_LEN" $SEQ
-
     echo "===== Running SEQ_LEN=$SEQ (BATCH=128) ====="
     echo "[EXP_SEQ] BATCH=128, SEQ_LEN=${SEQ}" >> $LOGFILE
 
-    compile_dpu
-    compile_host
-    run_host
+    run_host -b 128 -s $SEQ -d 16 -n 16 -t 16 -J trace_seq${SEQ}.json
 
     echo "" >> $LOGFILE
 done
 
 BATCH_LIST=(32 48 64 80 96 112 128)
 
-update_macro "SEQ_LEN" 128
-
 for BATCH in "${BATCH_LIST[@]}"; do
-    update_macro "BATCH_SIZE" $BATCH
-
     echo "===== Running BATCH=$BATCH (SEQ=128) ====="
     echo "[EXP_BATCH] BATCH=${BATCH}, SEQ_LEN=128" >> $LOGFILE
 
-    compile_dpu
-    compile_host
-    run_host
+    run_host -b $BATCH -s 128 -d 16 -n 16 -t 16
 
     echo "" >> $LOGFILE
 done
 
 HEAD_DIM_LIST=(16 24 32 40 48 56 64)
 
-update_macro "BATCH_SIZE" 128
-update_macro "SEQ_LEN" 32
-
 for HD in "${HEAD_DIM_LIST[@]}"; do
-    update_macro "HEAD_DIM" $HD
-
     echo "===== Running HEAD_DIM=$HD ====="
     echo "[EXP_HD] BATCH=128, SEQ_LEN=32, HEAD_DIM=${HD}" >> $LOGFILE
 
-    compile_dpu
-    compile_host
-    run_host
+    run_host -b 128 -s 32 -d $HD -n 16 -t 16
 
     echo "" >> $LOGFILE
 done
 
-NUM_HEADS_LIST=(12 16 20 24 28 32)
+# Same sweep on the byte-per-load kernels, for the packed-operand speedup.
+for HD in "${HEAD_DIM_LIST[@]}"; do
+    echo "===== Running HEAD_DIM=$HD (byte kernels) ====="
+    echo "[EXP_HD_BYTE] BATCH=128, SEQ_LEN=32, HEAD_DIM=${HD}" >> $LOGFILE
 
-update_macro "BATCH_SIZE" 64
-update_macro "SEQ_LEN" 32
+    run_host -b 128 -s 32 -d $HD -n 16 -t 16 -L
 
-for NH in "${NUM_HEADS_LIST[@]}"; do
-    update_macro "NUM_HEADS" $NH
+    echo "" >> $LOGFILE
+done
+
+NUM_HEADS_LIST=(12 16 20 24 28 32)
 
+for NH in "${NUM_HEADS_LIST[@]}"; do
     echo "===== Running NUM_HEADS=$NH ====="
     echo "[EXP_NH] BATCH=64, SEQ_LEN=32, NUM_HEADS=${NH}" >> $LOGFILE
 
-    compile_dpu
-    compile_host
-    run_host
+    run_host -b 64 -s 32 -d 16 -n $NH -t 16
 
     echo "" >> $LOGFILE
 done
 
-TASKLET_LIST=(4 8 12 16 20 24)
+# Fused softmax (one reciprocal per row) against the division per
+# probability, with the error of both against a float softmax.
+for SEQ in "${SEQ_LIST[@]}"; do
+    echo "===== Running softmax SEQ_LEN=$SEQ ====="
+    echo "[EXP_SOFTMAX] BATCH=16, SEQ_LEN=${SEQ}" >> $LOGFILE
+    run_host -b 16 -s $SEQ -d 16 -n 16 -t 16 -A
+    echo "" >> $LOGFILE
 
-update_macro "BATCH_SIZE" 128
-update_macro "SEQ_LEN" 64
-update_macro "HEAD_DIM" 32
-update_macro "NUM_HEADS" 16
+    echo "[EXP_SOFTMAX_DIV] BATCH=16, SEQ_LEN=${SEQ}" >> $LOGFILE
+    run_host -b 16 -s $SEQ -d 16 -n 16 -t 16 -A -F
+    echo "" >> $LOGFILE
+done
 
-for NT in "${TASKLET_LIST[@]}"; do
-    update_macro "NR_TASKLETS" $NT
+LONG_SEQ_LIST=(128 256 512 1024 2048)
 
+for SEQ in "${LONG_SEQ_LIST[@]}"; do
+    echo "===== Running SEQ_LEN=$SEQ (BATCH=16, tiled) ====="
+    echo "[EXP_LONGSEQ] BATCH=16, SEQ_LEN=${SEQ}" >> $LOGFILE
+
+    run_host -b 16 -s $SEQ -d 64 -n 16 -t 16 -k tiled
+
+    echo "" >> $LOGFILE
+done
+
+TASKLET_LIST=(4 8 12 16 20 24)
+
+for NT in "${TASKLET_LIST[@]}"; do
     echo "===== Running NR_TASKLETS=$NT ====="
     echo "[EXP_TL] BATCH=128, SEQ_LEN=64, HEAD_DIM=32, NUM_HEADS=16, NR_TASKLETS=${NT}" >> $LOGFILE
 
-    compile_dpu
-    compile_host
-    run_host
+    run_host -b 128 -s 64 -d 32 -n 16 -t $NT
+
+    echo "[EXP_TL_STATIC] BATCH=128, SEQ_LEN=64, HEAD_DIM=32, NUM_HEADS=16, NR_TASKLETS=${NT}" >> $LOGFILE
+    run_host -b 128 -s 64 -d 32 -n 16 -t $NT -R
+
+    echo "" >> $LOGFILE
+done
+
+SLOTS_LIST=(1 2 4 8)
+
+for P in "${SLOTS_LIST[@]}"; do
+    echo "===== Running hybrid SLOTS_PER_DPU=$P ====="
+    echo "[EXP_HYBRID] BATCH=128, SEQ_LEN=128, SLOTS_PER_DPU=${P}" >> $LOGFILE
+
+    run_host -b 128 -s 128 -p $P -H
+
+    echo "" >> $LOGFILE
+done
+
+RAGGED_MIN_LIST=(128 64 16)
+
+for MIN in "${RAGGED_MIN_LIST[@]}"; do
+    echo "===== Running ragged MIN_LEN=$MIN ====="
+    echo "[EXP_RAGGED] BATCH=128, SEQ_LEN=128, SLOTS_PER_DPU=4, MIN_LEN=${MIN}" >> $LOGFILE
+
+    run_host -b 128 -s 128 -d 16 -n 16 -t 16 -p 4 -l $MIN
+
+    echo "" >> $LOGFILE
+done
+
+KV_HEADS_LIST=(16 4 1)
+
+for KV in "${KV_HEADS_LIST[@]}"; do
+    echo "===== Running grouped-query KV_HEADS=$KV ====="
+    echo "[EXP_GQA] BATCH=128, SEQ_LEN=128, NUM_HEADS=16, SLOTS_PER_DPU=16, KV_HEADS=${KV}" >> $LOGFILE
+
+    run_host -b 128 -s 128 -d 16 -n 16 -t 16 -p 16 -g $KV
+
+    echo "" >> $LOGFILE
+done
+
+KV_PARTS_LIST=(1 2 4 8 16)
+
+for K in "${KV_PARTS_LIST[@]}"; do
+    echo "===== Running K/V split KV_PARTS=$K ====="
+    echo "[EXP_KV_SPLIT] BATCH=1, SEQ_LEN=2048, NUM_HEADS=16, KV_PARTS=${K}" >> $LOGFILE
+
+    run_host -b 1 -s 2048 -d 64 -n 16 -t 16 -c -K $K
+
+    echo "" >> $LOGFILE
+done
+
+DPUS_LIST=(2048 1024 512 256)
+
+for N in "${DPUS_LIST[@]}"; do
+    echo "===== Running on DPUS=$N ====="
+    echo "[EXP_DPUS] BATCH=128, SEQ_LEN=128, DPUS=${N}" >> $LOGFILE
+
+    run_host -b 128 -s 128 -d 16 -n 16 -t 16 -N $N
+
+    echo "" >> $LOGFILE
+done
+
+# Serving: clients awaiting each reply, then Poisson arrivals at rising
+# offered loads, launches batching up to 128 requests.
+SERVE_RATE_LIST=(0 500 1000 2000 4000)
+
+for RATE in "${SERVE_RATE_LIST[@]}"; do
+    echo "===== Running serving RATE=$RATE ====="
+    echo "[EXP_SERVE] BATCH=128, SEQ_LEN=128, REQUESTS=2000, CLIENTS=16, RATE=${RATE}" >> $LOGFILE
+
+    run_host -b 128 -s 128 -d 16 -n 16 -t 16 -V 2000 -j 16 -i $RATE -w 2
+
+    echo "" >> $LOGFILE
+done
+
+for SEQ in "${SEQ_LIST[@]}"; do
+    echo "===== Running profile SEQ_LEN=$SEQ ====="
+    echo "[EXP_PROFILE] BATCH=128, SEQ_LEN=${SEQ}" >> $LOGFILE
+
+    HOST=./host_prof run_host -b 128 -s $SEQ -d 16 -n 16 -t 16
 
     echo "" >> $LOGFILE
 done
 
-echo "All experiments finished. Log saved to $LOGFILE"
\ No newline at end of file
+# Repeated runs of the main sweeps with percentiles, bench.csv and bench.json.
+# BENCH_PROFILE=backend=simulator runs them on the simulator instead.
+cat > bench_sweep.txt <<EOF
+seq=32,64,96,128 batch=128 head_dim=16 heads=16 tasklets=16
+seq=32 batch=128 head_dim=16,32,64 heads=16 tasklets=16
+seq=64 batch=128 head_dim=32 heads=16 tasklets=8,16,24
+EOF
+echo "===== Running benchmark sweep ====="
+./bench -r 10 -w 2 -o bench ${BENCH_PROFILE:+-Y $BENCH_PROFILE} bench_sweep.txt
+
+echo "All experiments finished. Log saved to $LOGFILE"
@@ -0,0 +1,314 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "host.h"
+
+// Benchmark harness: runs the host pipeline over a sweep of shapes, each
+// point warmed up and then repeated, and writes the distribution of every
+// stage as CSV and JSON. Build it from bench.c and the host sources with
+// -DMHA_NO_MAIN.
+//
+// A sweep file holds one sweep per line. Keys take comma separated values and
+// the line expands to their cross product; any other token is passed to the
+// host as is, and '#' starts a comment:
+//
+//   seq=32,64,128 batch=128 head_dim=16 heads=16 tasklets=8,16 -k full -c
+
+#define BENCH_MAX_TOKENS 64
+#define BENCH_MAX_VALUES 32
+#define BENCH_LINE_LEN 1024
+
+typedef struct {
+    const char *key;
+    const char *flag;
+} bench_axis_t;
+
+static const bench_axis_t axes[] = {
+    { "seq", "-s" }, { "batch", "-b" }, { "head_dim", "-d" }, { "heads", "-n" }, { "tasklets", "-t" }, { "slots", "-p" },
+};
+#define BENCH_AXES (sizeof(axes) / sizeof(axes[0]))
+
+// Stage times reported per point; transfer is push plus pull of the same run.
+static const char *metric_names[] = {
+    "e2e_ms", "alloc_ms", "load_ms", "push_ms", "launch_ms", "pull_ms", "unpack_ms", "transfer_ms", "dpu_ms", "host_ms",
+};
+#define BENCH_METRICS (sizeof(metric_names) / sizeof(metric_names[0]))
+
+static double metric_value(const mha_stats_t *s, uint32_t m) {
+    switch (m) {
+    case 0: return s->e2e_ms;
+    case 1: return s->alloc_ms;
+    case 2: return s->load_ms;
+    case 3: return s->push_ms;
+    case 4: return s->launch_ms;
+    case 5: return s->pull_ms;
+    case 6: return s->unpack_ms;
+    case 7: return s->push_ms + s->pull_ms;
+    case 8: return s->dpu_ms;
+    default: return s->host_ms;
+    }
+}
+
+typedef struct {
+    uint32_t reps;
+    uint32_t warmup;
+    const char *out;       // output prefix, <out>.csv and <out>.json
+    const char *profile;   // dpu_alloc profile forwarded to every run
+    bool verbose;
+} bench_config_t;
+
+static bench_config_t bcfg = { 5, 1, "bench", NULL, false };
+
+static FILE *csv, *json;
+static uint32_t npoints;
+
+static void json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') fputc('\\', f);
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+// One host run with its output discarded unless -v is given.
+static int run_quiet(int argc, char **argv, mha_stats_t *stats) {
+    if (bcfg.verbose) return mha_run(argc, argv, stats);
+
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    if (saved < 0 || devnull < 0) return mha_run(argc, argv, stats);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    int rc = mha_run(argc, argv, stats);
+
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    return rc;
+}
+
+// Warm-up runs, then bcfg.reps measured runs of one point, and its CSV row
+// and JSON object. A run that fails ends the point with what was measured.
+static void run_point(int argc, char **argv) {
+    char args[BENCH_LINE_LEN] = "";
+    for (int i = 1; i < argc; ++i) {
+        size_t len = strlen(args);
+        snprintf(args + len, sizeof(args) - len, "%s%s", i > 1 ? " " : "", argv[i]);
+    }
+    printf("[%u] %s: ", npoints, args);
+    fflush(stdout);
+
+    mha_stats_t stats;
+    int rc = 0;
+    for (uint32_t w = 0; w < bcfg.warmup && rc == 0; ++w)
+        rc = run_quiet(argc, argv, &stats);
+
+    double *samples = malloc((size_t)BENCH_METRICS * bcfg.reps * sizeof(double));
+    mha_stats_t first;
+    memset(&first, 0, sizeof(first));
+    uint32_t runs = 0;
+    bool ok = true;
+    for (; runs < bcfg.reps && rc == 0; ++runs) {
+        rc = run_quiet(argc, argv, &stats);
+        if (rc != 0) break;
+        if (runs == 0) first = stats;
+        ok = ok && stats.ok;
+        for (uint32_t m = 0; m < BENCH_METRICS; ++m)
+            samples[(size_t)m * bcfg.reps + runs] = metric_value(&stats, m);
+    }
+    if (runs == 0) ok = false;
+
+    double p50[BENCH_METRICS];
+    for (uint32_t m = 0; m < BENCH_METRICS; ++m) {
+        double *s = samples + (size_t)m * bcfg.reps;
+        mha_sort_samples(s, runs);
+        p50[m] = mha_percentile(s, runs, 50.0);
+    }
+    // Rates of the median run; transfer share is of the median end-to-end.
+    double tokens_per_s = p50[0] > 0.0 ? first.tokens / (p50[0] / 1e3) : 0.0;
+    double gops = p50[0] > 0.0 ? first.ops / (p50[0] / 1e3) / 1e9 : 0.0;
+    double transfer_share = p50[0] > 0.0 ? p50[7] / p50[0] : 0.0;
+
+    printf("%s, %u runs, e2e p50 %.3f ms, launch p50 %.3f ms, transfer %.1f%%\n",
+           rc != 0 ? "failed" : ok ? "ok" : "mismatch", runs, p50[0], p50[4], 100.0 * transfer_share);
+
+    fprintf(csv, "%u,\"%s\",%u,%u,%u,%u,%u,%u,%s,%u,%s,%u,%zu,%zu,%.1f,%.3f,%.4f", npoints, args, first.seq_len,
+            first.batch_size, first.head_dim, first.num_heads, first.nr_tasklets, first.slots_per_dpu,
+            first.kernel ? first.kernel : "", first.nr_dpus, rc != 0 ? "failed" : ok ? "ok" : "mismatch", runs,
+            first.push_bytes, first.pull_bytes, tokens_per_s, gops, transfer_share);
+    for (uint32_t m = 0; m < BENCH_METRICS; ++m) {
+        const double *s = samples + (size_t)m * bcfg.reps;
+        fprintf(csv, ",%.4f,%.4f,%.4f", p50[m], mha_percentile(s, runs, 90.0), mha_percentile(s, runs, 99.0));
+    }
+    fprintf(csv, "\n");
+
+    fprintf(json, "%s\n{\"point\":%u,\"args\":", npoints ? "," : "", npoints);
+    json_string(json, args);
+    fprintf(json, ",\"seq_len\":%u,\"batch_size\":%u,\"head_dim\":%u,\"num_heads\":%u,\"tasklets\":%u,"
+                  "\"slots_per_dpu\":%u,\"kernel\":", first.seq_len, first.batch_size, first.head_dim,
+            first.num_heads, first.nr_tasklets, first.slots_per_dpu);
+    json_string(json, first.kernel ? first.kernel : "");
+    fprintf(json, ",\"nr_dpus\":%u,\"status\":\"%s\",\"runs\":%u,\"push_bytes\":%zu,\"pull_bytes\":%zu,"
+                  "\"tokens_per_s\":%.1f,\"gops\":%.3f,\"transfer_share\":%.4f,\"metrics\":{",
+            first.nr_dpus, rc != 0 ? "failed" : ok ? "ok" : "mismatch", runs, first.push_bytes, first.pull_bytes,
+            tokens_per_s, gops, transfer_share);
+    for (uint32_t m = 0; m < BENCH_METRICS; ++m) {
+        const double *s = samples + (size_t)m * bcfg.reps;
+        double sum = 0.0;
+        for (uint32_t r = 0; r < runs; ++r) sum += s[r];
+        fprintf(json, "%s\"%s\":{\"min\":%.4f,\"p50\":%.4f,\"p90\":%.4f,\"p99\":%.4f,\"max\":%.4f,\"mean\":%.4f}",
+                m ? "," : "", metric_names[m], runs ? s[0] : 0.0, p50[m], mha_percentile(s, runs, 90.0),
+                mha_percentile(s, runs, 99.0), runs ? s[runs - 1] : 0.0, runs ? sum / runs : 0.0);
+    }
+    fprintf(json, "}}");
+
+    free(samples);
+    ++npoints;
+}
+
+// Expands one sweep line and runs its points, the last key varying fastest.
+static int run_sweep_line(char *line, uint32_t lineno) {
+    char *values[BENCH_AXES][BENCH_MAX_VALUES];
+    uint32_t nvalues[BENCH_AXES] = { 0 };
+    char *extra[BENCH_MAX_TOKENS];
+    uint32_t nextra = 0;
+
+    char *comment = strchr(line, '#');
+    if (comment) *comment = '\0';
+    for (char *tok = strtok(line, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+        char *eq = strchr(tok, '=');
+        if (tok[0] == '-' || eq == NULL) {
+            if (nextra == BENCH_MAX_TOKENS) {
+                fprintf(stderr, "Error: line %u has more than %d host arguments\n", lineno, BENCH_MAX_TOKENS);
+                return -1;
+            }
+            extra[nextra++] = tok;
+            continue;
+        }
+        *eq = '\0';
+        uint32_t a = 0;
+        while (a < BENCH_AXES && strcmp(axes[a].key, tok) != 0) ++a;
+        if (a == BENCH_AXES) {
+            fprintf(stderr, "Error: line %u: unknown key %s\n", lineno, tok);
+            return -1;
+        }
+        nvalues[a] = 0;
+        for (char *v = eq + 1, *next; v && *v; v = next) {
+            next = strchr(v, ',');
+            if (next) *next++ = '\0';
+            if (nvalues[a] == BENCH_MAX_VALUES) {
+                fprintf(stderr, "Error: line %u: more than %d values for %s\n", lineno, BENCH_MAX_VALUES, tok);
+                return -1;
+            }
+            values[a][nvalues[a]++] = v;
+        }
+    }
+
+    uint32_t given = 0;
+    for (uint32_t a = 0; a < BENCH_AXES; ++a) given += nvalues[a] > 0;
+    if (given == 0 && nextra == 0) return 0;
+
+    uint32_t idx[BENCH_AXES] = { 0 };
+    for (;;) {
+        char *argv[1 + 2 * BENCH_AXES + BENCH_MAX_TOKENS + 2];
+        int argc = 0;
+        argv[argc++] = "host";
+        for (uint32_t a = 0; a < BENCH_AXES; ++a) {
+            if (nvalues[a] == 0) continue;
+            argv[argc++] = (char *)axes[a].flag;
+            argv[argc++] = values[a][idx[a]];
+        }
+        for (uint32_t i = 0; i < nextra; ++i) argv[argc++] = extra[i];
+        if (bcfg.profile) {
+            argv[argc++] = "-Y";
+            argv[argc++] = (char *)bcfg.profile;
+        }
+        run_point(argc, argv);
+
+        int a = (int)BENCH_AXES - 1;
+        for (; a >= 0; --a) {
+            if (nvalues[a] == 0) continue;
+            if (++idx[a] < nvalues[a]) break;
+            idx[a] = 0;
+        }
+        if (a < 0) return 0;
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-r reps] [-w warmup] [-o prefix] [-Y profile] [-v] sweep.txt\n"
+            "  defaults: -r %u -w %u -o %s\n"
+            "  sweep lines: seq=, batch=, head_dim=, heads=, tasklets=, slots= take comma lists,\n"
+            "               other tokens are host options, e.g. 'seq=32,64 tasklets=8,16 -k tiled -c'\n"
+            "  -r: measured runs per point\n"
+            "  -w: discarded warm-up runs per point\n"
+            "  -o: writes <prefix>.csv and <prefix>.json\n"
+            "  -Y: dpu_alloc profile for every run, e.g. backend=simulator\n"
+            "  -v: keep the host output of every run\n",
+            prog, bcfg.reps, bcfg.warmup, bcfg.out);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "r:w:o:Y:vh")) != -1) {
+        switch (opt) {
+        case 'r': bcfg.reps = (uint32_t)atoi(optarg); break;
+        case 'w': bcfg.warmup = (uint32_t)atoi(optarg); break;
+        case 'o': bcfg.out = optarg; break;
+        case 'Y': bcfg.profile = optarg; break;
+        case 'v': bcfg.verbose = true; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 1 || bcfg.reps == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *spec = fopen(argv[optind], "r");
+    if (spec == NULL) {
+        fprintf(stderr, "Error: cannot open sweep %s\n", argv[optind]);
+        return 1;
+    }
+    char path[BENCH_LINE_LEN];
+    snprintf(path, sizeof(path), "%s.csv", bcfg.out);
+    csv = fopen(path, "w");
+    snprintf(path, sizeof(path), "%s.json", bcfg.out);
+    json = fopen(path, "w");
+    if (csv == NULL || json == NULL) {
+        fprintf(stderr, "Error: cannot write %s.csv and %s.json\n", bcfg.out, bcfg.out);
+        return 1;
+    }
+
+    fprintf(csv, "point,args,seq_len,batch_size,head_dim,num_heads,tasklets,slots_per_dpu,kernel,nr_dpus,status,runs,"
+                 "push_bytes,pull_bytes,tokens_per_s,gops,transfer_share");
+    for (uint32_t m = 0; m < BENCH_METRICS; ++m)
+        fprintf(csv, ",%s_p50,%s_p90,%s_p99", metric_names[m], metric_names[m], metric_names[m]);
+    fprintf(csv, "\n");
+    fprintf(json, "{\"reps\":%u,\"warmup\":%u,\"profile\":", bcfg.reps, bcfg.warmup);
+    json_string(json, bcfg.profile ? bcfg.profile : "");
+    fprintf(json, ",\"points\":[");
+
+    char line[BENCH_LINE_LEN];
+    uint32_t lineno = 0;
+    int rc = 0;
+    while (rc == 0 && fgets(line, sizeof(line), spec) != NULL)
+        rc = run_sweep_line(line, ++lineno);
+    fclose(spec);
+
+    fprintf(json, "\n]}\n");
+    fclose(csv);
+    fclose(json);
+    if (rc == 0) printf("%u points written to %s.csv and %s.json\n", npoints, bcfg.out, bcfg.out);
+    return rc != 0;
+}
@@ -5,32 +5,265 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+// Default workload. These are only the host defaults: every value can be
+// overridden on the host command line without rebuilding dpus.mpo.
 #define BATCH_SIZE 128
 
 #define EMBED_DIM 512
 #define SEQ_LEN 128
 #define HEAD_DIM 16
-#define NUM_HEADS 16   
+#define NUM_HEADS 16
 
-#define TOTAL_SLOTS (NUM_HEADS * BATCH_SIZE)
 #define SLOTS_PER_DPU 1
 
-#define NR_DPUS TOTAL_SLOTS
-
+// Tasklets compiled into dpus.mpo. The host may ask for fewer at runtime.
 #ifndef NR_TASKLETS
 #define NR_TASKLETS 16
 #endif
 
+// Query rows a full-kernel tasklet reads from MRAM at once. Binaries built
+// with another value are named after it, dpus_q<rows>.mpo.
+#ifndef Q_BLOCK_ROWS
+#define Q_BLOCK_ROWS 8
+#endif
+
+// Attention kernels. FULL keeps a slot's whole K/V in WRAM; TILED streams
+// KV_TILE_ROWS-row tiles from MRAM with an online softmax, so its WRAM use
+// does not depend on SEQ_LEN. DECODE attends one new query row per slot over
+// a K/V cache that stays resident in DPU_QKV across launches.
+#define MHA_KERNEL_FULL 0
+#define MHA_KERNEL_TILED 1
+#define MHA_KERNEL_DECODE 2
+
+// mha_shape_t.flags
+#define MHA_FLAG_CAUSAL (1u << 0)     // query row i only attends to keys 0..i
+#define MHA_FLAG_PROJECT (1u << 1)    // Q/K/V are projected on the DPU from DPU_X and DPU_W
+#define MHA_FLAG_SHARED_X (1u << 2)   // every local slot reads the embeddings of slot 0
+#define MHA_FLAG_PACKED (1u << 3)     // kernels read int8 operands as packed 64-bit words
+#define MHA_FLAG_V_TILED (1u << 4)    // V is stored as KV_TILE_ROWS-row tiles, each d-major
+#define MHA_FLAG_DIV_SOFTMAX (1u << 5) // unfused softmax, one division per probability
+#define MHA_FLAG_STATIC_ROWS (1u << 6) // full kernel: fixed row ranges instead of the shared work counter
+#define MHA_FLAG_RAGGED (1u << 7)     // slots have their own lengths, in DPU_SLOT_LENS
+#define MHA_FLAG_KV_SPLIT (1u << 8)   // slots hold the K/V rows of the kv_row0/kv_rows windows only
+
+// Profiling build, -DMHA_PROFILE on both host and DPU: cycles per tasklet
+// and phase in DPU_PROFILE. Every cycle of a kernel lands in one phase.
+#define MHA_PHASE_DMA 0        // MRAM reads of Q, K, V, X and W
+#define MHA_PHASE_QK 1
+#define MHA_PHASE_SOFTMAX 2    // exponentials and normalization
+#define MHA_PHASE_AV 3         // P.V, with the tiled kernel's online softmax tiles
+#define MHA_PHASE_WRITEBACK 4  // output rows, requantization and MRAM writes
+#define MHA_PHASE_PROJECT 5
+#define MHA_PHASE_BARRIER 6
+#define MHA_PHASE_OTHER 7      // work scheduling and loop overhead
+#define MHA_PHASES 8
+
+// Output row formats in DPU_RESULTS. The compact ones store each row as
+// int16/int8 values rounded down by a per-row power-of-two shift, followed
+// by an 8-byte trailer holding that shift. A K/V split returns partial rows:
+// the int32 V sums, unnormalized, and a trailer of the row max and exp sum.
+#define MHA_OUT_INT32 0
+#define MHA_OUT_INT16 1
+#define MHA_OUT_INT8 2
+#define MHA_OUT_PARTIAL 3
+
+// Query rows the full kernel's micro-kernels score and accumulate together,
+// so every K/V word loaded from WRAM serves that many rows.
+#define MAX_ROW_BLOCK 4
+
+#ifndef KV_TILE_ROWS
+#define KV_TILE_ROWS 32
+#endif
+#ifndef TILE_Q_ROWS
+#define TILE_Q_ROWS 2
+#endif
+
+// Capacity of one DPU binary. A shape is accepted as long as its slots fit
+// in the MRAM tensors and its buffers fit in the WRAM heap.
+#ifndef MRAM_TENSOR_BYTES
+#define MRAM_TENSOR_BYTES (4 << 20)
+#endif
+#define MAX_SLOTS_PER_DPU 64
+
+#define MRAM_DMA_MAX 2048
+
+#define WRAM_SIZE (64 << 10)
+#ifndef STACK_SIZE_DEFAULT
+#define STACK_SIZE_DEFAULT 1024
+#endif
+#define WRAM_RESERVED 4096
+#define WRAM_HEAP_BYTES (WRAM_SIZE - NR_TASKLETS * STACK_SIZE_DEFAULT - WRAM_RESERVED)
+
 #define QK_SCALE 127
 #define V_SCALE 127
 
+// Per-DPU launch descriptor, written by the host to DPU_SHAPE. In a ragged
+// launch seq_len is the longest slot and local slot ls holds
+// DPU_SLOT_LENS[ls] rows; slots are packed back to back, Q, K and V of a
+// slot after each other, and so are their output rows. With kv_group > 1,
+// every kv_group consecutive local slots are query heads of one K/V head and
+// have the same length: their Q follow each other, then the single K and V.
+// With MHA_FLAG_KV_SPLIT, a slot's Q has all its rows but its K and V only
+// two windows, kv_rows[w] rows from kv_row0[w] on, stored back to back, and
+// its outputs are MHA_OUT_PARTIAL rows.
 typedef struct {
-    int32_t out[SEQ_LEN * HEAD_DIM];  
-    uint64_t cycles;
-} mha_result_t;
+    uint32_t seq_len;
+    uint32_t head_dim;
+    uint32_t nslots;       // slots resident on this DPU
+    uint32_t slot0;        // global index of the first local slot
+    uint32_t nr_tasklets;  // active tasklets, 0 means NR_TASKLETS
+    uint32_t kernel;       // MHA_KERNEL_*
+    uint32_t flags;        // MHA_FLAG_*
+    uint32_t pos;          // decode: cache row the new token is appended at; a ragged
+                           // slot of len rows appends at pos - (seq_len - len)
+    uint32_t embed_dim;    // projection: columns of the DPU_X rows
+    uint32_t proj_shift;   // projection: right shift requantizing X*W to int8
+    uint32_t out_format;   // MHA_OUT_*
+    uint32_t row_block;    // full kernel: query rows per micro-kernel block, 0 means 1
+    uint32_t lut_shift;    // score units per exp LUT entry, as a power of two
+    uint32_t kv_group;     // local slots sharing each K/V, 0 means 1
+    uint32_t kv_row0[2];   // K/V split: first sequence row of each window held
+    uint32_t kv_rows[2];   // K/V split: rows of each window, the second after the first
+} mha_shape_t;
 
-typedef struct {
-    mha_result_t heads[TOTAL_SLOTS];
-} mha_results_t;
+static inline uint32_t mha_round_up8(uint32_t x) { return (x + 7) & ~7u; }
+
+// WRAM scratch of one tasklet: row_block score rows, softmax rows and
+// output rows, plus the Q block of q_rows rows.
+static inline uint32_t mha_tasklet_wram_bytes(uint32_t seq_len, uint32_t head_dim, uint32_t row_block,
+                                              uint32_t q_rows) {
+    return row_block * (mha_round_up8(seq_len * sizeof(int32_t)) +
+                        mha_round_up8(seq_len) +
+                        mha_round_up8(head_dim * sizeof(int32_t))) +
+           mha_round_up8(q_rows * head_dim);
+}
 
-#endif 
+// Heap the DPU allocates for a shape: shared K/V (double-buffered when more
+// than one slot is resident) plus per-tasklet scratch.
+static inline uint32_t mha_wram_bytes(uint32_t seq_len, uint32_t head_dim, uint32_t nr_tasklets, uint32_t nslots,
+                                      uint32_t row_block, uint32_t q_rows) {
+    uint32_t kv_buffers = nslots > 1 ? 2 : 1;
+    return kv_buffers * 2 * mha_round_up8(seq_len * head_dim) +
+           nr_tasklets * mha_tasklet_wram_bytes(seq_len, head_dim, row_block, q_rows);
+}
+
+// Default row block by HEAD_DIM. Narrow heads keep four query rows' words
+// and accumulators in registers next to the K/V word; wide heads grow the
+// per-tasklet output rows, so two.
+static inline uint32_t mha_row_block(uint32_t head_dim) {
+    return head_dim <= 32 ? 4 : 2;
+}
+
+// Tiled kernel, per tasklet: Q rows, one score tile row, V accumulators.
+static inline uint32_t mha_tiled_tasklet_wram_bytes(uint32_t head_dim) {
+    return mha_round_up8(TILE_Q_ROWS * head_dim) +
+           KV_TILE_ROWS * sizeof(int32_t) +
+           TILE_Q_ROWS * head_dim * sizeof(int32_t);
+}
+
+// Tiled kernel: double-buffered K/V tiles plus per-tasklet scratch.
+static inline uint32_t mha_tiled_wram_bytes(uint32_t head_dim, uint32_t nr_tasklets) {
+    return 2 * 2 * mha_round_up8(KV_TILE_ROWS * head_dim) +
+           nr_tasklets * mha_tiled_tasklet_wram_bytes(head_dim);
+}
+
+// Exp LUT: entry i holds 255*exp(-x) for a logit x = i << lut_shift score
+// units below the row max, entry 0 being 255. Scores past the table land on
+// its last entry.
+static inline uint8_t mha_lut_exp(const uint8_t *lut, int32_t below_max, uint32_t lut_shift) {
+    uint32_t idx = (uint32_t)below_max >> lut_shift;
+    return lut[idx > 255 ? 255 : idx];
+}
+
+// Softmax normalization by one fixed-point reciprocal per row instead of a
+// division per element: acc * 255 / sum, rounded down.
+static inline uint32_t mha_softmax_recip(int32_t sum) {
+    return sum > 0 ? (255u << 16) / (uint32_t)sum : 0;
+}
+
+static inline int32_t mha_softmax_norm(int32_t acc, uint32_t recip) {
+    return (int32_t)(((int64_t)acc * recip) >> 16);
+}
+
+// Projection output: int32 dot product of an X row and a W column brought
+// back to the int8 range of the attention inputs.
+static inline int8_t mha_requant(int32_t acc, uint32_t shift) {
+    int32_t v = acc >> shift;
+    if (v > 127) v = 127;
+    if (v < -127) v = -127;
+    return (int8_t)v;
+}
+
+static inline uint32_t mha_out_row_bytes(uint32_t head_dim, uint32_t out_format) {
+    if (out_format == MHA_OUT_INT16) return head_dim * sizeof(int16_t) + 8;
+    if (out_format == MHA_OUT_INT8) return head_dim + 8;
+    if (out_format == MHA_OUT_PARTIAL) return head_dim * sizeof(int32_t) + 8;
+    return head_dim * sizeof(int32_t);
+}
+
+static inline int32_t mha_out_qmax(uint32_t out_format) {
+    return out_format == MHA_OUT_INT8 ? 127 : 32767;
+}
+
+// Smallest shift bringing max_abs, rounded, into [-qmax, qmax], so that no
+// value of the row is clamped.
+static inline uint32_t mha_out_shift(int32_t max_abs, int32_t qmax) {
+    uint32_t shift = 0;
+    while ((((int64_t)max_abs + (shift ? 1 << (shift - 1) : 0)) >> shift) > qmax) ++shift;
+    return shift;
+}
+
+// Round-to-nearest right shift, clamped to the format.
+static inline int32_t mha_out_quant(int32_t v, uint32_t shift, int32_t qmax) {
+    if (shift) v = (int32_t)(((int64_t)v + (1 << (shift - 1))) >> shift);
+    if (v > qmax) v = qmax;
+    if (v < -qmax) v = -qmax;
+    return v;
+}
+
+// K/V split of seq_len rows over nparts DPUs: part j gets an even share of
+// the tiles, the first half of it from the start of the sequence after the
+// early windows of parts 0..j-1 and the rest from the end before the late
+// windows of parts 0..j-1, so that under a causal mask every part has about
+// the same (query, key) pairs. The first window holds whole tiles and is
+// never empty while nparts is at most the tiles; rows[1] may be 0.
+static inline void mha_kv_windows(uint32_t j, uint32_t nparts, uint32_t seq_len, uint32_t row0[2],
+                                  uint32_t rows[2]) {
+    const uint32_t tiles = (seq_len + KV_TILE_ROWS - 1) / KV_TILE_ROWS;
+    uint32_t early = 0, late = tiles, n = 0;
+    for (uint32_t i = 0; i <= j; ++i) {
+        early += (n + 1) / 2;
+        n = (uint32_t)((uint64_t)tiles * (i + 1) / nparts - (uint64_t)tiles * i / nparts);
+        late -= n / 2;
+    }
+    const uint32_t end[2] = { (early + (n + 1) / 2) * KV_TILE_ROWS, (late + n / 2) * KV_TILE_ROWS };
+    row0[0] = early * KV_TILE_ROWS;
+    row0[1] = late * KV_TILE_ROWS < seq_len ? late * KV_TILE_ROWS : seq_len;
+    for (int w = 0; w < 2; ++w)
+        rows[w] = (end[w] < seq_len ? end[w] : seq_len) - row0[w];
+}
+
+// Projection: group_cols columns of W^T shared by all tasklets, plus one X
+// row and the group's outputs per tasklet.
+static inline uint32_t mha_proj_wram_bytes(uint32_t embed_dim, uint32_t group_cols, uint32_t nr_tasklets) {
+    return mha_round_up8(group_cols * embed_dim) +
+           nr_tasklets * (mha_round_up8(embed_dim) + group_cols);
+}
+
+// Widest multiple of 8 output columns, at most head_dim, whose projection
+// buffers fit the heap; 0 when not even 8 do.
+static inline uint32_t mha_proj_group_cols(uint32_t embed_dim, uint32_t head_dim, uint32_t nr_tasklets) {
+    for (uint32_t g = head_dim; g >= 8; g -= 8)
+        if (mha_proj_wram_bytes(embed_dim, g, nr_tasklets) <= WRAM_HEAP_BYTES) return g;
+    return 0;
+}
+
+// Decode kernel: the score row of one slot, its q row, and per tasklet one
+// K or V tile plus a partial V accumulator.
+static inline uint32_t mha_decode_wram_bytes(uint32_t seq_len, uint32_t head_dim, uint32_t nr_tasklets) {
+    return mha_round_up8(seq_len * sizeof(int32_t)) +
+           mha_round_up8(head_dim) +
+           nr_tasklets * (mha_round_up8(KV_TILE_ROWS * head_dim) + mha_round_up8(head_dim * sizeof(int32_t)));
+}
+
+#endif
@@ -5,33 +5,268 @@
 #include <mram.h>
 #include <alloc.h>
 #include <barrier.h>
+#include <mutex.h>
 #include <perfcounter.h>
 
 #include "common.h"
 
-__mram_noinit int8_t DPU_Q[SLOTS_PER_DPU * SEQ_LEN * HEAD_DIM];
-__mram_noinit int8_t DPU_K[SLOTS_PER_DPU * SEQ_LEN * HEAD_DIM];
-__mram_noinit int8_t DPU_V[SLOTS_PER_DPU * SEQ_LEN * HEAD_DIM];
+// Slot-major payload: Q, K and V of local slot 0, then of slot 1, ... A
+// group of slots sharing K/V stores the Q of each, then K and V once.
+__mram_noinit int8_t DPU_QKV[3 * MRAM_TENSOR_BYTES];
 
 __mram_noinit uint8_t DPU_EXP_LUT[256];
-__mram_noinit mha_result_t DPU_RESULTS[SLOTS_PER_DPU];
+__mram_noinit int32_t DPU_RESULTS[MRAM_TENSOR_BYTES];
+__mram_noinit uint64_t DPU_CYCLES[MAX_SLOTS_PER_DPU];
 
-__mram_noinit uint64_t DPU_NHEADS64;
-__mram_noinit uint64_t DPU_HEAD0_64;
+__mram_noinit mha_shape_t DPU_SHAPE;
 
-BARRIER_INIT(my_barrier, NR_TASKLETS);
+// Rows of every local slot of a ragged launch (MHA_FLAG_RAGGED).
+__mram_noinit uint32_t DPU_SLOT_LENS[MAX_SLOTS_PER_DPU];
+
+// Per tasklet, the cycles spent waiting at barriers, then after NR_TASKLETS
+// entries the cycles of the whole launch.
+__mram_noinit uint64_t DPU_TASKLET_CYCLES[2 * NR_TASKLETS];
+
+#ifdef MHA_PROFILE
+// MHA_PHASES cycle counters per tasklet.
+__mram_noinit uint64_t DPU_PROFILE[NR_TASKLETS * MHA_PHASES];
+#endif
 
-static inline size_t round_up8(size_t x) { return (x + 7) & ~((size_t)7); }
+// Projection inputs: SEQ_LEN x EMBED_DIM embeddings per local slot, and per
+// local slot W_q, W_k, W_v transposed (HEAD_DIM rows of EMBED_DIM each).
+// The weights are written once and stay resident across launches.
+__mram_noinit int8_t DPU_X[2 * MRAM_TENSOR_BYTES];
+__mram_noinit int8_t DPU_W[MRAM_TENSOR_BYTES];
 
-static int8_t K_shared[SEQ_LEN * HEAD_DIM] __attribute__((aligned(8)));
-static int8_t V_shared[SEQ_LEN * HEAD_DIM] __attribute__((aligned(8)));
+// Decode step input: the new token's q, k and v rows of local slot 0, then
+// of slot 1, ... A row is at most one DMA.
+__mram_noinit int8_t DPU_STEP[3 * MAX_SLOTS_PER_DPU * MRAM_DMA_MAX];
+
+BARRIER_INIT(my_barrier, NR_TASKLETS);
+MUTEX_INIT(work_mutex);
+
+static mha_shape_t shape;
+static int8_t *K_buf[2];
+static int8_t *V_buf[2];
+static uint8_t *tasklet_scratch;
 static uint8_t LUT_shared[256] __attribute__((aligned(8)));
+static uint64_t slot_cycles[MAX_SLOTS_PER_DPU] __attribute__((aligned(8)));
+static int32_t *decode_scores;
+static int8_t *decode_q;
+static int32_t part_max[NR_TASKLETS];
+static int32_t part_sum[NR_TASKLETS];
+static int8_t *proj_w;
+static uint64_t proj_cycles[MAX_SLOTS_PER_DPU];
+static uint64_t tasklet_cycles[2 * NR_TASKLETS] __attribute__((aligned(8)));
+static uint32_t work_next[MAX_SLOTS_PER_DPU];
+
+// Rows of every local slot and where they start: its Q at row slot_q_row[ls]
+// of DPU_QKV, its K at row slot_k_row[ls] followed by V, and its outputs at
+// row slot_row0[ls] of DPU_RESULTS. Every slot has SEQ_LEN rows unless the
+// launch is ragged.
+static uint32_t slot_len[MAX_SLOTS_PER_DPU] __attribute__((aligned(8)));
+static uint32_t slot_row0[MAX_SLOTS_PER_DPU];
+static uint32_t slot_q_row[MAX_SLOTS_PER_DPU];
+static uint32_t slot_k_row[MAX_SLOTS_PER_DPU];
 
-#ifndef Q_BLOCK_ROWS
-#define Q_BLOCK_ROWS 8
+// PROFILE_PHASE charges the cycles since the tasklet's previous mark to a
+// phase; each kernel sets the first mark once its counter runs.
+#ifdef MHA_PROFILE
+static uint64_t profile[NR_TASKLETS][MHA_PHASES] __attribute__((aligned(8)));
+static uint64_t profile_mark[NR_TASKLETS];
+#define PROFILE_START(tid) (profile_mark[tid] = perfcounter_get())
+#define PROFILE_PHASE(tid, phase)                              \
+    do {                                                       \
+        uint64_t now_ = perfcounter_get();                     \
+        profile[tid][phase] += now_ - profile_mark[tid];       \
+        profile_mark[tid] = now_;                              \
+    } while (0)
+#else
+#define PROFILE_START(tid) ((void)0)
+#define PROFILE_PHASE(tid, phase) ((void)0)
 #endif
 
-void dpu_matmul_score_row(const int8_t *q_row, const int8_t *k_full, int32_t *score_row, int seq_len, int dim) {
+// Barrier of the compute phases, once the cycle counter runs: the wait is
+// charged to the tasklet as idle time.
+static void sync_tasklets(unsigned int tid) {
+    PROFILE_PHASE(tid, MHA_PHASE_OTHER);
+    uint64_t t0 = perfcounter_get();
+    barrier_wait(&my_barrier);
+    tasklet_cycles[tid] += perfcounter_get() - t0;
+    PROFILE_PHASE(tid, MHA_PHASE_BARRIER);
+}
+
+// Every kernel restarts the counter, so each adds its own length.
+static void end_phase(unsigned int tid) {
+    PROFILE_PHASE(tid, MHA_PHASE_OTHER);
+    tasklet_cycles[NR_TASKLETS + tid] += perfcounter_get();
+}
+
+// K/V rows of local slot ls; a K/V split holds the shape.kv_rows windows of
+// every slot.
+static inline uint32_t kv_len(uint32_t ls) {
+    return (shape.flags & MHA_FLAG_KV_SPLIT) ? shape.kv_rows[0] + shape.kv_rows[1] : slot_len[ls];
+}
+
+// Rows [row0, row0+nrows) of a slot's K and V are cut into DMA-sized chunks
+// dealt round-robin to the active tasklets, so a prefetch never serializes
+// behind a single tasklet. A NULL destination skips that tensor.
+static void load_kv_rows(uint32_t ls, uint32_t row0, uint32_t nrows, int8_t *k_dst, int8_t *v_dst,
+                         unsigned int tid, uint32_t nr_active) {
+    size_t slot_bytes = (size_t)kv_len(ls) * shape.head_dim;
+    size_t bytes = (size_t)nrows * shape.head_dim;
+    size_t nchunks = (bytes + MRAM_DMA_MAX - 1) / MRAM_DMA_MAX;
+    __mram_ptr int8_t const *k_src = DPU_QKV + ((size_t)slot_k_row[ls] + row0) * shape.head_dim;
+
+    for (size_t c = tid; c < 2 * nchunks; c += nr_active) {
+        bool is_v = c >= nchunks;
+        size_t off = (is_v ? c - nchunks : c) * MRAM_DMA_MAX;
+        size_t chunk = bytes - off;
+        if (chunk > MRAM_DMA_MAX) chunk = MRAM_DMA_MAX;
+
+        int8_t *dst = is_v ? v_dst : k_dst;
+        if (!dst) continue;
+
+        __mram_ptr int8_t const *src = k_src + (is_v ? slot_bytes : 0) + off;
+        mram_read((__mram_ptr void const*)src, dst + off, chunk);
+    }
+}
+
+// Contiguous MRAM range cut into DMA-sized chunks dealt round-robin to the
+// active tasklets.
+static void load_mram(__mram_ptr int8_t const *src, int8_t *dst, size_t bytes, unsigned int tid, uint32_t nr_active) {
+    size_t nchunks = (bytes + MRAM_DMA_MAX - 1) / MRAM_DMA_MAX;
+    for (size_t c = tid; c < nchunks; c += nr_active) {
+        size_t off = c * MRAM_DMA_MAX;
+        size_t chunk = bytes - off;
+        if (chunk > MRAM_DMA_MAX) chunk = MRAM_DMA_MAX;
+        mram_read((__mram_ptr void const*)(src + off), dst + off, chunk);
+    }
+}
+
+// LUT exponential of v = score - max <= 0.
+static inline uint8_t lut_exp(const uint8_t *lut, int32_t v) {
+    return mha_lut_exp(lut, -v, shape.lut_shift);
+}
+
+// Stores output row row_idx of DPU_RESULTS in shape.out_format. Compact
+// formats are packed in place: value i moves from byte 4*i down to byte
+// i*size, which is never ahead of the reads, and the shift trailer lands
+// after the values.
+static void write_out_row(int32_t *row, size_t row_idx) {
+    const uint32_t head_dim = shape.head_dim;
+    const uint32_t fmt = shape.out_format;
+    const uint32_t rec_bytes = mha_out_row_bytes(head_dim, fmt);
+    __mram_ptr uint8_t *dst = (__mram_ptr uint8_t*)DPU_RESULTS + row_idx * rec_bytes;
+
+    if (fmt != MHA_OUT_INT32) {
+        const int32_t qmax = mha_out_qmax(fmt);
+        int32_t max_abs = 0;
+        for (uint32_t d = 0; d < head_dim; ++d) {
+            int32_t a = row[d] < 0 ? -row[d] : row[d];
+            if (a > max_abs) max_abs = a;
+        }
+        uint32_t shift = mha_out_shift(max_abs, qmax);
+
+        // Byte stores keep the in-place repacking free of aliasing.
+        uint8_t *packed = (uint8_t*)row;
+        for (uint32_t d = 0; d < head_dim; ++d) {
+            int32_t q = mha_out_quant(row[d], shift, qmax);
+            if (fmt == MHA_OUT_INT8) {
+                packed[d] = (uint8_t)(int8_t)q;
+            } else {
+                int16_t q16 = (int16_t)q;
+                memcpy(packed + 2 * d, &q16, sizeof(q16));
+            }
+        }
+        uint32_t trailer[2] = { shift, 0 };
+        memcpy(packed + rec_bytes - 8, trailer, sizeof(trailer));
+    }
+    mram_write(row, (__mram_ptr void*)dst, rec_bytes);
+}
+
+// Stores partial row row_idx of a K/V split: the unnormalized V sums, then
+// the row max and exp sum the host merges the parts by.
+static void write_partial_row(const int32_t *acc, int32_t row_max, int32_t row_sum, size_t row_idx) {
+    const uint32_t head_dim = shape.head_dim;
+    __mram_ptr uint8_t *dst = (__mram_ptr uint8_t*)DPU_RESULTS + row_idx * mha_out_row_bytes(head_dim, MHA_OUT_PARTIAL);
+    int32_t trailer[2] __attribute__((aligned(8))) = { row_max, row_sum };
+    mram_write(acc, (__mram_ptr void*)dst, head_dim * sizeof(int32_t));
+    mram_write(trailer, (__mram_ptr void*)(dst + head_dim * sizeof(int32_t)), sizeof(trailer));
+}
+
+// Packed operands. Rows start 8-byte aligned in WRAM and HEAD_DIM is a
+// multiple of 8, so int8 rows are read as 64-bit words and every byte of a
+// 32-bit half feeds one of the DPU's 8x8 multiplies (mul_sl_sl, mul_sh_sh,
+// mul_ul_sl, ...) without a load of its own.
+static inline int32_t dot4_ss(uint32_t a, uint32_t b) {
+    return (int8_t)a * (int8_t)b + (int8_t)(a >> 8) * (int8_t)(b >> 8) +
+           (int8_t)(a >> 16) * (int8_t)(b >> 16) + (int8_t)(a >> 24) * (int8_t)(b >> 24);
+}
+
+static inline int32_t dot4_us(uint32_t p, uint32_t v) {
+    return (uint8_t)p * (int8_t)v + (uint8_t)(p >> 8) * (int8_t)(v >> 8) +
+           (uint8_t)(p >> 16) * (int8_t)(v >> 16) + (uint8_t)(p >> 24) * (int8_t)(v >> 24);
+}
+
+static inline uint64_t load_word(const void *p) {
+    uint64_t w;
+    memcpy(&w, __builtin_assume_aligned(p, 8), sizeof(w));
+    return w;
+}
+
+// a . b over n int8 values, n a multiple of 8.
+static inline int32_t dot_s8_packed(const int8_t *a, const int8_t *b, uint32_t n) {
+    int32_t acc = 0;
+    for (uint32_t i = 0; i < n; i += 8) {
+        uint64_t x = load_word(a + i), y = load_word(b + i);
+        acc += dot4_ss((uint32_t)x, (uint32_t)y) + dot4_ss((uint32_t)(x >> 32), (uint32_t)(y >> 32));
+    }
+    return acc;
+}
+
+// p . v over n values, any n.
+static inline int32_t dot_u8_packed(const uint8_t *p, const int8_t *v, uint32_t n) {
+    int32_t acc = 0;
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t x = load_word(p + i), y = load_word(v + i);
+        acc += dot4_us((uint32_t)x, (uint32_t)y) + dot4_us((uint32_t)(x >> 32), (uint32_t)(y >> 32));
+    }
+    for (; i < n; ++i) acc += (int32_t)p[i] * (int32_t)v[i];
+    return acc;
+}
+
+// acc += p * v over n int8 values, n a multiple of 8.
+static inline void axpy_s8_packed(uint8_t p, const int8_t *v, int32_t *acc, uint32_t n) {
+    for (uint32_t i = 0; i < n; i += 8) {
+        uint64_t x = load_word(v + i);
+        uint32_t lo = (uint32_t)x, hi = (uint32_t)(x >> 32);
+        acc[i + 0] += p * (int8_t)lo;
+        acc[i + 1] += p * (int8_t)(lo >> 8);
+        acc[i + 2] += p * (int8_t)(lo >> 16);
+        acc[i + 3] += p * (int8_t)(lo >> 24);
+        acc[i + 4] += p * (int8_t)hi;
+        acc[i + 5] += p * (int8_t)(hi >> 8);
+        acc[i + 6] += p * (int8_t)(hi >> 16);
+        acc[i + 7] += p * (int8_t)(hi >> 24);
+    }
+}
+
+// How the attention kernels read Q/K/V, from shape.flags: one byte per
+// multiply, packed words with row-major V, or packed words with V tiles
+// stored d-major so the output row is a dot product per dimension.
+enum { OPS_BYTE, OPS_PACKED, OPS_PACKED_VT };
+
+static inline int shape_ops(void) {
+    if (!(shape.flags & MHA_FLAG_PACKED)) return OPS_BYTE;
+    return (shape.flags & MHA_FLAG_V_TILED) ? OPS_PACKED_VT : OPS_PACKED;
+}
+
+// The score kernels return the row max, so the softmax does not need a
+// pass of its own to find it.
+int32_t dpu_matmul_score_row(const int8_t *q_row, const int8_t *k_full, int32_t *score_row, int seq_len, int dim) {
+    int32_t row_max = INT32_MIN;
     for (int j = 0; j < seq_len; ++j) {
         const int8_t *kv = k_full + (size_t)j * dim;
         int32_t acc = 0;
@@ -39,27 +274,56 @@ void dpu_matmul_score_row(const int8_t *q_row, const int8_t *k_full, int32_t *sc
         for (int d = 0; d < dim; ++d)
             acc += (int32_t)q_row[d] * (int32_t)kv[d];
         score_row[j] = acc;
+        if (acc > row_max) row_max = acc;
     }
+    return row_max;
 }
 
+int32_t dpu_matmul_score_row_packed(const int8_t *q_row, const int8_t *k_full, int32_t *score_row, int seq_len, int dim) {
+    int32_t row_max = INT32_MIN;
+    for (int j = 0; j < seq_len; ++j) {
+        int32_t acc = dot_s8_packed(q_row, k_full + (size_t)j * dim, dim);
+        score_row[j] = acc;
+        if (acc > row_max) row_max = acc;
+    }
+    return row_max;
+}
+
+// Unfused softmax (MHA_FLAG_DIV_SOFTMAX): max, LUT exponentials and their
+// sum, then a division per probability.
 void dpu_softmax_row(int32_t *score_row, uint8_t *out_row, int cols, const uint8_t *lut) {
     int32_t row_max = score_row[0];
     for (int j = 1; j < cols; ++j)
         if (score_row[j] > row_max) row_max = score_row[j];
 
     int32_t sum = 0;
-    uint8_t tmp[SEQ_LEN] __attribute__((aligned(8)));
     for (int j = 0; j < cols; ++j) {
-        int32_t v = score_row[j] - row_max;
-        int idx = v + 128;
-        if (idx & ~255) idx = (idx < 0) ? 0 : 255;
-        uint8_t e = lut[idx];
-        tmp[j] = e;
+        uint8_t e = lut_exp(lut, score_row[j] - row_max);
+        out_row[j] = e;
         sum += e;
     }
     if (sum == 0) sum = 1;
     for (int j = 0; j < cols; ++j)
-        out_row[j] = (uint8_t)((tmp[j] * 255) / sum);
+        out_row[j] = (uint8_t)((out_row[j] * 255) / sum);
+}
+
+// Fused softmax: with the max known from the score pass, one pass writes the
+// LUT exponentials and returns their sum. They weight V unnormalized and the
+// output row is scaled once by dpu_softmax_normalize.
+int32_t dpu_softmax_exp_row(const int32_t *score_row, uint8_t *e_row, int cols, int32_t row_max, const uint8_t *lut) {
+    int32_t sum = 0;
+    for (int j = 0; j < cols; ++j) {
+        uint8_t e = lut_exp(lut, score_row[j] - row_max);
+        e_row[j] = e;
+        sum += e;
+    }
+    return sum;
+}
+
+void dpu_softmax_normalize(int32_t *acc, int32_t sum, int dim) {
+    uint32_t recip = mha_softmax_recip(sum);
+    for (int d = 0; d < dim; ++d)
+        acc[d] = mha_softmax_norm(acc[d], recip);
 }
 
 void dpu_attention_output_row(const uint8_t *score_row, const int8_t *v_full, int32_t *out_row, int seq_len, int dim) {
@@ -75,102 +339,869 @@ void dpu_attention_output_row(const uint8_t *score_row, const int8_t *v_full, in
     }
 }
 
-int main(void) {
-    unsigned int tid = me();
+void dpu_attention_output_row_packed(const uint8_t *score_row, const int8_t *v_full, int32_t *out_row, int seq_len, int dim) {
+    for (int d = 0; d < dim; ++d) out_row[d] = 0;
+    for (int j = 0; j < seq_len; ++j)
+        axpy_s8_packed(score_row[j], v_full + (size_t)j * dim, out_row, dim);
+}
+
+// V in tiles of KV_TILE_ROWS keys, each stored d-major with a stride of its
+// own row count: out[d] is the probability row dotted with row d of every
+// tile the first cols keys touch.
+void dpu_attention_output_row_vt(const uint8_t *score_row, const int8_t *v_tiles, int32_t *out_row, int cols,
+                                 int seq_len, int dim) {
+    for (int d = 0; d < dim; ++d) out_row[d] = 0;
+    for (int t0 = 0; t0 < cols; t0 += KV_TILE_ROWS) {
+        int stride = seq_len - t0 < KV_TILE_ROWS ? seq_len - t0 : KV_TILE_ROWS;
+        int keys = cols - t0 < stride ? cols - t0 : stride;
+        const int8_t *tile = v_tiles + (size_t)t0 * dim;
+        for (int d = 0; d < dim; ++d)
+            out_row[d] += dot_u8_packed(score_row + t0, tile + (size_t)d * stride, keys);
+    }
+}
+
+// Register-blocked micro-kernels over nb query rows, nb a constant after
+// inlining so the per-row words and accumulators stay in registers. Each
+// K or V word is loaded once for all nb rows. Rows are strided: scores by
+// score_stride int32, probabilities by p_stride bytes, outputs by dim. The
+// row maxima skip keys past a causal row's own limit.
+static inline __attribute__((always_inline))
+void score_rows_n(const int8_t *q, const int8_t *k_full, int32_t *scores, int score_stride, int nb, int keys, int dim,
+                  bool causal, int32_t *row_max) {
+    for (int r = 0; r < nb; ++r) row_max[r] = INT32_MIN;
+    for (int j = 0; j < keys; ++j) {
+        const int8_t *k = k_full + (size_t)j * dim;
+        int32_t acc[MAX_ROW_BLOCK] = { 0 };
+        for (int i = 0; i < dim; i += 8) {
+            uint64_t y = load_word(k + i);
+            for (int r = 0; r < nb; ++r) {
+                uint64_t x = load_word(q + (size_t)r * dim + i);
+                acc[r] += dot4_ss((uint32_t)x, (uint32_t)y) + dot4_ss((uint32_t)(x >> 32), (uint32_t)(y >> 32));
+            }
+        }
+        for (int r = 0; r < nb; ++r) {
+            scores[(size_t)r * score_stride + j] = acc[r];
+            bool in_row = !causal || j < keys - (nb - 1 - r);
+            if (in_row && acc[r] > row_max[r]) row_max[r] = acc[r];
+        }
+    }
+}
+
+static inline __attribute__((always_inline))
+void output_rows_n(const uint8_t *p, int p_stride, const int8_t *v_full, int32_t *out, int nb, int keys, int dim) {
+    for (int i = 0; i < nb * dim; ++i) out[i] = 0;
+    for (int j = 0; j < keys; ++j) {
+        const int8_t *vrow = v_full + (size_t)j * dim;
+        uint8_t pr[MAX_ROW_BLOCK];
+        for (int r = 0; r < nb; ++r) pr[r] = p[(size_t)r * p_stride + j];
+        for (int i = 0; i < dim; i += 8) {
+            uint64_t x = load_word(vrow + i);
+            int32_t v[8];
+            for (int b = 0; b < 8; ++b) v[b] = (int8_t)(x >> (8 * b));
+            for (int r = 0; r < nb; ++r) {
+                int32_t *o = out + (size_t)r * dim + i;
+                for (int b = 0; b < 8; ++b) o[b] += pr[r] * v[b];
+            }
+        }
+    }
+}
+
+static inline __attribute__((always_inline))
+void output_rows_vt_n(const uint8_t *p, int p_stride, const int8_t *v_tiles, int32_t *out, int nb, int cols,
+                      int seq_len, int dim) {
+    for (int i = 0; i < nb * dim; ++i) out[i] = 0;
+    for (int t0 = 0; t0 < cols; t0 += KV_TILE_ROWS) {
+        int stride = seq_len - t0 < KV_TILE_ROWS ? seq_len - t0 : KV_TILE_ROWS;
+        int keys = cols - t0 < stride ? cols - t0 : stride;
+        const int8_t *tile = v_tiles + (size_t)t0 * dim;
+        for (int d = 0; d < dim; ++d) {
+            const int8_t *vd = tile + (size_t)d * stride;
+            int32_t acc[MAX_ROW_BLOCK] = { 0 };
+            int j = 0;
+            for (; j + 8 <= keys; j += 8) {
+                uint64_t y = load_word(vd + j);
+                for (int r = 0; r < nb; ++r) {
+                    uint64_t x = load_word(p + (size_t)r * p_stride + t0 + j);
+                    acc[r] += dot4_us((uint32_t)x, (uint32_t)y) + dot4_us((uint32_t)(x >> 32), (uint32_t)(y >> 32));
+                }
+            }
+            for (; j < keys; ++j)
+                for (int r = 0; r < nb; ++r) acc[r] += (int32_t)p[(size_t)r * p_stride + t0 + j] * (int32_t)vd[j];
+            for (int r = 0; r < nb; ++r) out[(size_t)r * dim + d] += acc[r];
+        }
+    }
+}
+
+// Scores of nb consecutive Q rows against the first keys keys, with the max
+// of each row; under a causal mask the last row is the one with keys keys.
+void dpu_matmul_score_rows(const int8_t *q, const int8_t *k_full, int32_t *scores, int score_stride, int nb,
+                           int keys, int dim, bool causal, int32_t *row_max) {
+    switch (nb) {
+    case 4: score_rows_n(q, k_full, scores, score_stride, 4, keys, dim, causal, row_max); break;
+    case 3: score_rows_n(q, k_full, scores, score_stride, 3, keys, dim, causal, row_max); break;
+    case 2: score_rows_n(q, k_full, scores, score_stride, 2, keys, dim, causal, row_max); break;
+    default: row_max[0] = dpu_matmul_score_row_packed(q, k_full, scores, keys, dim); break;
+    }
+}
+
+// Output rows of nb probability rows over the first cols keys. Entries of a
+// row past its own causal limit must be zero.
+void dpu_attention_output_rows(const uint8_t *p, int p_stride, const int8_t *v, int32_t *out, int nb, int cols,
+                               int seq_len, int dim, bool v_tiled) {
+    if (v_tiled) {
+        switch (nb) {
+        case 4: output_rows_vt_n(p, p_stride, v, out, 4, cols, seq_len, dim); break;
+        case 3: output_rows_vt_n(p, p_stride, v, out, 3, cols, seq_len, dim); break;
+        case 2: output_rows_vt_n(p, p_stride, v, out, 2, cols, seq_len, dim); break;
+        default: dpu_attention_output_row_vt(p, v, out, cols, seq_len, dim); break;
+        }
+        return;
+    }
+    switch (nb) {
+    case 4: output_rows_n(p, p_stride, v, out, 4, cols, dim); break;
+    case 3: output_rows_n(p, p_stride, v, out, 3, cols, dim); break;
+    case 2: output_rows_n(p, p_stride, v, out, 2, cols, dim); break;
+    default: dpu_attention_output_row_packed(p, v, out, cols, dim); break;
+    }
+}
+
+// Online softmax over one K/V tile for one query row. row_max and row_sum
+// carry the running max and the running sum of LUT exponentials; acc holds
+// the V accumulation, unnormalized. When a tile raises the max, the old
+// state is rescaled by the LUT exponential of the shift.
+// With OPS_PACKED_VT the tile is d-major with tile_rows per row of V, and the
+// exponentials are first written over the score row, byte j over int32 j/4,
+// which has always been read by then.
+void dpu_online_softmax_tile(int32_t *score_row, int32_t tile_max, const int8_t *v_tile, int rows, int tile_rows,
+                             int dim, bool first, int32_t *row_max, int32_t *row_sum, int32_t *acc, const uint8_t *lut,
+                             int ops) {
+    if (first) {
+        *row_max = tile_max;
+        *row_sum = 0;
+        for (int d = 0; d < dim; ++d) acc[d] = 0;
+    } else if (tile_max > *row_max) {
+        int32_t one = lut[0] ? lut[0] : 1;
+        int32_t f = lut_exp(lut, *row_max - tile_max);
+        *row_sum = (int32_t)(((int64_t)*row_sum * f) / one);
+        for (int d = 0; d < dim; ++d)
+            acc[d] = (int32_t)(((int64_t)acc[d] * f) / one);
+        *row_max = tile_max;
+    }
+
+    int32_t sum = *row_sum;
+    if (ops == OPS_PACKED_VT) {
+        uint8_t *e_row = (uint8_t*)score_row;
+        for (int j = 0; j < rows; ++j) {
+            uint8_t e = lut_exp(lut, score_row[j] - *row_max);
+            e_row[j] = e;
+            sum += e;
+        }
+        for (int d = 0; d < dim; ++d)
+            acc[d] += dot_u8_packed(e_row, v_tile + (size_t)d * tile_rows, rows);
+        *row_sum = sum;
+        return;
+    }
+
+    for (int j = 0; j < rows; ++j) {
+        int32_t e = lut_exp(lut, score_row[j] - *row_max);
+        if (e == 0) continue;
+        const int8_t *vrow = v_tile + (size_t)j * dim;
+        sum += e;
+        if (ops == OPS_PACKED) {
+            axpy_s8_packed((uint8_t)e, vrow, acc, dim);
+            continue;
+        }
+#pragma unroll 4
+        for (int d = 0; d < dim; ++d)
+            acc[d] += e * (int32_t)vrow[d];
+    }
+    *row_sum = sum;
+}
+
+void dpu_online_softmax_finish(int32_t *acc, int32_t row_sum, int dim, bool div_softmax) {
+    if (!div_softmax) {
+        dpu_softmax_normalize(acc, row_sum, dim);
+        return;
+    }
+    for (int d = 0; d < dim; ++d)
+        acc[d] = row_sum ? (int32_t)(((int64_t)acc[d] * 255) / row_sum) : 0;
+}
+
+// Contiguous row range of one tasklet. Under a causal mask row i costs i+1
+// keys, so the boundaries split the triangle into equal areas instead of
+// equal row counts.
+static void tasklet_rows(unsigned int tid, uint32_t nr_active, uint32_t seq_len, bool causal, int *start, int *end) {
+    if (tid >= nr_active) {
+        *start = *end = seq_len;
+        return;
+    }
+    if (!causal) {
+        int rows_per_tasklet = (seq_len + nr_active - 1) / nr_active;
+        *start = tid * rows_per_tasklet;
+        *end = *start + rows_per_tasklet;
+        if (*start > (int)seq_len) *start = seq_len;
+        if (*end > (int)seq_len) *end = seq_len;
+        return;
+    }
 
-    if (tid == 0) mem_reset();
+    uint64_t total = (uint64_t)seq_len * (seq_len + 1) / 2;
+    uint64_t lo = total * tid / nr_active;
+    uint64_t hi = total * (tid + 1) / nr_active;
+    uint32_t r = 0;
+    uint64_t work = 0;
+    while (r < seq_len && work < lo) work += ++r;
+    *start = r;
+    while (r < seq_len && work < hi) work += ++r;
+    *end = r;
+}
+
+// Next row range of slot ls for a tasklet of the full kernel. With
+// MHA_FLAG_STATIC_ROWS every tasklet gets its tasklet_rows range once;
+// otherwise blocks of item_rows rows come off the slot's shared counter
+// until it runs out, causal slots from the bottom up so the longest rows
+// go first.
+static bool next_rows(unsigned int tid, uint32_t ls, uint32_t item_rows, bool *taken, int *start, int *end) {
+    const uint32_t seq_len = slot_len[ls];
+    const bool causal = (shape.flags & MHA_FLAG_CAUSAL) != 0;
+
+    if (shape.flags & MHA_FLAG_STATIC_ROWS) {
+        if (*taken) return false;
+        *taken = true;
+        tasklet_rows(tid, shape.nr_tasklets, seq_len, causal, start, end);
+        return *start < *end;
+    }
+    if (tid >= shape.nr_tasklets) return false;
+
+    mutex_lock(work_mutex);
+    uint32_t item = work_next[ls]++;
+    mutex_unlock(work_mutex);
+
+    if (item >= (seq_len + item_rows - 1) / item_rows) return false;
+    if (causal) {
+        *end = seq_len - item * item_rows;
+        *start = *end > (int)item_rows ? *end - (int)item_rows : 0;
+    } else {
+        *start = item * item_rows;
+        *end = seq_len - *start < item_rows ? (int)seq_len : *start + (int)item_rows;
+    }
+    return true;
+}
+
+static void run_full(unsigned int tid) {
+    const uint32_t seq_len = shape.seq_len;
+    const uint32_t head_dim = shape.head_dim;
+    const uint32_t nslots = shape.nslots;
+    const uint32_t nr_active = shape.nr_tasklets;
+
+    const size_t kv_bytes = (size_t)seq_len * head_dim * sizeof(int8_t);
+    const uint32_t row_block = shape.row_block;
+    const uint32_t scratch_bytes = mha_tasklet_wram_bytes(seq_len, head_dim, row_block, Q_BLOCK_ROWS);
+
+    const uint32_t group = shape.kv_group;
+
+    if (tid == 0) {
+        K_buf[0] = mem_alloc(kv_bytes);
+        V_buf[0] = mem_alloc(kv_bytes);
+        if (nslots > group) {
+            K_buf[1] = mem_alloc(kv_bytes);
+            V_buf[1] = mem_alloc(kv_bytes);
+        }
+        tasklet_scratch = mem_alloc((size_t)nr_active * scratch_bytes);
+        for (uint32_t ls = 0; ls < nslots; ++ls) work_next[ls] = 0;
+    }
     barrier_wait(&my_barrier);
 
-    int32_t score_row[SEQ_LEN] __attribute__((aligned(8)));
-    uint8_t score_u8_row[SEQ_LEN] __attribute__((aligned(8)));
-    int32_t attn_out_row[HEAD_DIM] __attribute__((aligned(8)));
+    if (tid == 0) perfcounter_config(COUNT_CYCLES, true);
+    barrier_wait(&my_barrier);
+    PROFILE_START(tid);
+
+    const int score_stride = mha_round_up8(seq_len * sizeof(int32_t)) / sizeof(int32_t);
+    const int p_stride = mha_round_up8(seq_len);
+    uint8_t *scratch = tasklet_scratch + (size_t)tid * scratch_bytes;
+    int32_t *score_row = (int32_t*)scratch;
+    scratch += row_block * mha_round_up8(seq_len * sizeof(int32_t));
+    uint8_t *score_u8_row = scratch;
+    scratch += row_block * mha_round_up8(seq_len);
+    int32_t *attn_out_row = (int32_t*)scratch;
+    scratch += row_block * mha_round_up8(head_dim * sizeof(int32_t));
+    int8_t *q_block = (int8_t*)scratch;
+
+    const bool causal = (shape.flags & MHA_FLAG_CAUSAL) != 0;
+    const int ops = shape_ops();
+    const bool div_softmax = (shape.flags & MHA_FLAG_DIV_SOFTMAX) != 0;
+    // Work items are blocks of a whole number of micro-kernel blocks, at most
+    // a Q block, and small enough to give every tasklet about two per slot.
+    uint32_t item_rows = seq_len / (2 * nr_active);
+    if (item_rows > Q_BLOCK_ROWS) item_rows = Q_BLOCK_ROWS;
+    item_rows -= item_rows % row_block;
+    if (item_rows == 0) item_rows = row_block;
+
+    uint64_t slot_start = 0;
+
+    if (tid < nr_active) load_kv_rows(0, 0, slot_len[0], K_buf[0], V_buf[0], tid, nr_active);
+    PROFILE_PHASE(tid, MHA_PHASE_DMA);
+    sync_tasklets(tid);
+
+    for (uint32_t ls = 0; ls < nslots; ++ls) {
+        const uint32_t len = slot_len[ls];
+        const uint32_t kv = ls / group;
+        const int8_t *K_shared = K_buf[kv & 1];
+        const int8_t *V_shared = V_buf[kv & 1];
+
+        __mram_ptr int8_t *q_base_mram = (__mram_ptr int8_t*)(DPU_QKV + (size_t)slot_q_row[ls] * head_dim);
 
-    int32_t out_padded_local[(HEAD_DIM * sizeof(int32_t) + 7) / 4] __attribute__((aligned(8)));
-    int8_t q_block[Q_BLOCK_ROWS * HEAD_DIM] __attribute__((aligned(8)));
+        // The next group's K/V streams into the other buffer while the first
+        // slot of this group is computed; the barrier at the end of the slot
+        // publishes it. Every slot of a group reads the same buffers.
+        if (ls % group == 0 && ls + group < nslots && tid < nr_active)
+            load_kv_rows(ls + group, 0, slot_len[ls + group], K_buf[(kv + 1) & 1], V_buf[(kv + 1) & 1], tid,
+                         nr_active);
+        PROFILE_PHASE(tid, MHA_PHASE_DMA);
 
-    uint64_t nslots64 = 0, slot0_64 = 0;
+        bool taken = false;
+        int row_start, row_end;
+        while (next_rows(tid, ls, item_rows, &taken, &row_start, &row_end)) {
+            for (int r = row_start; r < row_end; r += Q_BLOCK_ROWS) {
+                int this_block = row_end - r;
+                if (this_block > Q_BLOCK_ROWS) this_block = Q_BLOCK_ROWS;
+                PROFILE_PHASE(tid, MHA_PHASE_OTHER);
+
+                __mram_ptr void const* q_block_ptr = (__mram_ptr void const*)(q_base_mram + (size_t)r * head_dim);
+                mram_read(q_block_ptr, q_block, (size_t)this_block * head_dim * sizeof(int8_t));
+                PROFILE_PHASE(tid, MHA_PHASE_DMA);
+
+                // Packed operands go through the micro-kernels row_block rows at
+                // a time; the last row of a causal block has the most keys.
+                int br = 0;
+                for (; ops != OPS_BYTE && row_block > 1 && br + 1 < this_block; br += row_block) {
+                    int nb = this_block - br < (int)row_block ? this_block - br : (int)row_block;
+                    int cols = causal ? r + br + nb : (int)len;
+
+                    int32_t row_max[MAX_ROW_BLOCK], row_sum[MAX_ROW_BLOCK];
+                    dpu_matmul_score_rows(q_block + (size_t)br * head_dim, K_shared, score_row, score_stride, nb, cols,
+                                          head_dim, causal, row_max);
+                    PROFILE_PHASE(tid, MHA_PHASE_QK);
+                    for (int i = 0; i < nb; ++i) {
+                        int row_cols = causal ? r + br + i + 1 : (int)len;
+                        uint8_t *p = score_u8_row + (size_t)i * p_stride;
+                        if (div_softmax)
+                            dpu_softmax_row(score_row + (size_t)i * score_stride, p, row_cols, LUT_shared);
+                        else
+                            row_sum[i] = dpu_softmax_exp_row(score_row + (size_t)i * score_stride, p, row_cols,
+                                                             row_max[i], LUT_shared);
+                        for (int j = row_cols; j < cols; ++j) p[j] = 0;
+                    }
+                    PROFILE_PHASE(tid, MHA_PHASE_SOFTMAX);
+                    dpu_attention_output_rows(score_u8_row, p_stride, V_shared, attn_out_row, nb, cols, len,
+                                              head_dim, ops == OPS_PACKED_VT);
+                    PROFILE_PHASE(tid, MHA_PHASE_AV);
+                    for (int i = 0; !div_softmax && i < nb; ++i)
+                        dpu_softmax_normalize(attn_out_row + (size_t)i * head_dim, row_sum[i], head_dim);
+                    PROFILE_PHASE(tid, MHA_PHASE_SOFTMAX);
+                    for (int i = 0; i < nb; ++i)
+                        write_out_row(attn_out_row + (size_t)i * head_dim, (size_t)slot_row0[ls] + r + br + i);
+                    PROFILE_PHASE(tid, MHA_PHASE_WRITEBACK);
+                }
+
+                for (; br < this_block; ++br) {
+                    int row_idx = r + br;
+                    int8_t *q_row_local = q_block + (size_t)br * head_dim;
+                    int cols = causal ? row_idx + 1 : (int)len;
+
+                    int32_t row_max, row_sum = 0;
+                    if (ops == OPS_BYTE)
+                        row_max = dpu_matmul_score_row(q_row_local, K_shared, score_row, cols, head_dim);
+                    else
+                        row_max = dpu_matmul_score_row_packed(q_row_local, K_shared, score_row, cols, head_dim);
+                    PROFILE_PHASE(tid, MHA_PHASE_QK);
+                    if (div_softmax)
+                        dpu_softmax_row(score_row, score_u8_row, cols, LUT_shared);
+                    else
+                        row_sum = dpu_softmax_exp_row(score_row, score_u8_row, cols, row_max, LUT_shared);
+                    PROFILE_PHASE(tid, MHA_PHASE_SOFTMAX);
+                    if (ops == OPS_PACKED_VT)
+                        dpu_attention_output_row_vt(score_u8_row, V_shared, attn_out_row, cols, len, head_dim);
+                    else if (ops == OPS_PACKED)
+                        dpu_attention_output_row_packed(score_u8_row, V_shared, attn_out_row, cols, head_dim);
+                    else
+                        dpu_attention_output_row(score_u8_row, V_shared, attn_out_row, cols, head_dim);
+                    PROFILE_PHASE(tid, MHA_PHASE_AV);
+
+                    if (!div_softmax) dpu_softmax_normalize(attn_out_row, row_sum, head_dim);
+                    PROFILE_PHASE(tid, MHA_PHASE_SOFTMAX);
+                    write_out_row(attn_out_row, (size_t)slot_row0[ls] + row_idx);
+                    PROFILE_PHASE(tid, MHA_PHASE_WRITEBACK);
+                }
+            }
+        }
+        sync_tasklets(tid);
+
+        if (tid == 0) {
+            uint64_t cyc = perfcounter_get();
+            slot_cycles[ls] = cyc - slot_start;
+            slot_start = cyc;
+        }
+    }
+    end_phase(tid);
+}
+
+// Tiles of the window of kv_rows rows from kv0 on that start before row end.
+static inline uint32_t window_tiles(uint32_t kv0, uint32_t kv_rows, uint32_t end) {
+    if (end > kv0 + kv_rows) end = kv0 + kv_rows;
+    return end > kv0 ? (end - kv0 + KV_TILE_ROWS - 1) / KV_TILE_ROWS : 0;
+}
+
+// K/V tiles the query rows [first, last] of a group have to visit among the
+// two windows held, row r being row r % seq_len of query head r / seq_len;
+// a causal block stops at the tile holding its furthest row, and under a K/V
+// split may end before a window starts. The second window follows the first
+// in the sequence, so the tiles visited are always the first ones held.
+static inline uint32_t block_tiles(uint32_t first, uint32_t last, uint32_t seq_len, const uint32_t kv0[2],
+                                   const uint32_t kv_rows[2], bool causal) {
+    uint32_t end = UINT32_MAX;
+    if (causal && first / seq_len == last / seq_len) end = last % seq_len + 1;
+    return window_tiles(kv0[0], kv_rows[0], end) + window_tiles(kv0[1], kv_rows[1], end);
+}
+
+// Every tasklet owns TILE_Q_ROWS query rows of a block of nr_active*TILE_Q_ROWS
+// rows. The query rows of a group's slots are stacked, so every K/V tile
+// serves all its heads; the block walks the group's tiles, tile n+1 is
+// prefetched while tile n is consumed, and one barrier per tile swaps the
+// buffers. Under a K/V split the tiles cover the DPU's two windows of every
+// slot, one after the other, and the rows are written unnormalized, as
+// partials.
+static void run_tiled(unsigned int tid) {
+    const uint32_t head_dim = shape.head_dim;
+    const uint32_t nslots = shape.nslots;
+    const uint32_t nr_active = shape.nr_tasklets;
+
+    const uint32_t tile_bytes = mha_round_up8(KV_TILE_ROWS * head_dim);
+    const uint32_t scratch_bytes = mha_tiled_tasklet_wram_bytes(head_dim);
 
     if (tid == 0) {
-        mram_read((__mram_ptr void*)&DPU_NHEADS64, &nslots64, sizeof(uint64_t));
-        mram_read((__mram_ptr void*)&DPU_HEAD0_64, &slot0_64, sizeof(uint64_t));
+        for (int b = 0; b < 2; ++b) {
+            K_buf[b] = mem_alloc(tile_bytes);
+            V_buf[b] = mem_alloc(tile_bytes);
+        }
+        tasklet_scratch = mem_alloc((size_t)nr_active * scratch_bytes);
     }
+    barrier_wait(&my_barrier);
 
+    if (tid == 0) perfcounter_config(COUNT_CYCLES, true);
     barrier_wait(&my_barrier);
+    PROFILE_START(tid);
+
+    uint8_t *scratch = tasklet_scratch + (size_t)tid * scratch_bytes;
+    int8_t *q_rows = (int8_t*)scratch;
+    scratch += mha_round_up8(TILE_Q_ROWS * head_dim);
+    int32_t *score_row = (int32_t*)scratch;
+    scratch += KV_TILE_ROWS * sizeof(int32_t);
+    int32_t *acc = (int32_t*)scratch;
+
+    int32_t row_max[TILE_Q_ROWS];
+    int32_t row_sum[TILE_Q_ROWS];
+    uint32_t row_slot[TILE_Q_ROWS];
+    uint32_t row_pos[TILE_Q_ROWS];
+
+    const bool causal = (shape.flags & MHA_FLAG_CAUSAL) != 0;
+    const int ops = shape_ops();
+    const bool div_softmax = (shape.flags & MHA_FLAG_DIV_SOFTMAX) != 0;
+    const uint32_t block_rows = nr_active * TILE_Q_ROWS;
+    const uint32_t group = shape.kv_group;
+    const bool split = (shape.flags & MHA_FLAG_KV_SPLIT) != 0;
+    uint64_t slot_start = 0;
+
+    if (tid < nr_active) {
+        uint32_t rows = kv_len(0) < KV_TILE_ROWS ? kv_len(0) : KV_TILE_ROWS;
+        load_kv_rows(0, 0, rows, K_buf[0], V_buf[0], tid, nr_active);
+    }
+    PROFILE_PHASE(tid, MHA_PHASE_DMA);
+    sync_tasklets(tid);
+
+    uint32_t step = 0;
+    for (uint32_t ls = 0; ls < nslots; ls += group) {
+        const uint32_t len = slot_len[ls];
+        const uint32_t qrows = group * len;
+        const uint32_t nblocks = (qrows + block_rows - 1) / block_rows;
+        __mram_ptr int8_t *q_base_mram = (__mram_ptr int8_t*)(DPU_QKV + (size_t)slot_q_row[ls] * head_dim);
+        const uint32_t kv0[2] = { split ? shape.kv_row0[0] : 0, split ? shape.kv_row0[1] : 0 };
+        const uint32_t kv_rows[2] = { split ? shape.kv_rows[0] : len, split ? shape.kv_rows[1] : 0 };
+
+        for (uint32_t qb = 0; qb < nblocks; ++qb) {
+            uint32_t row0 = qb * block_rows + tid * TILE_Q_ROWS;
+            int nrows = 0;
+            if (tid < nr_active && row0 < qrows)
+                nrows = (qrows - row0 < TILE_Q_ROWS) ? (int)(qrows - row0) : TILE_Q_ROWS;
+            for (int br = 0; br < nrows; ++br) {
+                row_slot[br] = ls + (row0 + br) / len;
+                row_pos[br] = (row0 + br) % len;
+            }
+
+            PROFILE_PHASE(tid, MHA_PHASE_OTHER);
+            if (nrows > 0)
+                mram_read((__mram_ptr void const*)(q_base_mram + (size_t)row0 * head_dim), q_rows,
+                          (size_t)nrows * head_dim);
+            PROFILE_PHASE(tid, MHA_PHASE_DMA);
+
+            const uint32_t first = qb * block_rows;
+            const uint32_t last = first + block_rows < qrows ? first + block_rows - 1 : qrows - 1;
+            const uint32_t ntiles = block_tiles(first, last, len, kv0, kv_rows, causal);
+            for (uint32_t t = 0; t < ntiles; ++t, ++step) {
+                const int8_t *K_tile = K_buf[step & 1];
+                const int8_t *V_tile = V_buf[step & 1];
+
+                uint32_t next_ls = ls, next_qb = qb, next_t = t + 1;
+                if (next_t == ntiles) {
+                    next_t = 0;
+                    if (++next_qb == nblocks) {
+                        next_qb = 0;
+                        next_ls += group;
+                    }
+                }
+                PROFILE_PHASE(tid, MHA_PHASE_OTHER);
+                if (next_ls < nslots && tid < nr_active) {
+                    uint32_t next_len = kv_len(next_ls);
+                    uint32_t next_row0 = next_t * KV_TILE_ROWS;
+                    uint32_t next_rows = next_len - next_row0 < KV_TILE_ROWS ? next_len - next_row0 : KV_TILE_ROWS;
+                    load_kv_rows(next_ls, next_row0, next_rows, K_buf[(step + 1) & 1], V_buf[(step + 1) & 1], tid, nr_active);
+                }
+                PROFILE_PHASE(tid, MHA_PHASE_DMA);
+
+                const int t0 = t * KV_TILE_ROWS;
+                const int kv_end = (int)kv_len(ls);
+                int tile_rows = kv_end - t0 < KV_TILE_ROWS ? kv_end - t0 : KV_TILE_ROWS;
+                // Sequence row of the tile's first key.
+                const int seq0 = t0 < (int)kv_rows[0] ? (int)kv0[0] + t0 : (int)(kv0[1] - kv_rows[0]) + t0;
+                for (int br = 0; br < nrows; ++br) {
+                    int keys = tile_rows;
+                    int visible = (int)row_pos[br] - seq0 + 1;
+                    if (causal && visible < keys) keys = visible;
+                    if (keys <= 0) continue;
+
+                    int32_t tile_max;
+                    if (ops == OPS_BYTE)
+                        tile_max = dpu_matmul_score_row(q_rows + (size_t)br * head_dim, K_tile, score_row, keys, head_dim);
+                    else
+                        tile_max = dpu_matmul_score_row_packed(q_rows + (size_t)br * head_dim, K_tile, score_row, keys,
+                                                               head_dim);
+                    PROFILE_PHASE(tid, MHA_PHASE_QK);
+                    dpu_online_softmax_tile(score_row, tile_max, V_tile, keys, tile_rows, head_dim, t == 0,
+                                            &row_max[br], &row_sum[br], acc + (size_t)br * head_dim, LUT_shared, ops);
+                    PROFILE_PHASE(tid, MHA_PHASE_AV);
+                }
+                sync_tasklets(tid);
+            }
 
-    uint32_t nslots = (uint32_t)(nslots64 & 0xffffffffu);
-    uint32_t slot0  = (uint32_t)(slot0_64 & 0xffffffffu);
-    
-    if (nslots == 0) {
+            for (int br = 0; br < nrows; ++br) {
+                int32_t *out_row = acc + (size_t)br * head_dim;
+                if (split) {
+                    // A row before the first window sees none of its keys.
+                    if (kv_rows[0] == 0 || (causal && row_pos[br] < kv0[0])) {
+                        row_max[br] = INT32_MIN;
+                        row_sum[br] = 0;
+                        for (uint32_t d = 0; d < head_dim; ++d) out_row[d] = 0;
+                    }
+                    write_partial_row(out_row, row_max[br], row_sum[br], (size_t)slot_row0[row_slot[br]] + row_pos[br]);
+                    PROFILE_PHASE(tid, MHA_PHASE_WRITEBACK);
+                    continue;
+                }
+                dpu_online_softmax_finish(out_row, row_sum[br], head_dim, div_softmax);
+                PROFILE_PHASE(tid, MHA_PHASE_SOFTMAX);
+                write_out_row(out_row, (size_t)slot_row0[row_slot[br]] + row_pos[br]);
+                PROFILE_PHASE(tid, MHA_PHASE_WRITEBACK);
+            }
+        }
+        sync_tasklets(tid);
+
+        // The slots of a group run together and share its cycles.
         if (tid == 0) {
             uint64_t cyc = perfcounter_get();
-            mram_write(&cyc, (__mram_ptr void*)(&DPU_RESULTS[0].cycles), sizeof(uint64_t));
+            for (uint32_t i = 0; i < group; ++i)
+                slot_cycles[ls + i] = (cyc - slot_start) / group + (i == 0 ? (cyc - slot_start) % group : 0);
+            slot_start = cyc;
         }
-        return 0;
     }
+    end_phase(tid);
+}
+
+// One decode step. Each local slot first appends the new token's k/v rows
+// from DPU_STEP at row shape.pos of its cache, or as far before it as the
+// slot is shorter than SEQ_LEN, then attends its q row over keys 0..pos.
+// The keys are dealt to the tasklets tile by tile and the three softmax
+// passes (max, exponential sum, weighted V) meet at a barrier each, so the
+// output equals causal row pos of the full kernel bit for bit.
+static void run_decode(unsigned int tid) {
+    const uint32_t seq_len = shape.seq_len;
+    const uint32_t head_dim = shape.head_dim;
+    const uint32_t nslots = shape.nslots;
+    const uint32_t nr_active = shape.nr_tasklets;
+    const uint32_t tile_bytes = mha_round_up8(KV_TILE_ROWS * head_dim);
+    const uint32_t acc_bytes = mha_round_up8(head_dim * sizeof(int32_t));
 
     if (tid == 0) {
-        mram_read((__mram_ptr void*)DPU_EXP_LUT, LUT_shared, 256);
+        decode_scores = mem_alloc(mha_round_up8(seq_len * sizeof(int32_t)));
+        decode_q = mem_alloc(mha_round_up8(head_dim));
+        tasklet_scratch = mem_alloc((size_t)nr_active * (tile_bytes + acc_bytes));
     }
     barrier_wait(&my_barrier);
 
     if (tid == 0) perfcounter_config(COUNT_CYCLES, true);
     barrier_wait(&my_barrier);
+    PROFILE_START(tid);
 
-    const size_t slot_elems = (size_t)SEQ_LEN * HEAD_DIM;
-    const size_t kv_bytes = slot_elems * sizeof(int8_t);
+    int8_t *tile = (int8_t*)(tasklet_scratch + (size_t)tid * (tile_bytes + acc_bytes));
+    int32_t *acc = (int32_t*)(tasklet_scratch + (size_t)tid * (tile_bytes + acc_bytes) + tile_bytes);
+
+    // The appended k and v rows, once per group of slots sharing them, bounce
+    // through the tasklets' tile buffers.
+    if (tid < nr_active) {
+        for (uint32_t r = tid; r < 2 * nslots; r += nr_active) {
+            uint32_t ls = r >> 1, which = 1 + (r & 1);
+            if (ls % shape.kv_group != 0) continue;
+            uint32_t pos = shape.pos - (seq_len - slot_len[ls]);
+            __mram_ptr int8_t const *src = DPU_STEP + ((size_t)ls * 3 + which) * head_dim;
+            __mram_ptr int8_t *dst = DPU_QKV + ((size_t)slot_k_row[ls] + (size_t)(which - 1) * slot_len[ls] + pos) * head_dim;
+            mram_read((__mram_ptr void const*)src, tile, head_dim);
+            mram_write(tile, (__mram_ptr void*)dst, head_dim);
+        }
+    }
+    PROFILE_PHASE(tid, MHA_PHASE_DMA);
+
+    const bool packed = (shape.flags & MHA_FLAG_PACKED) != 0;
+    const bool div_softmax = (shape.flags & MHA_FLAG_DIV_SOFTMAX) != 0;
+    uint64_t slot_start = 0;
 
     for (uint32_t ls = 0; ls < nslots; ++ls) {
-        size_t slot_elem_offset = (size_t)ls * slot_elems;
+        const uint32_t keys = shape.pos - (seq_len - slot_len[ls]) + 1;
+        const uint32_t ntiles = (keys + KV_TILE_ROWS - 1) / KV_TILE_ROWS;
+        if (tid == 0)
+            mram_read((__mram_ptr void const*)(DPU_STEP + (size_t)ls * 3 * head_dim), decode_q, head_dim);
+        PROFILE_PHASE(tid, MHA_PHASE_DMA);
+        sync_tasklets(tid);
+
+        int32_t local_max = INT32_MIN;
+        for (uint32_t t = tid; tid < nr_active && t < ntiles; t += nr_active) {
+            uint32_t row0 = t * KV_TILE_ROWS;
+            uint32_t rows = keys - row0 < KV_TILE_ROWS ? keys - row0 : KV_TILE_ROWS;
+            PROFILE_PHASE(tid, MHA_PHASE_OTHER);
+            load_kv_rows(ls, row0, rows, tile, NULL, 0, 1);
+            PROFILE_PHASE(tid, MHA_PHASE_DMA);
+            int32_t tile_max;
+            if (packed)
+                tile_max = dpu_matmul_score_row_packed(decode_q, tile, decode_scores + row0, rows, head_dim);
+            else
+                tile_max = dpu_matmul_score_row(decode_q, tile, decode_scores + row0, rows, head_dim);
+            if (tile_max > local_max) local_max = tile_max;
+            PROFILE_PHASE(tid, MHA_PHASE_QK);
+        }
+        if (tid < nr_active) part_max[tid] = local_max;
+        sync_tasklets(tid);
+
+        int32_t row_max = part_max[0];
+        for (uint32_t i = 1; i < nr_active; ++i)
+            if (part_max[i] > row_max) row_max = part_max[i];
+
+        int32_t local_sum = 0;
+        for (uint32_t t = tid; tid < nr_active && t < ntiles; t += nr_active) {
+            uint32_t row0 = t * KV_TILE_ROWS;
+            uint32_t end = keys - row0 < KV_TILE_ROWS ? keys : row0 + KV_TILE_ROWS;
+            for (uint32_t j = row0; j < end; ++j)
+                local_sum += lut_exp(LUT_shared, decode_scores[j] - row_max);
+        }
+        PROFILE_PHASE(tid, MHA_PHASE_SOFTMAX);
+        if (tid < nr_active) part_sum[tid] = local_sum;
+        sync_tasklets(tid);
 
-        __mram_ptr int8_t *k_base_mram = (__mram_ptr int8_t*)(DPU_K + slot_elem_offset);
-        __mram_ptr int8_t *v_base_mram = (__mram_ptr int8_t*)(DPU_V + slot_elem_offset);
-        __mram_ptr int8_t *q_base_mram = (__mram_ptr int8_t*)(DPU_Q + slot_elem_offset);
+        int32_t sum = 0;
+        for (uint32_t i = 0; i < nr_active; ++i) sum += part_sum[i];
+        int32_t div_sum = sum ? sum : 1;
+
+        if (tid < nr_active) {
+            for (uint32_t d = 0; d < head_dim; ++d) acc[d] = 0;
+            for (uint32_t t = tid; t < ntiles; t += nr_active) {
+                uint32_t row0 = t * KV_TILE_ROWS;
+                uint32_t rows = keys - row0 < KV_TILE_ROWS ? keys - row0 : KV_TILE_ROWS;
+                PROFILE_PHASE(tid, MHA_PHASE_OTHER);
+                load_kv_rows(ls, row0, rows, NULL, tile, 0, 1);
+                PROFILE_PHASE(tid, MHA_PHASE_DMA);
+                for (uint32_t j = 0; j < rows; ++j) {
+                    int32_t p = lut_exp(LUT_shared, decode_scores[row0 + j] - row_max);
+                    if (div_softmax) p = (uint8_t)((p * 255) / div_sum);
+                    const int8_t *vrow = tile + (size_t)j * head_dim;
+                    if (packed) {
+                        axpy_s8_packed((uint8_t)p, vrow, acc, head_dim);
+                        continue;
+                    }
+#pragma unroll 4
+                    for (uint32_t d = 0; d < head_dim; ++d)
+                        acc[d] += p * (int32_t)vrow[d];
+                }
+                PROFILE_PHASE(tid, MHA_PHASE_AV);
+            }
+        }
+        sync_tasklets(tid);
 
         if (tid == 0) {
-            mram_read((__mram_ptr void const*)k_base_mram, K_shared, kv_bytes);
-            mram_read((__mram_ptr void const*)v_base_mram, V_shared, kv_bytes);
+            for (uint32_t i = 1; i < nr_active; ++i) {
+                const int32_t *part = (const int32_t*)(tasklet_scratch + (size_t)i * (tile_bytes + acc_bytes) + tile_bytes);
+                for (uint32_t d = 0; d < head_dim; ++d) acc[d] += part[d];
+            }
+            PROFILE_PHASE(tid, MHA_PHASE_AV);
+            if (!div_softmax) dpu_softmax_normalize(acc, sum, head_dim);
+            PROFILE_PHASE(tid, MHA_PHASE_SOFTMAX);
+            write_out_row(acc, ls);
+            PROFILE_PHASE(tid, MHA_PHASE_WRITEBACK);
+
+            uint64_t cyc = perfcounter_get();
+            slot_cycles[ls] = cyc - slot_start;
+            slot_start = cyc;
         }
-        barrier_wait(&my_barrier);
+    }
+    end_phase(tid);
+}
 
-        int rows_per_tasklet = (SEQ_LEN + NR_TASKLETS - 1) / NR_TASKLETS;
-        int row_start = tid * rows_per_tasklet;
-        int row_end = row_start + rows_per_tasklet;
-        if (row_start > SEQ_LEN) row_start = SEQ_LEN;
-        if (row_end > SEQ_LEN) row_end = SEQ_LEN;
+// Fused input projection: Q, K and V of every local slot are computed in
+// place in DPU_QKV from DPU_X and DPU_W before the attention kernel runs.
+// W^T is staged a group of output columns at a time in shared WRAM, and
+// every tasklet streams its X rows past the group.
+static void run_projection(unsigned int tid) {
+    const uint32_t seq_len = shape.seq_len;
+    const uint32_t head_dim = shape.head_dim;
+    const uint32_t embed_dim = shape.embed_dim;
+    const uint32_t nslots = shape.nslots;
+    const uint32_t nr_active = shape.nr_tasklets;
 
-        size_t bytes = (size_t)HEAD_DIM * sizeof(int32_t);
-        size_t bytes_padded = round_up8(bytes);
-        size_t ints_padded = bytes_padded / sizeof(int32_t);
+    const size_t slot_bytes = (size_t)seq_len * head_dim;
+    const size_t x_bytes = (size_t)seq_len * embed_dim;
+    const size_t w_bytes = (size_t)3 * head_dim * embed_dim;
+    const uint32_t group = mha_proj_group_cols(embed_dim, head_dim, nr_active);
+    const uint32_t x_row_bytes = mha_round_up8(embed_dim);
+    const bool packed = (shape.flags & MHA_FLAG_PACKED) != 0;
 
-        for (int r = row_start; r < row_end; r += Q_BLOCK_ROWS) {
-            int this_block = row_end - r;
-            if (this_block > Q_BLOCK_ROWS) this_block = Q_BLOCK_ROWS;
+    if (tid == 0) {
+        proj_w = mem_alloc(mha_round_up8(group * embed_dim));
+        tasklet_scratch = mem_alloc((size_t)nr_active * (x_row_bytes + group));
+    }
+    barrier_wait(&my_barrier);
+
+    if (tid == 0) perfcounter_config(COUNT_CYCLES, true);
+    barrier_wait(&my_barrier);
+    PROFILE_START(tid);
 
-            __mram_ptr void const* q_block_ptr = (__mram_ptr void const*)(q_base_mram + (size_t)r * HEAD_DIM);
-            mram_read(q_block_ptr, q_block, (size_t)this_block * HEAD_DIM * sizeof(int8_t));
+    int8_t *x_row = (int8_t*)(tasklet_scratch + (size_t)tid * (x_row_bytes + group));
+    int8_t *out = x_row + x_row_bytes;
+    uint64_t slot_start = 0;
 
-            for (int br = 0; br < this_block; ++br) {
-                int row_idx = r + br;
-                int8_t *q_row_local = q_block + (size_t)br * HEAD_DIM;
+    for (uint32_t ls = 0; ls < nslots; ++ls) {
+        size_t x_slot = (shape.flags & MHA_FLAG_SHARED_X) ? 0 : ls;
+        __mram_ptr int8_t const *x = DPU_X + x_slot * x_bytes;
 
-                dpu_matmul_score_row(q_row_local, K_shared, score_row, SEQ_LEN, HEAD_DIM);
-                dpu_softmax_row(score_row, score_u8_row, SEQ_LEN, LUT_shared);
-                dpu_attention_output_row(score_u8_row, V_shared, attn_out_row, SEQ_LEN, HEAD_DIM);
+        for (uint32_t t = 0; t < 3; ++t) {
+            __mram_ptr int8_t *dst = DPU_QKV + (size_t)ls * 3 * slot_bytes + t * slot_bytes;
 
-                for (size_t i = 0; i < ints_padded; ++i) out_padded_local[i] = 0;
-                for (size_t i = 0; i < (size_t)HEAD_DIM; ++i) out_padded_local[i] = attn_out_row[i];
+            for (uint32_t d0 = 0; d0 < head_dim; d0 += group) {
+                uint32_t cols = head_dim - d0 < group ? head_dim - d0 : group;
+                __mram_ptr int8_t const *w = DPU_W + ls * w_bytes + ((size_t)t * head_dim + d0) * embed_dim;
+                if (tid < nr_active) load_mram(w, proj_w, (size_t)cols * embed_dim, tid, nr_active);
+                PROFILE_PHASE(tid, MHA_PHASE_DMA);
+                sync_tasklets(tid);
 
-                __mram_ptr void *out_ptr = (__mram_ptr void*)(&DPU_RESULTS[ls].out[(size_t)row_idx * HEAD_DIM]);
-                mram_write(out_padded_local, out_ptr, bytes_padded);
+                for (uint32_t r = tid; tid < nr_active && r < seq_len; r += nr_active) {
+                    PROFILE_PHASE(tid, MHA_PHASE_OTHER);
+                    load_mram(x + (size_t)r * embed_dim, x_row, embed_dim, 0, 1);
+                    PROFILE_PHASE(tid, MHA_PHASE_DMA);
+                    for (uint32_t c = 0; c < cols; ++c) {
+                        const int8_t *wc = proj_w + (size_t)c * embed_dim;
+                        int32_t acc = 0;
+                        if (packed) {
+                            acc = dot_s8_packed(x_row, wc, embed_dim);
+                        } else {
+#pragma unroll 4
+                            for (uint32_t e = 0; e < embed_dim; ++e)
+                                acc += (int32_t)x_row[e] * (int32_t)wc[e];
+                        }
+                        out[c] = mha_requant(acc, shape.proj_shift);
+                    }
+                    PROFILE_PHASE(tid, MHA_PHASE_PROJECT);
+                    mram_write(out, (__mram_ptr void*)(dst + (size_t)r * head_dim + d0), cols);
+                    PROFILE_PHASE(tid, MHA_PHASE_WRITEBACK);
+                }
+                sync_tasklets(tid);
             }
         }
+
+        if (tid == 0) {
+            uint64_t cyc = perfcounter_get();
+            proj_cycles[ls] = cyc - slot_start;
+            slot_start = cyc;
+        }
+    }
+    end_phase(tid);
+}
+
+int main(void) {
+    unsigned int tid = me();
+
+    if (tid == 0) {
+        mem_reset();
+        mram_read((__mram_ptr void const*)&DPU_SHAPE, &shape, sizeof(mha_shape_t));
+        if (shape.nr_tasklets == 0 || shape.nr_tasklets > NR_TASKLETS) shape.nr_tasklets = NR_TASKLETS;
+        if (shape.row_block == 0 || shape.row_block > MAX_ROW_BLOCK) shape.row_block = 1;
+        if (shape.kv_group == 0) shape.kv_group = 1;
+
+        if (shape.flags & MHA_FLAG_RAGGED)
+            mram_read((__mram_ptr void const*)DPU_SLOT_LENS, slot_len, sizeof(slot_len));
+        const uint32_t group = shape.kv_group;
+        uint32_t row0 = 0, qkv_row = 0;
+        for (uint32_t ls = 0; ls < shape.nslots; ++ls) {
+            if (!(shape.flags & MHA_FLAG_RAGGED)) slot_len[ls] = shape.seq_len;
+            const uint32_t len = slot_len[ls];
+            slot_row0[ls] = row0;
+            row0 += len;
+            slot_q_row[ls] = qkv_row + (ls % group) * len;
+            slot_k_row[ls] = qkv_row + group * len;
+            if (ls % group == group - 1 || ls + 1 == shape.nslots) qkv_row += group * len + 2 * kv_len(ls);
+        }
+    }
+    tasklet_cycles[tid] = tasklet_cycles[NR_TASKLETS + tid] = 0;
+#ifdef MHA_PROFILE
+    for (uint32_t p = 0; p < MHA_PHASES; ++p) profile[tid][p] = 0;
+#endif
+    barrier_wait(&my_barrier);
+
+    if (shape.nslots == 0) {
+        if (tid == 0) {
+            uint64_t cyc = perfcounter_get();
+            mram_write(&cyc, (__mram_ptr void*)&DPU_CYCLES[0], sizeof(uint64_t));
+        }
+        return 0;
+    }
+
+    if (tid == 0) mram_read((__mram_ptr void const*)DPU_EXP_LUT, LUT_shared, 256);
+
+    const bool project = (shape.flags & MHA_FLAG_PROJECT) != 0;
+    if (project) {
+        run_projection(tid);
+        if (tid == 0) mem_reset();
         barrier_wait(&my_barrier);
     }
 
+    if (shape.kernel == MHA_KERNEL_TILED)
+        run_tiled(tid);
+    else if (shape.kernel == MHA_KERNEL_DECODE)
+        run_decode(tid);
+    else
+        run_full(tid);
+
+    if (tid == 0 && project)
+        for (uint32_t ls = 0; ls < shape.nslots; ++ls) slot_cycles[ls] += proj_cycles[ls];
+    barrier_wait(&my_barrier);
     if (tid == 0) {
-        uint64_t cyc = perfcounter_get();
-        for (uint32_t ls = 0; ls < nslots; ++ls)
-            mram_write(&cyc, (__mram_ptr void*)(&DPU_RESULTS[ls].cycles), sizeof(uint64_t));
+        mram_write(slot_cycles, (__mram_ptr void*)DPU_CYCLES, shape.nslots * sizeof(uint64_t));
+        mram_write(tasklet_cycles, (__mram_ptr void*)DPU_TASKLET_CYCLES, sizeof(tasklet_cycles));
     }
+#ifdef MHA_PROFILE
+    mram_write(profile[tid], (__mram_ptr void*)&DPU_PROFILE[tid * MHA_PHASES], sizeof(profile[tid]));
+#endif
     return 0;
 }
@@ -6,33 +6,277 @@
 #include <math.h>
 
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <dpu.h>
 
 #include "common.h"
+#include "host.h"
+#include "host_cpu.h"
+#include "host_trace.h"
 
 #ifndef DPU_BINARY
 #define DPU_BINARY "dpus.mpo"
 #endif
 
-static int8_t input_Q[TOTAL_SLOTS * SEQ_LEN * HEAD_DIM];
-static int8_t input_K[TOTAL_SLOTS * SEQ_LEN * HEAD_DIM];
-static int8_t input_V[TOTAL_SLOTS * SEQ_LEN * HEAD_DIM];
+// Written by scripts/autotune.py; read at startup when present.
+#ifndef TUNING_TABLE
+#define TUNING_TABLE "tuning.txt"
+#endif
+
+#define PIPELINE_GROUPS 2
+
+// Timed repetitions behind each figure of the hybrid model.
+#define HYBRID_PROBES 5
+
+#define MHA_KERNEL_AUTO UINT32_MAX
+
+// Attention rows are weighted averages of V scaled by about 255; this shift
+// brings them back to int8 before the output projection.
+#define ATTN_OUT_SHIFT 8
+
+typedef struct {
+    uint32_t batch_size;
+    uint32_t seq_len;
+    uint32_t head_dim;
+    uint32_t num_heads;
+    uint32_t nr_tasklets;
+    uint32_t slots_per_dpu;
+    bool serial_xfer;
+    uint32_t stream_batches;
+    uint32_t kernel;
+    bool causal;
+    uint32_t decode_steps;
+    bool project;
+    uint32_t embed_dim;
+    bool out_proj;
+    uint32_t host_threads;
+    uint32_t out_format;
+    host_cpu_isa_t cpu_isa;
+    bool cpu_only;
+    bool hybrid;
+    bool byte_kernels;
+    uint32_t row_block;
+    uint32_t lut_bits;
+    bool div_softmax;
+    bool accuracy;
+    bool static_rows;
+    uint32_t q_rows;      // Q_BLOCK_ROWS of the DPU binary to load
+    const char *tuning;   // tuning table, NULL for none
+    const char *trace;    // Chrome trace JSON of the host timeline, NULL for none
+    const char *profile;  // dpu_alloc profile, e.g. "backend=simulator"
+    uint32_t min_len;     // ragged batch: entry lengths drawn from [min_len, SEQ_LEN], 0 for none
+    uint32_t kv_heads;    // K/V heads, each shared by NUM_HEADS/kv_heads query heads; 0 for one per query head
+    uint32_t dpus;        // DPUs to allocate, DPU_ALLOCATE_ALL for all available, 0 for as many as the batch needs
+    uint32_t kv_parts;    // DPUs the K/V of every slot is split over, 0 or 1 for none
+    uint32_t serve_requests;  // serving mode: synthetic requests to serve, 0 for none
+    uint32_t serve_clients;   // client threads submitting them
+    double serve_rate;        // offered requests/s over all clients, 0 for clients awaiting each reply
+    double serve_wait_ms;     // longest the oldest queued request waits for its launch to fill
+} mha_config_t;
+
+typedef struct {
+    int32_t *out;
+    uint64_t *cycles;
+    uint8_t *packed;  // raw DPU_RESULTS rows when the output format is compact
+} mha_results_t;
+
+static const mha_config_t cfg_defaults = {
+    .batch_size = BATCH_SIZE,
+    .seq_len = SEQ_LEN,
+    .head_dim = HEAD_DIM,
+    .num_heads = NUM_HEADS,
+    .nr_tasklets = NR_TASKLETS,
+    .slots_per_dpu = SLOTS_PER_DPU,
+    .serial_xfer = false,
+    .stream_batches = 0,
+    .kernel = MHA_KERNEL_AUTO,
+    .causal = false,
+    .decode_steps = 0,
+    .project = false,
+    .embed_dim = EMBED_DIM,
+    .out_proj = false,
+    .host_threads = 0,
+    .out_format = MHA_OUT_INT32,
+    .cpu_isa = HOST_CPU_AUTO,
+    .cpu_only = false,
+    .hybrid = false,
+    .byte_kernels = false,
+    .row_block = 0,
+    .lut_bits = 5,
+    .div_softmax = false,
+    .accuracy = false,
+    .static_rows = false,
+    .q_rows = Q_BLOCK_ROWS,
+    .tuning = TUNING_TABLE,
+    .trace = NULL,
+    .profile = NULL,
+    .min_len = 0,
+    .kv_heads = 0,
+    .dpus = 0,
+    .kv_parts = 0,
+    .serve_requests = 0,
+    .serve_clients = 4,
+    .serve_rate = 0.0,
+    .serve_wait_ms = 2.0,
+};
+static mha_config_t cfg;
+
+// Options given on the command line, which a tuning table entry leaves alone.
+static bool opt_given[128];
+static char dpu_binary[64] = DPU_BINARY;
+
+static uint32_t total_slots;
+static size_t slot_elems;
+static uint32_t nr_dpus;
+
+// A batch needing more DPUs than were allocated runs in launch rounds:
+// nr_dpus counts the DPUs of every round, nr_dpus / nr_rounds of them run at
+// once, and DPU round_first of the layout is the first of the round in
+// flight.
+static uint32_t nr_rounds;
+static uint32_t round_first;
+
+#define NO_SLOT UINT32_MAX
+
+// Slot lengths and placement. Slot s holds slot_len[s] rows, SEQ_LEN unless
+// the batch is ragged, and is stored with SEQ_LEN rows on the host. DPU i
+// takes positions i*slots_per_dpu onwards: pos_slot[p] is the slot at
+// position p or NO_SLOT, pos_row0[p] its first row within the DPU's packed
+// outputs, and pos_q_row0[p] and pos_k_row0[p] the first rows of its Q and
+// of its K (V following) within the DPU's Q/K/V payload. The outputs span
+// dpu_rows rows on every DPU and the payload dpu_qkv_rows.
+static uint32_t *slot_len;
+static uint32_t *pos_slot;
+static uint32_t *pos_row0;
+static uint32_t *pos_q_row0;
+static uint32_t *pos_k_row0;
+static uint32_t dpu_rows;
+static uint32_t dpu_qkv_rows;
+static bool lens_aligned;   // every length a multiple of 8
+static uint32_t *dpu_lens;  // DPU_SLOT_LENS of every DPU, lens_bytes() apart
+
+static int8_t *dpu_payload;
+static mha_shape_t *dpu_shapes;
+
+static int8_t *input_Q;
+static int8_t *input_K;
+static int8_t *input_V;
+
+static int8_t *step_payload;
+
+// Projection mode: embeddings per batch entry, W_q/W_k/W_v per head stored
+// transposed, and their per-DPU payloads.
+static int8_t *input_X;
+static int8_t *input_W;
+static int8_t *dpu_x_payload;
+static int8_t *dpu_w_payload;
+static uint32_t proj_shift;
+
+// Output stage: W_o transposed, EMBED_DIM rows of NUM_HEADS*HEAD_DIM.
+static int8_t *input_Wo;
 
 static mha_results_t dpu_results;
 static mha_results_t host_results;
 
-uint8_t exp_lut[256];
+static uint8_t exp_lut[256];
+static uint32_t lut_shift;
+
+// Set by alloc_dpus, for the end-to-end breakdown.
+static double alloc_ms, load_ms;
+
+// Measurements of the current run, handed to mha_run's caller.
+static mha_stats_t stats;
+
+// Entry i is 255*exp(-x) for the logit x standing i << lut_shift score units
+// below the row max. Q and K carry QK_SCALE each and attention scales q.k by
+// 1/sqrt(HEAD_DIM), so a logit is QK_SCALE^2*sqrt(HEAD_DIM) score units.
+static void init_exp_lut(uint8_t* lut) {
+    double step = (double)(1u << lut_shift) / ((double)QK_SCALE * QK_SCALE * sqrt((double)cfg.head_dim));
+    for (int i = 0; i < 256; ++i)
+        lut[i] = (uint8_t)lrint(255.0 * exp(-(double)i * step));
+}
+
+// Softmax bits of the launch flags, shared with the CPU backend.
+static uint32_t softmax_flags(void) {
+    return (cfg.causal ? MHA_FLAG_CAUSAL : 0) | (cfg.div_softmax ? MHA_FLAG_DIV_SOFTMAX : 0);
+}
+
+static bool ragged(void) {
+    return cfg.min_len > 0;
+}
+
+// Query heads per K/V head.
+static uint32_t kv_group(void) {
+    return cfg.kv_heads ? cfg.num_heads / cfg.kv_heads : 1;
+}
+
+// K/V split: the K/V of every slot is cut into kv_parts() parts of two
+// windows of whole tiles, an early and a late one (mha_kv_windows), one
+// part per DPU; the DPUs of the parts of a group of slots follow each other.
+static uint32_t kv_parts(void) {
+    return cfg.kv_parts > 1 ? cfg.kv_parts : 1;
+}
+
+static bool kv_split(void) {
+    return kv_parts() > 1;
+}
 
-void init_exp_lut(uint8_t* lut) {
-    for (int i = 0; i < 256; ++i) {
-        float x = (float)(i - 128) / 32.0f;
-        float e = expf(x);
-        if (e > 255.0f) e = 255.0f;
-        lut[i] = (uint8_t)e;
+// The K/V windows DPU i holds of a slot of len rows: the whole slot unless
+// the K/V is split.
+static void part_windows(size_t i, uint32_t len, uint32_t row0[2], uint32_t rows[2]) {
+    if (kv_split()) {
+        mha_kv_windows((uint32_t)(i % kv_parts()), kv_parts(), len, row0, rows);
+        return;
     }
+    row0[0] = row0[1] = 0;
+    rows[0] = len;
+    rows[1] = 0;
 }
 
-void init_input_data(int8_t *arr, int size, int seed_offset) {
+static uint32_t part_rows(size_t i, uint32_t len) {
+    uint32_t row0[2], rows[2];
+    part_windows(i, len, row0, rows);
+    return rows[0] + rows[1];
+}
+
+// Row format in DPU_RESULTS.
+static uint32_t dpu_out_format(void) {
+    return kv_split() ? MHA_OUT_PARTIAL : cfg.out_format;
+}
+
+// DPUs holding the batch at spd slots per DPU.
+static uint32_t dpus_needed(uint32_t spd) {
+    return kv_parts() * ((total_slots + spd - 1) / spd);
+}
+
+// Slots are laid out on the DPUs through pos_slot instead of in order.
+static bool placed(void) {
+    return ragged() || kv_group() > 1;
+}
+
+// K/V of slot h*BATCH_SIZE+b are those of K/V head h/kv_group() and entry b,
+// stored under the slot index of that head's first query head.
+static uint32_t kv_slot(uint32_t slot) {
+    uint32_t h = slot / cfg.batch_size, b = slot % cfg.batch_size;
+    return (h / kv_group()) * cfg.batch_size + b;
+}
+
+// Slot lengths for the CPU backend, NULL when every slot is SEQ_LEN long.
+static const uint32_t *cpu_lens(void) {
+    return ragged() ? slot_len : NULL;
+}
+
+static size_t lens_bytes(void) {
+    return mha_round_up8(cfg.slots_per_dpu * sizeof(uint32_t));
+}
+
+// (query, key) pairs a slot of len rows attends.
+static double slot_pairs(uint32_t len) {
+    return cfg.causal ? (double)len * (len + 1) / 2 : (double)len * len;
+}
+
+static void init_input_data(int8_t *arr, int size, int seed_offset) {
     srand(42 + seed_offset);
     for (int i = 0; i < size; ++i) {
         float val = ((float)rand() / RAND_MAX) * 2.0f - 1.0f;
@@ -40,193 +284,2274 @@ void init_input_data(int8_t *arr, int size, int seed_offset) {
     }
 }
 
-void host_matmul_score_int8(const int8_t* q, const int8_t* k, int32_t* score, int len, int dim) {
-    for (int i = 0; i < len; ++i)
-        for (int j = 0; j < len; ++j) {
-            int32_t s = 0;
-            for (int d = 0; d < dim; ++d) s += (int32_t)q[i*dim + d] * (int32_t)k[j*dim + d];
-            score[i*len + j] = s;
-        }
+static double elapsed_ms(const struct timespec *t0, const struct timespec *t1) {
+    return (t1->tv_sec - t0->tv_sec) * 1000.0 + (t1->tv_nsec - t0->tv_nsec) / 1e6;
+}
+
+static void print_bandwidth(const char *what, size_t bytes, double ms) {
+    printf("%s transfer: %.3f MB in %.3f ms (%.1f MB/s)\n",
+           what, bytes / 1e6, ms, ms > 0.0 ? bytes / 1e3 / ms : 0.0);
+}
+
+// Integer operations of one batch, a multiply-add counting two: q.k and
+// p.V over the attended (query, key) pairs, plus the projection with -E.
+static double batch_ops(void) {
+    double ops = 0.0;
+    for (uint32_t slot = 0; slot < total_slots; ++slot) {
+        ops += 4.0 * slot_pairs(slot_len[slot]) * cfg.head_dim;
+        if (cfg.project) ops += 2.0 * 3 * slot_len[slot] * cfg.embed_dim * cfg.head_dim;
+    }
+    return ops;
+}
+
+// Tokens of one batch: the lengths of its entries, whose heads are the
+// slots h * BATCH + b.
+static double batch_tokens(void) {
+    double tokens = 0.0;
+    for (uint32_t b = 0; b < cfg.batch_size; ++b) tokens += slot_len[b];
+    return tokens;
 }
 
-void host_softmax_int32(int32_t* score, uint8_t* out, int rows, int cols, uint8_t* exp_lut_ptr) {
-    for (int i = 0; i < rows; ++i) {
-        int32_t row_max = score[i*cols];
+static void print_throughput(const char *what, uint32_t nbatches, double ms) {
+    double s = ms / 1e3;
+    printf("%s throughput: %.1f tokens/s, %.3f effective GOPS\n", what,
+           s > 0.0 ? nbatches * batch_tokens() / s : 0.0,
+           s > 0.0 ? nbatches * batch_ops() / s / 1e9 : 0.0);
+}
 
-        for (int j = 1; j < cols; ++j) {
-            if (score[i*cols + j] > row_max) {
-                row_max = score[i*cols + j];
+// Q/K/V of one slot from its embeddings x and the head's transposed weights
+// w_t, requantized exactly like the DPU projection.
+static void host_project_int8(const int8_t* x, const int8_t* w_t, int8_t* q, int8_t* k, int8_t* v,
+                              int len, int dim, int embed, uint32_t shift) {
+    int8_t *dst[3] = { q, k, v };
+    for (int t = 0; t < 3; ++t)
+        for (int i = 0; i < len; ++i)
+            for (int d = 0; d < dim; ++d) {
+                const int8_t *wc = w_t + ((size_t)t * dim + d) * embed;
+                int32_t acc = 0;
+                for (int e = 0; e < embed; ++e) acc += (int32_t)x[(size_t)i*embed + e] * (int32_t)wc[e];
+                dst[t][i*dim + d] = mha_requant(acc, shift);
             }
+}
+
+// Output stage for rows [row0, row1) of the BATCH*SEQ_LEN token rows: the
+// heads of a token are concatenated from the slot-major attention output
+// and multiplied by W_o, giving EMBED_DIM int32 outputs per token.
+static void host_output_projection(const int32_t* attn, int8_t* concat, int32_t* y, const int8_t* wo_t,
+                                   uint32_t row0, uint32_t row1) {
+    const uint32_t width = cfg.num_heads * cfg.head_dim;
+    for (uint32_t row = row0; row < row1; ++row) {
+        uint32_t b = row / cfg.seq_len, s = row % cfg.seq_len;
+        int8_t *c = concat + (size_t)row * width;
+        for (uint32_t h = 0; h < cfg.num_heads; ++h) {
+            const int32_t *src = attn + ((size_t)h * cfg.batch_size + b) * slot_elems + (size_t)s * cfg.head_dim;
+            for (uint32_t d = 0; d < cfg.head_dim; ++d)
+                c[h * cfg.head_dim + d] = mha_requant(src[d], ATTN_OUT_SHIFT);
+        }
+        for (uint32_t e = 0; e < cfg.embed_dim; ++e) {
+            const int8_t *w = wo_t + (size_t)e * width;
+            int32_t acc = 0;
+            for (uint32_t i = 0; i < width; ++i) acc += (int32_t)c[i] * (int32_t)w[i];
+            y[(size_t)row * cfg.embed_dim + e] = acc;
         }
+    }
+}
+
+typedef struct {
+    const int32_t *attn;
+    int8_t *concat;
+    int32_t *y;
+    uint32_t row0, row1;
+    pthread_t thread;
+    bool started;
+} out_proj_task_t;
+
+static void *out_proj_worker(void *arg) {
+    out_proj_task_t *task = arg;
+    host_output_projection(task->attn, task->concat, task->y, input_Wo, task->row0, task->row1);
+    return NULL;
+}
+
+// Token rows are split evenly across cfg.host_threads threads. The calling
+// thread takes the first range, and any range whose thread could not be
+// started.
+static double host_output_projection_mt(const int32_t* attn, int8_t* concat, int32_t* y) {
+    const uint32_t rows = cfg.batch_size * cfg.seq_len;
+    uint32_t nthreads = cfg.host_threads;
+    out_proj_task_t one, *tasks = nthreads > 1 ? malloc(nthreads * sizeof(out_proj_task_t)) : NULL;
+    if (tasks == NULL) {
+        tasks = &one;
+        nthreads = 1;
+    }
+
+    struct timespec ts0, ts1;
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
+
+    for (uint32_t t = 0; t < nthreads; ++t)
+        tasks[t] = (out_proj_task_t){ .attn = attn, .concat = concat, .y = y,
+                                      .row0 = (uint32_t)((uint64_t)rows * t / nthreads),
+                                      .row1 = (uint32_t)((uint64_t)rows * (t + 1) / nthreads) };
+    for (uint32_t t = 1; t < nthreads; ++t)
+        tasks[t].started = pthread_create(&tasks[t].thread, NULL, out_proj_worker, &tasks[t]) == 0;
+    out_proj_worker(&tasks[0]);
+    for (uint32_t t = 1; t < nthreads; ++t)
+        if (!tasks[t].started) out_proj_worker(&tasks[t]);
+    for (uint32_t t = 1; t < nthreads; ++t)
+        if (tasks[t].started) pthread_join(tasks[t].thread, NULL);
+    if (tasks != &one) free(tasks);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    trace_span("output projection", TRACE_LANE_HOST, &ts0, &ts1, 0);
+    return elapsed_ms(&ts0, &ts1);
+}
+
+// V goes to the DPUs as d-major tiles when the packed kernels read it whole
+// from the host's payload. Projected Q/K/V are written row-major on the DPU
+// and the decode cache grows a row at a time, so both keep rows; the tiles
+// also need every tile stride, so every slot length, to stay a multiple of 8.
+static bool v_tiled(void) {
+    return !cfg.byte_kernels && !cfg.project && cfg.kernel != MHA_KERNEL_DECODE && lens_aligned;
+}
+
+// V of one slot of len rows as tiles of KV_TILE_ROWS keys, each stored
+// d-major with its own row count as stride.
+static void pack_v_tiles(const int8_t *v, int8_t *dst, uint32_t len) {
+    for (uint32_t t0 = 0; t0 < len; t0 += KV_TILE_ROWS) {
+        uint32_t rows = len - t0 < KV_TILE_ROWS ? len - t0 : KV_TILE_ROWS;
+        int8_t *tile = dst + (size_t)t0 * cfg.head_dim;
+        for (uint32_t j = 0; j < rows; ++j)
+            for (uint32_t d = 0; d < cfg.head_dim; ++d)
+                tile[(size_t)d * rows + j] = v[(size_t)(t0 + j) * cfg.head_dim + d];
+    }
+}
+
+// Entry lengths of a ragged batch, uniform in [min_len, SEQ_LEN] and shared
+// by the heads of the entry.
+static void init_slot_lengths(void) {
+    srand(600);
+    lens_aligned = cfg.seq_len % 8 == 0;
+    for (uint32_t b = 0; b < cfg.batch_size; ++b) {
+        uint32_t len = ragged() ? cfg.min_len + (uint32_t)rand() % (cfg.seq_len - cfg.min_len + 1) : cfg.seq_len;
+        if (len % 8 != 0) lens_aligned = false;
+        for (uint32_t h = 0; h < cfg.num_heads; ++h) slot_len[(size_t)h * cfg.batch_size + b] = len;
+    }
+}
+
+// Placement units: the kv_group() query heads of one K/V head and batch
+// entry, which must share a DPU. Unit u is K/V head u / BATCH_SIZE of entry
+// u % BATCH_SIZE; with one query head per K/V head unit u is slot u.
+static uint32_t unit_slot(uint32_t u, uint32_t i) {
+    return ((u / cfg.batch_size) * kv_group() + i) * cfg.batch_size + u % cfg.batch_size;
+}
 
-        int32_t sum = 0;
-        uint8_t tmp[SEQ_LEN];
+static int cmp_longer_unit(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    uint32_t lx = slot_len[unit_slot(x, 0)], ly = slot_len[unit_slot(y, 0)];
+    if (lx != ly) return lx > ly ? -1 : 1;
+    return x < y ? -1 : x > y;
+}
 
-        for (int j = 0; j < cols; ++j) {
-            int32_t val = score[i*cols + j] - row_max;
-            int idx = val + 128;
+// Uniform units fill the DPUs in order. Ragged units are placed longest
+// first, each on the DPU with the least work that still has room, the work
+// being the attended pairs: the kernels' cost grows with the square of the
+// length, the transfers only linearly.
+static void assign_slots(void) {
+    const uint32_t spd = cfg.slots_per_dpu;
+    const uint32_t group = kv_group();
+    const uint32_t upd = spd / group;
+    const uint32_t nunits = total_slots / group;
+    const size_t npos = (size_t)nr_dpus * spd;
+    for (size_t p = 0; p < npos; ++p) pos_slot[p] = NO_SLOT;
 
-            if (idx < 0) idx = 0;
-            if (idx > 255) idx = 255;
+    double max_work = 0.0, sum_work = 0.0;
+    if (ragged()) {
+        uint32_t *order = malloc(nunits * sizeof(uint32_t));
+        double *work = calloc(nr_dpus, sizeof(double));
+        uint32_t *fill = calloc(nr_dpus, sizeof(uint32_t));
+        for (uint32_t u = 0; u < nunits; ++u) order[u] = u;
+        qsort(order, nunits, sizeof(uint32_t), cmp_longer_unit);
 
-            tmp[j] = exp_lut_ptr[idx];
-            sum += tmp[j];
+        for (uint32_t k = 0; k < nunits; ++k) {
+            uint32_t best = UINT32_MAX;
+            for (uint32_t i = 0; i < nr_dpus; ++i)
+                if (fill[i] < upd && (best == UINT32_MAX || work[i] < work[best])) best = i;
+            for (uint32_t m = 0; m < group; ++m)
+                pos_slot[(size_t)best * spd + fill[best] * group + m] = unit_slot(order[k], m);
+            ++fill[best];
+            work[best] += group * slot_pairs(slot_len[unit_slot(order[k], 0)]);
+        }
+        for (uint32_t i = 0; i < nr_dpus; ++i) {
+            sum_work += work[i];
+            if (work[i] > max_work) max_work = work[i];
         }
-        for (int j = 0; j < cols; ++j) {
-            out[i*cols + j] = (uint8_t)((tmp[j] * 255) / (sum ? sum : 1));
+        free(order);
+        free(work);
+        free(fill);
+    } else if (kv_split()) {
+        // The DPUs of the parts of a group all hold the group's slots.
+        for (size_t p = 0; p < npos; ++p) {
+            size_t slot = p / spd / kv_parts() * spd + p % spd;
+            if (slot < total_slots) pos_slot[p] = (uint32_t)slot;
+        }
+    } else {
+        // A hybrid set may hold fewer positions than slots.
+        for (uint32_t u = 0; u < nunits && (size_t)u * group < npos; ++u)
+            for (uint32_t m = 0; m < group; ++m)
+                pos_slot[(size_t)u * group + m] = unit_slot(u, m);
+    }
+
+    // Unplaced slots keep their SEQ_LEN rows so the uniform layout stays a
+    // plain slot-major array.
+    dpu_rows = dpu_qkv_rows = 0;
+    for (uint32_t i = 0; i < nr_dpus; ++i) {
+        uint32_t rows = 0, qkv_rows = 0;
+        for (uint32_t ls = 0; ls < spd; ++ls) {
+            size_t p = (size_t)i * spd + ls;
+            uint32_t len = pos_slot[p] != NO_SLOT ? slot_len[pos_slot[p]] : placed() ? 0 : cfg.seq_len;
+            pos_row0[p] = rows;
+            pos_q_row0[p] = qkv_rows + (ls % group) * len;
+            pos_k_row0[p] = qkv_rows + group * len;
+            rows += len;
+            if (ls % group == group - 1) qkv_rows += group * len + 2 * part_rows(i, len);
         }
+        if (rows > dpu_rows) dpu_rows = rows;
+        if (qkv_rows > dpu_qkv_rows) dpu_qkv_rows = qkv_rows;
+    }
+
+    if (ragged()) {
+        uint32_t lo = cfg.seq_len;
+        double tokens = batch_tokens();
+        for (uint32_t b = 0; b < cfg.batch_size; ++b)
+            if (slot_len[b] < lo) lo = slot_len[b];
+        printf("Ragged batch: %u to %u rows per slot (mean %.1f), %u rows per DPU sent instead of %u; "
+               "heaviest DPU %.2fx the mean work\n", lo, cfg.seq_len, tokens / cfg.batch_size, dpu_rows,
+               spd * cfg.seq_len, sum_work > 0.0 ? max_work * nr_dpus / sum_work : 1.0);
     }
+    if (group > 1)
+        printf("Grouped K/V: %u query heads per K/V head, %u Q/K/V rows per DPU instead of %u\n", group,
+               dpu_qkv_rows, 3 * dpu_rows);
 }
 
-void host_attention_output_int8(const uint8_t* score, const int8_t* v, int32_t* out, int len, int dim) {
-    for (int i = 0; i < len; ++i) {
-        for (int d = 0; d < dim; ++d) {
-            int32_t s = 0;
-            for (int j = 0; j < len; ++j) {
-                s += (int32_t)score[i*len + j] * (int32_t)v[j*dim + d];
-            }
-            out[i*dim + d] = s;
+// Launch descriptors handing the first dpu_slots slots to the DPUs,
+// cfg.slots_per_dpu per DPU in order, or the placed slots of a ragged or
+// grouped batch; under a K/V split, to the DPU of each part.
+static void pack_shapes(uint32_t dpu_slots) {
+    uint32_t slot_idx = 0;
+    for (uint32_t i = 0; i < nr_dpus; ++i) {
+        if (kv_split()) {
+            slot_idx = i / kv_parts() * cfg.slots_per_dpu;
+            if (slot_idx > dpu_slots) slot_idx = dpu_slots;
+        }
+        uint32_t remaining = dpu_slots - slot_idx;
+        uint32_t nslots = (remaining >= cfg.slots_per_dpu) ? cfg.slots_per_dpu : remaining;
+        if (placed())
+            for (nslots = 0; nslots < cfg.slots_per_dpu && pos_slot[(size_t)i * cfg.slots_per_dpu + nslots] != NO_SLOT;)
+                ++nslots;
+
+        uint32_t kv_row0[2], kv_rows[2];
+        part_windows(i, cfg.seq_len, kv_row0, kv_rows);
+        mha_shape_t shape = {
+            .seq_len = cfg.seq_len,
+            .head_dim = cfg.head_dim,
+            .nslots = nslots,
+            .slot0 = slot_idx,
+            .nr_tasklets = cfg.nr_tasklets,
+            .kernel = cfg.kernel,
+            .flags = softmax_flags() |
+                     (cfg.project ? MHA_FLAG_PROJECT : 0) |
+                     (cfg.project && cfg.batch_size == 1 ? MHA_FLAG_SHARED_X : 0) |
+                     (cfg.byte_kernels ? 0 : MHA_FLAG_PACKED) |
+                     (v_tiled() ? MHA_FLAG_V_TILED : 0) |
+                     (cfg.static_rows ? MHA_FLAG_STATIC_ROWS : 0) |
+                     (ragged() ? MHA_FLAG_RAGGED : 0) |
+                     (kv_split() ? MHA_FLAG_KV_SPLIT : 0),
+            .embed_dim = cfg.embed_dim,
+            .proj_shift = proj_shift,
+            .out_format = dpu_out_format(),
+            .row_block = cfg.row_block,
+            .lut_shift = lut_shift,
+            .kv_group = kv_group(),
+            .kv_row0 = { kv_row0[0], kv_row0[1] },
+            .kv_rows = { kv_rows[0], kv_rows[1] },
+        };
+        dpu_shapes[i] = shape;
+        slot_idx += nslots;
+    }
+}
+
+// Bytes of the per-run activation payload of one DPU: Q/K/V per slot, or
+// the packed Q/K/V of the fullest DPU of a ragged, grouped or K/V split
+// batch, or embeddings per slot, or a single broadcast embedding block.
+static size_t payload_bytes_per_dpu(void) {
+    if (placed() || kv_split()) return (size_t)dpu_qkv_rows * cfg.head_dim;
+    if (!cfg.project) return (size_t)cfg.slots_per_dpu * 3 * slot_elems;
+    size_t x_bytes = (size_t)cfg.seq_len * cfg.embed_dim;
+    return cfg.batch_size == 1 ? x_bytes : cfg.slots_per_dpu * x_bytes;
+}
+
+// Copies one slot of len rows, its Q, K and V starting at q, k and v, to
+// position p.
+static void pack_slot(size_t p, const int8_t *q, const int8_t *k, const int8_t *v, uint32_t len) {
+    const uint32_t spd = cfg.slots_per_dpu;
+    int8_t *dpu = dpu_payload + (p / spd) * payload_bytes_per_dpu();
+    memcpy(dpu + (size_t)pos_q_row0[p] * cfg.head_dim, q, (size_t)len * cfg.head_dim);
+    if (p % kv_group() == 0) {
+        uint32_t row0[2], rows[2];
+        part_windows(p / spd, len, row0, rows);
+        size_t kv_elems = (size_t)(rows[0] + rows[1]) * cfg.head_dim;
+        int8_t *dst = dpu + (size_t)pos_k_row0[p] * cfg.head_dim;
+        // The windows are stored back to back; the first one is whole tiles
+        // whenever the second is not empty, so V's tiles stay aligned.
+        for (int w = 0; w < 2; dst += (size_t)rows[w++] * cfg.head_dim) {
+            size_t kv_off = (size_t)row0[w] * cfg.head_dim;
+            memcpy(dst, k + kv_off, (size_t)rows[w] * cfg.head_dim);
+            if (v_tiled())
+                pack_v_tiles(v + kv_off, dst + kv_elems, rows[w]);
+            else
+                memcpy(dst + kv_elems, v + kv_off, (size_t)rows[w] * cfg.head_dim);
         }
     }
+    if (ragged()) dpu_lens[(p / spd) * (lens_bytes() / sizeof(uint32_t)) + p % spd] = len;
+}
+
+// Each DPU receives one contiguous payload holding, slot after slot, the Q, K
+// and V of that slot, or for a group of slots sharing K/V their Q and then
+// the group's K and V. DPU i owns the slots at positions [i*slots_per_dpu,
+// (i+1)*slots_per_dpu), which are slots [i*slots_per_dpu,
+// (i+1)*slots_per_dpu) unless the batch is ragged, grouped or K/V split; a
+// split DPU gets the K and V rows of its two windows only.
+static void pack_inputs(void) {
+    // With projection, local slot ls gets the embeddings of its batch entry
+    // and the weights of its head instead of Q/K/V; a single batch entry is
+    // broadcast once.
+    size_t x_bytes = (size_t)cfg.seq_len * cfg.embed_dim;
+    size_t w_bytes = (size_t)3 * cfg.head_dim * cfg.embed_dim;
+    for (uint32_t slot = 0; cfg.project && slot < total_slots; ++slot) {
+        if (cfg.batch_size > 1)
+            memcpy(dpu_x_payload + slot * x_bytes, input_X + (slot % cfg.batch_size) * x_bytes, x_bytes);
+        memcpy(dpu_w_payload + slot * w_bytes, input_W + (slot / cfg.batch_size) * w_bytes, w_bytes);
+    }
+
+    // Slots are packed back to back at their positions, each only as long
+    // as its own rows.
+    const uint32_t spd = cfg.slots_per_dpu;
+    for (size_t p = 0; !cfg.project && p < (size_t)nr_dpus * spd; ++p) {
+        uint32_t slot = pos_slot[p];
+        if (slot == NO_SLOT) continue;
+        size_t off = (size_t)slot * slot_elems;
+        pack_slot(p, input_Q + off, input_K + off, input_V + off, slot_len[slot]);
+    }
+
+    pack_shapes(total_slots);
+}
+
+// Host-side layout of the batch over nr_dpus DPUs, slots_per_dpu each.
+// Every DPU transfers the same length, so the payload is padded to whole DPUs.
+static void layout_batch(void) {
+    size_t padded_slots = (size_t)nr_dpus * cfg.slots_per_dpu;
+    pos_slot = malloc(padded_slots * sizeof(uint32_t));
+    pos_row0 = malloc(padded_slots * sizeof(uint32_t));
+    pos_q_row0 = malloc(padded_slots * sizeof(uint32_t));
+    pos_k_row0 = malloc(padded_slots * sizeof(uint32_t));
+    dpu_lens = calloc(nr_dpus, lens_bytes());
+    stats.slots_per_dpu = cfg.slots_per_dpu;
+    assign_slots();
+
+    dpu_payload = placed() || kv_split() ? calloc(nr_dpus, payload_bytes_per_dpu()) : calloc(padded_slots * 3, slot_elems);
+    dpu_shapes = calloc(nr_dpus, sizeof(mha_shape_t));
+    if (cfg.project) {
+        size_t x_bytes = (size_t)cfg.seq_len * cfg.embed_dim;
+        size_t w_bytes = (size_t)3 * cfg.head_dim * cfg.embed_dim;
+        dpu_x_payload = cfg.batch_size > 1 ? calloc(padded_slots, x_bytes) : NULL;
+        dpu_w_payload = calloc(padded_slots, w_bytes);
+    }
+    pack_inputs();
 }
 
-void host_compute_reference() {
+static void free_layout(void) {
+    free(pos_slot);
+    free(pos_row0);
+    free(pos_q_row0);
+    free(pos_k_row0);
+    free(dpu_lens);
+    free(dpu_payload);
+    free(dpu_shapes);
+    free(dpu_x_payload);
+    free(dpu_w_payload);
+    pos_slot = pos_row0 = pos_q_row0 = pos_k_row0 = dpu_lens = NULL;
+    dpu_payload = dpu_x_payload = dpu_w_payload = NULL;
+    dpu_shapes = NULL;
+}
+
+// Projection weights only travel once per DPU set and stay in MRAM, unless
+// the batch takes several launch rounds.
+static size_t scatter_weights_bytes(void) {
+    return (size_t)nr_dpus * cfg.slots_per_dpu * 3 * cfg.head_dim * cfg.embed_dim;
+}
+
+static double scatter_weights(struct dpu_set_t set) {
+    struct dpu_set_t dpu;
+    uint32_t dpu_idx;
+    size_t w_bytes = (size_t)cfg.slots_per_dpu * 3 * cfg.head_dim * cfg.embed_dim;
+
     struct timespec ts0, ts1;
     clock_gettime(CLOCK_MONOTONIC, &ts0);
 
-    for (int h = 0; h < NUM_HEADS; ++h) {
-        for (int b = 0; b < BATCH_SIZE; ++b) {
-            int slot = h * BATCH_SIZE + b;
-            int8_t* q = input_Q + (size_t)slot * SEQ_LEN * HEAD_DIM;
-            int8_t* k = input_K + (size_t)slot * SEQ_LEN * HEAD_DIM;
-            int8_t* v = input_V + (size_t)slot * SEQ_LEN * HEAD_DIM;
+    if (cfg.serial_xfer) {
+        DPU_FOREACH(set, dpu, dpu_idx) {
+            DPU_ASSERT(dpu_copy_to(dpu, "DPU_W", 0, dpu_w_payload + (round_first + dpu_idx) * w_bytes, w_bytes));
+        }
+    } else {
+        DPU_FOREACH(set, dpu, dpu_idx) {
+            DPU_ASSERT(dpu_prepare_xfer(dpu, dpu_w_payload + (round_first + dpu_idx) * w_bytes));
+        }
+        DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, "DPU_W", 0, w_bytes, DPU_XFER_DEFAULT));
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    trace_span("push weights", TRACE_LANE_HOST, &ts0, &ts1, scatter_weights_bytes() / nr_rounds);
+    return elapsed_ms(&ts0, &ts1);
+}
+
+static size_t scatter_bytes(void) {
+    return (size_t)nr_dpus * (payload_bytes_per_dpu() + sizeof(mha_shape_t) + sizeof(exp_lut) +
+                              (ragged() ? lens_bytes() : 0));
+}
+
+static double scatter_inputs(struct dpu_set_t set) {
+    struct dpu_set_t dpu;
+    uint32_t dpu_idx;
+    size_t payload_bytes = payload_bytes_per_dpu();
+    const char *payload_sym = cfg.project ? "DPU_X" : "DPU_QKV";
+    const bool shared_x = cfg.project && cfg.batch_size == 1;
+    int8_t *payload = shared_x ? input_X : cfg.project ? dpu_x_payload : dpu_payload;
+
+    struct timespec ts0, ts1;
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
 
-            int32_t score[SEQ_LEN * SEQ_LEN];
-            uint8_t score_u8[SEQ_LEN * SEQ_LEN];
-            int32_t out[SEQ_LEN * HEAD_DIM];
+    if (cfg.serial_xfer) {
+        DPU_FOREACH(set, dpu, dpu_idx) {
+            size_t i = round_first + dpu_idx;
+            size_t off = shared_x ? 0 : i * payload_bytes;
+            DPU_ASSERT(dpu_copy_to(dpu, payload_sym, 0, payload + off, payload_bytes));
+            DPU_ASSERT(dpu_copy_to(dpu, "DPU_SHAPE", 0, &dpu_shapes[i], sizeof(mha_shape_t)));
+            if (ragged())
+                DPU_ASSERT(dpu_copy_to(dpu, "DPU_SLOT_LENS", 0, (uint8_t*)dpu_lens + i * lens_bytes(), lens_bytes()));
+        }
+        DPU_ASSERT(dpu_copy_to(set, "DPU_EXP_LUT", 0, exp_lut, sizeof(exp_lut)));
+    } else {
+        if (shared_x) {
+            DPU_ASSERT(dpu_broadcast_to(set, "DPU_X", 0, input_X, payload_bytes, DPU_XFER_DEFAULT));
+        } else {
+            DPU_FOREACH(set, dpu, dpu_idx) {
+                DPU_ASSERT(dpu_prepare_xfer(dpu, payload + (round_first + dpu_idx) * payload_bytes));
+            }
+            DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, payload_sym, 0, payload_bytes, DPU_XFER_DEFAULT));
+        }
 
-            host_matmul_score_int8(q, k, score, SEQ_LEN, HEAD_DIM);
-            host_softmax_int32(score, score_u8, SEQ_LEN, SEQ_LEN, exp_lut);
-            host_attention_output_int8(score_u8, v, out, SEQ_LEN, HEAD_DIM);
+        DPU_FOREACH(set, dpu, dpu_idx) {
+            DPU_ASSERT(dpu_prepare_xfer(dpu, &dpu_shapes[round_first + dpu_idx]));
+        }
+        DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, "DPU_SHAPE", 0, sizeof(mha_shape_t), DPU_XFER_DEFAULT));
 
-            for (int i = 0; i < SEQ_LEN * HEAD_DIM; ++i) {
-                host_results.heads[slot].out[i] = out[i];
+        if (ragged()) {
+            DPU_FOREACH(set, dpu, dpu_idx) {
+                DPU_ASSERT(dpu_prepare_xfer(dpu, (uint8_t*)dpu_lens + (round_first + dpu_idx) * lens_bytes()));
             }
-            host_results.heads[slot].cycles = 0;
+            DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, "DPU_SLOT_LENS", 0, lens_bytes(), DPU_XFER_DEFAULT));
         }
+
+        DPU_ASSERT(dpu_broadcast_to(set, "DPU_EXP_LUT", 0, exp_lut, sizeof(exp_lut), DPU_XFER_DEFAULT));
     }
 
     clock_gettime(CLOCK_MONOTONIC, &ts1);
-    double host_ms = (ts1.tv_sec - ts0.tv_sec) * 1000.0 + (ts1.tv_nsec - ts0.tv_nsec) / 1e6;
-    printf("Host total computation time: %.3f ms\n", host_ms);
+    trace_span("push inputs", TRACE_LANE_HOST, &ts0, &ts1, scatter_bytes() / nr_rounds);
+    return elapsed_ms(&ts0, &ts1);
 }
 
-void compare_and_print() {
-    bool equal = true;
-    for (int h = 0; h < NUM_HEADS; ++h) {
-        for (int b = 0; b < BATCH_SIZE; ++b) {
-            int slot = h * BATCH_SIZE + b;
-            for (int i = 0; i < SEQ_LEN * HEAD_DIM; ++i) {
-                float dpu_val = (float)dpu_results.heads[slot].out[i] / ((float)QK_SCALE * (float)V_SCALE);
-                float host_val = (float)host_results.heads[slot].out[i] / ((float)QK_SCALE * (float)V_SCALE);
-                float diff = fabs(host_val - dpu_val);
-                
-                if (diff > 1e-2f) {
-                    equal = false;
-                }
+static const char *out_format_name(uint32_t fmt) {
+    return fmt == MHA_OUT_PARTIAL ? "partial" : fmt == MHA_OUT_INT8 ? "int8" : fmt == MHA_OUT_INT16 ? "int16" : "int32";
+}
+
+// Expands nrows compact output records into int32 rows.
+static void unpack_rows(const uint8_t *src, int32_t *dst, size_t nrows) {
+    const uint32_t rec_bytes = mha_out_row_bytes(cfg.head_dim, cfg.out_format);
+    for (size_t r = 0; r < nrows; ++r) {
+        const uint8_t *rec = src + r * rec_bytes;
+        int32_t *row = dst + r * cfg.head_dim;
+        uint32_t shift;
+        memcpy(&shift, rec + rec_bytes - 8, sizeof(shift));
+
+        for (uint32_t d = 0; d < cfg.head_dim; ++d) {
+            int32_t v;
+            if (cfg.out_format == MHA_OUT_INT8) {
+                v = (int8_t)rec[d];
+            } else {
+                int16_t v16;
+                memcpy(&v16, rec + 2 * d, sizeof(v16));
+                v = v16;
             }
+            row[d] = v * (1 << shift);
         }
     }
+}
 
-    printf("\n--- DPU cycles summary ---\n");
+// DPU_RESULTS rows of one DPU: every slot's SEQ_LEN rows, or the packed rows
+// of the fullest DPU of a ragged or grouped batch.
+static size_t result_rows_per_dpu(void) {
+    return placed() ? dpu_rows : (size_t)cfg.slots_per_dpu * cfg.seq_len;
+}
 
-    uint64_t total_cycles = 0;
-    for (int slot = 0; slot < TOTAL_SLOTS; ++slot) {
-        uint64_t c = dpu_results.heads[slot].cycles;
-        total_cycles += c;
+// Compact, placed and partial results are pulled into res->packed and
+// unpacked into res->out; int32 rows of slots in order land in res->out
+// directly.
+static bool raw_results(void) {
+    return dpu_out_format() != MHA_OUT_INT32 || placed();
+}
+
+// Placed rows go back to their slot's SEQ_LEN-row place, the rows past its
+// length zeroed like the CPU backend's.
+static void unpack_placed(mha_results_t *res) {
+    const uint32_t spd = cfg.slots_per_dpu;
+    const uint32_t rec_bytes = mha_out_row_bytes(cfg.head_dim, cfg.out_format);
+    for (size_t p = 0; p < (size_t)nr_dpus * spd; ++p) {
+        uint32_t slot = pos_slot[p];
+        if (slot == NO_SLOT) continue;
+        const uint8_t *src = res->packed + ((p / spd) * dpu_rows + pos_row0[p]) * rec_bytes;
+        int32_t *dst = res->out + (size_t)slot * slot_elems;
+        size_t elems = (size_t)slot_len[slot] * cfg.head_dim;
+        if (cfg.out_format != MHA_OUT_INT32) unpack_rows(src, dst, slot_len[slot]);
+        else memcpy(dst, src, elems * sizeof(int32_t));
+        memset(dst + elems, 0, (slot_elems - elems) * sizeof(int32_t));
     }
+}
 
-    double avg_cycles = (double)total_cycles / (double)TOTAL_SLOTS;
-    double avg_ms = avg_cycles / 350000.0;
+// Every row of a K/V split merges the partials of its slot's parts, which
+// sit on consecutive DPUs at the same place.
+static void merge_split(mha_results_t *res) {
+    const uint32_t spd = cfg.slots_per_dpu;
+    const size_t rec = mha_out_row_bytes(cfg.head_dim, MHA_OUT_PARTIAL) / sizeof(int32_t);
+    const size_t stride = result_rows_per_dpu() * rec;
+    const int32_t *parts = (const int32_t*)res->packed;
+    for (uint32_t slot = 0; slot < total_slots; ++slot) {
+        size_t p = (size_t)slot / spd * kv_parts() * spd + slot % spd;
+        const int32_t *src = parts + ((p / spd) * result_rows_per_dpu() + pos_row0[p]) * rec;
+        for (uint32_t r = 0; r < cfg.seq_len; ++r)
+            host_cpu_merge_partials(src + r * rec, stride, kv_parts(), cfg.head_dim,
+                                    res->out + (size_t)slot * slot_elems + (size_t)r * cfg.head_dim);
+    }
+}
 
-    printf("Total cycles (sum over all slots): %llu\n", (unsigned long long)total_cycles);
-    printf("Average cycles per slot: %.0f (%.3f ms)\n", avg_cycles, avg_ms);
+static double unpack_results(mha_results_t *res) {
+    struct timespec ts0, ts1;
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
+    if (kv_split())
+        merge_split(res);
+    else if (placed())
+        unpack_placed(res);
+    else if (cfg.out_format != MHA_OUT_INT32)
+        unpack_rows(res->packed, res->out, (size_t)nr_dpus * cfg.slots_per_dpu * cfg.seq_len);
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    if (raw_results()) trace_span(kv_split() ? "merge partials" : "unpack", TRACE_LANE_HOST, &ts0, &ts1, 0);
+    return elapsed_ms(&ts0, &ts1);
+}
 
-    if (equal) {
-        printf("Host == DPU\n");
+static size_t gather_bytes(void) {
+    return (size_t)nr_dpus * (result_rows_per_dpu() * mha_out_row_bytes(cfg.head_dim, dpu_out_format()) +
+                              (size_t)cfg.slots_per_dpu * sizeof(uint64_t));
+}
+
+static double gather_results(struct dpu_set_t set, mha_results_t *res) {
+    struct dpu_set_t dpu;
+    uint32_t dpu_idx;
+    size_t out_bytes = result_rows_per_dpu() * mha_out_row_bytes(cfg.head_dim, dpu_out_format());
+    uint8_t *out = raw_results() ? res->packed : (uint8_t*)res->out;
+    size_t cycles_bytes = (size_t)cfg.slots_per_dpu * sizeof(uint64_t);
+
+    struct timespec ts0, ts1;
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
+
+    if (cfg.serial_xfer) {
+        DPU_FOREACH(set, dpu, dpu_idx) {
+            size_t i = round_first + dpu_idx;
+            DPU_ASSERT(dpu_copy_from(dpu, "DPU_RESULTS", 0, out + i * out_bytes, out_bytes));
+            DPU_ASSERT(dpu_copy_from(dpu, "DPU_CYCLES", 0, &res->cycles[i * cfg.slots_per_dpu], cycles_bytes));
+        }
     } else {
-        printf("Host != DPU\n");
+        DPU_FOREACH(set, dpu, dpu_idx) {
+            DPU_ASSERT(dpu_prepare_xfer(dpu, out + (round_first + dpu_idx) * out_bytes));
+        }
+        DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "DPU_RESULTS", 0, out_bytes, DPU_XFER_DEFAULT));
+
+        DPU_FOREACH(set, dpu, dpu_idx) {
+            DPU_ASSERT(dpu_prepare_xfer(dpu, &res->cycles[(round_first + dpu_idx) * cfg.slots_per_dpu]));
+        }
+        DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "DPU_CYCLES", 0, cycles_bytes, DPU_XFER_DEFAULT));
     }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    trace_span("pull results", TRACE_LANE_HOST, &ts0, &ts1, gather_bytes() / nr_rounds);
+    return elapsed_ms(&ts0, &ts1);
 }
 
-int main(void) {
-    struct dpu_set_t set, dpu;
-    uint32_t nr_dpus = NR_DPUS; 
+// Per-tasklet cycles of the last launch, averaged over the DPUs holding
+// slots: busy is the launch total minus the cycles spent waiting at barriers.
+// With launch rounds, the last launch is the last round's. Only the full
+// kernel hands out rows, from a shared counter or as static ranges; the
+// tiled and decode kernels run their tasklets in lockstep.
+static void print_tasklet_balance(struct dpu_set_t set) {
+    struct dpu_set_t dpu;
+    uint32_t dpu_idx;
+    uint64_t cycles[2 * NR_TASKLETS];
+    double busy[NR_TASKLETS] = { 0 }, idle[NR_TASKLETS] = { 0 };
+    uint32_t ndpus = 0;
 
-    DPU_ASSERT(dpu_alloc(nr_dpus, NULL, &set));
-    DPU_ASSERT(dpu_load(set, DPU_BINARY, NULL));
-    DPU_ASSERT(dpu_get_nr_dpus(set, &nr_dpus));
-    printf("DPUs allocated: %u\n", nr_dpus);
+    DPU_FOREACH(set, dpu, dpu_idx) {
+        if (dpu_shapes[round_first + dpu_idx].nslots == 0) continue;
+        DPU_ASSERT(dpu_copy_from(dpu, "DPU_TASKLET_CYCLES", 0, cycles, sizeof(cycles)));
+        for (uint32_t t = 0; t < cfg.nr_tasklets; ++t) {
+            idle[t] += (double)cycles[t];
+            busy[t] += (double)(cycles[NR_TASKLETS + t] - cycles[t]);
+        }
+        ++ndpus;
+    }
+    if (ndpus == 0) return;
 
-    if (nr_dpus != NR_DPUS) {
-        fprintf(stderr, "Error: expected %u DPUs but got %u\n", NR_DPUS, nr_dpus);
-        DPU_ASSERT(dpu_free(set));
-        return 1;
+    double total_busy = 0, total = 0, worst_busy = 1.0;
+    const char *rows = cfg.kernel != MHA_KERNEL_FULL ? "lockstep" : cfg.static_rows ? "static rows" : "dynamic rows";
+    printf("\n--- Tasklet balance (%s, mean over %u DPUs) ---\n", rows, ndpus);
+    for (uint32_t t = 0; t < cfg.nr_tasklets; ++t) {
+        double b = busy[t] / ndpus, i = idle[t] / ndpus;
+        double share = b + i > 0 ? b / (b + i) : 1.0;
+        printf("Tasklet %2u: busy %10.0f idle %10.0f cycles (%5.1f%% busy)\n", t, b, i, 100.0 * share);
+        total_busy += b;
+        total += b + i;
+        if (share < worst_busy) worst_busy = share;
     }
+    printf("Tasklet idle share: %.1f%% (worst tasklet %.1f%% busy)\n",
+           total > 0 ? 100.0 * (1.0 - total_busy / total) : 0.0, 100.0 * worst_busy);
+}
+
+#ifdef MHA_PROFILE
+static const char *phase_names[MHA_PHASES] = { "dma", "qk", "softmax", "av", "writeback", "project", "barrier",
+                                               "other" };
 
-    size_t total_elems_per_slot = (size_t)SEQ_LEN * HEAD_DIM;
-    size_t total_bytes_per_slot = total_elems_per_slot * sizeof(int8_t);
+// Profiling build: DPU_PROFILE of every DPU holding slots. A DPU's phase
+// cycles are the mean over its active tasklets; the breakdown gives their
+// mean, min and max across DPUs and the mean's share of the launch.
+static void print_profile(struct dpu_set_t set) {
+    struct dpu_set_t dpu;
+    uint32_t dpu_idx;
+    uint64_t prof[NR_TASKLETS * MHA_PHASES];
+    double sum[MHA_PHASES] = { 0 }, lo[MHA_PHASES], hi[MHA_PHASES] = { 0 };
+    uint32_t ndpus = 0;
 
-    for (int h = 0; h < NUM_HEADS; ++h) {
-        for (int b = 0; b < BATCH_SIZE; ++b) {
-            int slot = h * BATCH_SIZE + b;
-            init_input_data(input_Q + (size_t)slot * total_elems_per_slot, (int)total_elems_per_slot, 1 + slot);
-            init_input_data(input_K + (size_t)slot * total_elems_per_slot, (int)total_elems_per_slot, 100 + slot);
-            init_input_data(input_V + (size_t)slot * total_elems_per_slot, (int)total_elems_per_slot, 200 + slot);
+    for (uint32_t p = 0; p < MHA_PHASES; ++p) lo[p] = INFINITY;
+    DPU_FOREACH(set, dpu, dpu_idx) {
+        if (dpu_shapes[round_first + dpu_idx].nslots == 0) continue;
+        DPU_ASSERT(dpu_copy_from(dpu, "DPU_PROFILE", 0, prof, sizeof(prof)));
+        for (uint32_t p = 0; p < MHA_PHASES; ++p) {
+            double c = 0;
+            for (uint32_t t = 0; t < cfg.nr_tasklets; ++t) c += (double)prof[t * MHA_PHASES + p];
+            c /= cfg.nr_tasklets;
+            sum[p] += c;
+            if (c < lo[p]) lo[p] = c;
+            if (c > hi[p]) hi[p] = c;
         }
+        ++ndpus;
     }
+    if (ndpus == 0) return;
 
-    init_exp_lut(exp_lut);
+    double total = 0;
+    for (uint32_t p = 0; p < MHA_PHASES; ++p) total += sum[p] / ndpus;
+    printf("\n--- DPU phase profile (cycles per tasklet, over %u DPUs) ---\n", ndpus);
+    for (uint32_t p = 0; p < MHA_PHASES; ++p) {
+        double mean = sum[p] / ndpus;
+        printf("Profile %s: mean %.0f min %.0f max %.0f cycles (%.1f%%)\n", phase_names[p], mean, lo[p], hi[p],
+               total > 0 ? 100.0 * mean / total : 0.0);
+    }
+}
+#endif
 
-    size_t matrix_size = total_bytes_per_slot; 
-    uint32_t slot_idx = 0;
-    uint32_t dpu_idx = 0;
+// Results are allocated for whole DPUs because every DPU pulls the same length,
+// and for at least every slot when the CPU takes part of the batch.
+static void alloc_results(mha_results_t *res) {
+    size_t padded_slots = (size_t)nr_dpus * cfg.slots_per_dpu;
+    if (padded_slots < total_slots) padded_slots = total_slots;
+    res->out = malloc(padded_slots * slot_elems * sizeof(int32_t));
+    res->cycles = malloc(padded_slots * sizeof(uint64_t));
+    size_t raw_rows = placed() ? (size_t)nr_dpus * dpu_rows : padded_slots * cfg.seq_len;
+    res->packed = raw_results() ? malloc(raw_rows * mha_out_row_bytes(cfg.head_dim, dpu_out_format())) : NULL;
+}
 
-    DPU_FOREACH(set, dpu, dpu_idx) {
-        uint32_t remaining = TOTAL_SLOTS - slot_idx;
-        uint32_t nslots = (remaining >= SLOTS_PER_DPU) ? SLOTS_PER_DPU : remaining;
+static void free_results(mha_results_t *res) {
+    free(res->out);
+    free(res->cycles);
+    free(res->packed);
+}
 
-        size_t bytes = (size_t)nslots * matrix_size;
-        DPU_ASSERT(dpu_copy_to(dpu, "DPU_Q", 0, input_Q + (size_t)slot_idx * matrix_size, bytes));
-        DPU_ASSERT(dpu_copy_to(dpu, "DPU_K", 0, input_K + (size_t)slot_idx * matrix_size, bytes));
-        DPU_ASSERT(dpu_copy_to(dpu, "DPU_V", 0, input_V + (size_t)slot_idx * matrix_size, bytes));
+// Cache row a slot appends at when the longest slot appends at pos: every
+// slot decodes the last tokens of its own length.
+static uint32_t slot_pos(uint32_t slot, uint32_t pos) {
+    return pos - (cfg.seq_len - slot_len[slot]);
+}
 
-        uint64_t n64 = (uint64_t)nslots;
-        uint64_t head0_64 = (uint64_t)slot_idx;
-        
-        DPU_ASSERT(dpu_copy_to(dpu, "DPU_NHEADS64", 0, &n64, sizeof(uint64_t)));
-        DPU_ASSERT(dpu_copy_to(dpu, "DPU_HEAD0_64", 0, &head0_64, sizeof(uint64_t)));
+// Decode step at cache row pos: the new token's q, k and v rows of every slot,
+// laid out per DPU the way DPU_STEP expects them.
+static void pack_step(uint32_t pos) {
+    for (size_t p = 0; p < (size_t)nr_dpus * cfg.slots_per_dpu; ++p) {
+        uint32_t slot = pos_slot[p];
+        if (slot == NO_SLOT) continue;
+        int8_t *dst = step_payload + p * 3 * cfg.head_dim;
+        size_t row = (size_t)slot * slot_elems + (size_t)slot_pos(slot, pos) * cfg.head_dim;
+        memcpy(dst, input_Q + row, cfg.head_dim);
+        memcpy(dst + cfg.head_dim, input_K + row, cfg.head_dim);
+        memcpy(dst + 2 * cfg.head_dim, input_V + row, cfg.head_dim);
+    }
+    for (uint32_t i = 0; i < nr_dpus; ++i)
+        dpu_shapes[i].pos = pos;
+}
 
-        slot_idx += nslots;
+static size_t scatter_step_bytes(void) {
+    return (size_t)nr_dpus * ((size_t)cfg.slots_per_dpu * 3 * cfg.head_dim + sizeof(mha_shape_t));
+}
+
+static double scatter_step(struct dpu_set_t set) {
+    struct dpu_set_t dpu;
+    uint32_t dpu_idx;
+    size_t step_bytes = (size_t)cfg.slots_per_dpu * 3 * cfg.head_dim;
+
+    struct timespec ts0, ts1;
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
+
+    if (cfg.serial_xfer) {
+        DPU_FOREACH(set, dpu, dpu_idx) {
+            DPU_ASSERT(dpu_copy_to(dpu, "DPU_STEP", 0, step_payload + (size_t)dpu_idx * step_bytes, step_bytes));
+            DPU_ASSERT(dpu_copy_to(dpu, "DPU_SHAPE", 0, &dpu_shapes[dpu_idx], sizeof(mha_shape_t)));
+        }
+    } else {
+        DPU_FOREACH(set, dpu, dpu_idx) {
+            DPU_ASSERT(dpu_prepare_xfer(dpu, step_payload + (size_t)dpu_idx * step_bytes));
+        }
+        DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, "DPU_STEP", 0, step_bytes, DPU_XFER_DEFAULT));
+
+        DPU_FOREACH(set, dpu, dpu_idx) {
+            DPU_ASSERT(dpu_prepare_xfer(dpu, &dpu_shapes[dpu_idx]));
+        }
+        DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, "DPU_SHAPE", 0, sizeof(mha_shape_t), DPU_XFER_DEFAULT));
     }
 
-    DPU_ASSERT(dpu_copy_to(set, "DPU_EXP_LUT", 0, exp_lut, sizeof(exp_lut)));
-    DPU_ASSERT(dpu_launch(set, DPU_SYNCHRONOUS));
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    trace_span("push step", TRACE_LANE_HOST, &ts0, &ts1, scatter_step_bytes());
+    return elapsed_ms(&ts0, &ts1);
+}
 
-    dpu_idx = 0;
-    slot_idx = 0;
-  
-    DPU_FOREACH(set, dpu, dpu_idx) {
-        uint32_t remaining = TOTAL_SLOTS - slot_idx;
-        uint32_t nslots = (remaining >= SLOTS_PER_DPU) ? SLOTS_PER_DPU : remaining;
-        size_t bytes = (size_t)nslots * sizeof(mha_result_t);
-        DPU_ASSERT(dpu_copy_from(dpu, "DPU_RESULTS", 0, &dpu_results.heads[slot_idx], bytes));
-        slot_idx += nslots;
+static size_t gather_step_bytes(void) {
+    return (size_t)nr_dpus * cfg.slots_per_dpu * (mha_out_row_bytes(cfg.head_dim, cfg.out_format) + sizeof(uint64_t));
+}
+
+// Pulls one output record per slot into out, slot-major, and the slot cycles.
+static double gather_step(struct dpu_set_t set, uint8_t *out, uint64_t *cycles) {
+    struct dpu_set_t dpu;
+    uint32_t dpu_idx;
+    size_t out_bytes = (size_t)cfg.slots_per_dpu * mha_out_row_bytes(cfg.head_dim, cfg.out_format);
+    size_t cycles_bytes = (size_t)cfg.slots_per_dpu * sizeof(uint64_t);
+
+    struct timespec ts0, ts1;
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
+
+    if (cfg.serial_xfer) {
+        DPU_FOREACH(set, dpu, dpu_idx) {
+            size_t slot0 = (size_t)dpu_idx * cfg.slots_per_dpu;
+            DPU_ASSERT(dpu_copy_from(dpu, "DPU_RESULTS", 0, out + (size_t)dpu_idx * out_bytes, out_bytes));
+            DPU_ASSERT(dpu_copy_from(dpu, "DPU_CYCLES", 0, &cycles[slot0], cycles_bytes));
+        }
+    } else {
+        DPU_FOREACH(set, dpu, dpu_idx) {
+            DPU_ASSERT(dpu_prepare_xfer(dpu, out + (size_t)dpu_idx * out_bytes));
+        }
+        DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "DPU_RESULTS", 0, out_bytes, DPU_XFER_DEFAULT));
+
+        DPU_FOREACH(set, dpu, dpu_idx) {
+            DPU_ASSERT(dpu_prepare_xfer(dpu, &cycles[(size_t)dpu_idx * cfg.slots_per_dpu]));
+        }
+        DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "DPU_CYCLES", 0, cycles_bytes, DPU_XFER_DEFAULT));
     }
 
-    host_compute_reference();
-    compare_and_print();
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    trace_span("pull step", TRACE_LANE_HOST, &ts0, &ts1, gather_step_bytes());
+    return elapsed_ms(&ts0, &ts1);
+}
 
-    DPU_ASSERT(dpu_free(set));
-    return 0;
+// The reference runs on the CPU backend, which reproduces the arithmetic of
+// the selected DPU kernel exactly; decode rows are full-kernel causal rows.
+static double host_cpu_run(int32_t *out) {
+    struct timespec ts0, ts1;
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
+
+    host_cpu_attention(input_Q, input_K, input_V, out, total_slots, cfg.seq_len, cpu_lens(), cfg.head_dim,
+                       cfg.kernel == MHA_KERNEL_TILED ? MHA_KERNEL_TILED : MHA_KERNEL_FULL, softmax_flags(),
+                       exp_lut, lut_shift, kv_split() ? kv_parts() : 0, cfg.host_threads, cfg.cpu_isa);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    trace_span("cpu attention", TRACE_LANE_HOST, &ts0, &ts1, 0);
+    return elapsed_ms(&ts0, &ts1);
+}
+
+static void host_compute_reference(void) {
+    double ms = host_cpu_run(host_results.out);
+    memset(host_results.cycles, 0, total_slots * sizeof(uint64_t));
+    stats.host_ms = ms;
+    printf("Host total computation time: %.3f ms (%u threads, %s)\n",
+           ms, cfg.host_threads, host_cpu_isa_name(cfg.cpu_isa));
+}
+
+// Float attention of the same int8 inputs, softmax(q.k / (QK_SCALE^2 *
+// sqrt(HEAD_DIM))) weighting V. The integer rows carry 255 times that, so
+// errors are reported in units of V after dividing by 255.
+static void report_accuracy(const int32_t *out) {
+    double max_err = 0.0, sum_err = 0.0;
+    double scale = 1.0 / ((double)QK_SCALE * QK_SCALE * sqrt((double)cfg.head_dim));
+    double *p = malloc(cfg.seq_len * sizeof(double));
+
+    double nvalues = 0.0;
+    for (size_t slot = 0; slot < total_slots; ++slot) {
+        const int8_t *q = input_Q + slot * slot_elems;
+        const int8_t *k = input_K + slot * slot_elems;
+        const int8_t *v = input_V + slot * slot_elems;
+        nvalues += (double)slot_len[slot] * cfg.head_dim;
+        for (uint32_t i = 0; i < slot_len[slot]; ++i) {
+            uint32_t cols = cfg.causal ? i + 1 : slot_len[slot];
+            double row_max = -INFINITY, sum = 0.0;
+            for (uint32_t j = 0; j < cols; ++j) {
+                int32_t s = 0;
+                for (uint32_t d = 0; d < cfg.head_dim; ++d)
+                    s += (int32_t)q[(size_t)i * cfg.head_dim + d] * (int32_t)k[(size_t)j * cfg.head_dim + d];
+                p[j] = s * scale;
+                if (p[j] > row_max) row_max = p[j];
+            }
+            for (uint32_t j = 0; j < cols; ++j) {
+                p[j] = exp(p[j] - row_max);
+                sum += p[j];
+            }
+            for (uint32_t d = 0; d < cfg.head_dim; ++d) {
+                double ref = 0.0;
+                for (uint32_t j = 0; j < cols; ++j) ref += p[j] * v[(size_t)j * cfg.head_dim + d];
+                double err = fabs(out[(slot * cfg.seq_len + i) * cfg.head_dim + d] / 255.0 - ref / sum);
+                if (err > max_err) max_err = err;
+                sum_err += err;
+            }
+        }
+    }
+    free(p);
+
+    printf("Accuracy vs float: max |err| %.3f, mean |err| %.4f (V units, %s softmax, 2^%u LUT entries per logit)\n",
+           max_err, sum_err / nvalues, cfg.div_softmax ? "division" : "fused", cfg.lut_bits);
 }
+
+// A compact output format loses up to half a quantization step per value;
+// the step follows from the row shift the DPU picks for the reference row,
+// and is discounted before the usual threshold applies.
+static bool rows_match(const int32_t *dpu_out, const int32_t *host_out, size_t nrows) {
+    bool equal = true;
+    int32_t half_step = 0;
+    for (size_t i = 0; i < nrows * cfg.head_dim; ++i) {
+        if (cfg.out_format != MHA_OUT_INT32 && i % cfg.head_dim == 0) {
+            int32_t max_abs = 0;
+            for (uint32_t d = 0; d < cfg.head_dim; ++d)
+                if (abs(host_out[i + d]) > max_abs) max_abs = abs(host_out[i + d]);
+            uint32_t shift = mha_out_shift(max_abs, mha_out_qmax(cfg.out_format));
+            half_step = shift ? 1 << (shift - 1) : 0;
+        }
+
+        int32_t err = abs(dpu_out[i] - host_out[i]) - half_step;
+        float diff = err > 0 ? (float)err / ((float)QK_SCALE * (float)V_SCALE) : 0.0f;
+
+        if (diff > 1e-2f) {
+            equal = false;
+        }
+    }
+    return equal;
+}
+
+static bool results_match(const mha_results_t *res) {
+    return rows_match(res->out, host_results.out, (size_t)total_slots * cfg.seq_len);
+}
+
+static void compare_and_print(void) {
+    bool equal = results_match(&dpu_results);
+    if (cfg.accuracy) report_accuracy(dpu_results.out);
+
+    printf("\n--- DPU cycles summary ---\n");
+
+    // Rounds run one after the other, each as long as its slowest DPU.
+    uint64_t total_cycles = 0, max_dpu_cycles = 0, round_cycles = 0;
+    const uint32_t per_round = nr_dpus / nr_rounds;
+    for (uint32_t r = 0; r < nr_rounds; ++r) {
+        uint64_t round_max = 0;
+        for (uint32_t i = r * per_round; i < (r + 1) * per_round; ++i) {
+            uint64_t c = 0;
+            for (uint32_t ls = 0; ls < dpu_shapes[i].nslots; ++ls)
+                c += dpu_results.cycles[(size_t)i * cfg.slots_per_dpu + ls];
+            total_cycles += c;
+            if (c > round_max) round_max = c;
+        }
+        if (round_max > max_dpu_cycles) max_dpu_cycles = round_max;
+        round_cycles += round_max;
+    }
+
+    double avg_cycles = (double)total_cycles / (double)total_slots;
+    double avg_ms = avg_cycles / 350000.0;
+
+    printf("Total cycles (sum over all slots): %llu\n", (unsigned long long)total_cycles);
+    printf("Average cycles per slot: %.0f (%.3f ms)\n", avg_cycles, avg_ms);
+    printf("Max cycles per DPU launch: %llu (%.3f ms)\n",
+           (unsigned long long)max_dpu_cycles, (double)max_dpu_cycles / 350000.0);
+    if (nr_rounds > 1)
+        printf("DPU time over %u rounds: %llu cycles (%.3f ms)\n", nr_rounds, (unsigned long long)round_cycles,
+               (double)round_cycles / 350000.0);
+    stats.dpu_ms = (double)round_cycles / 350000.0;
+    stats.ok = equal;
+
+    if (equal) {
+        printf("Host == DPU\n");
+    } else {
+        printf("Host != DPU\n");
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-b batch] [-s seq_len] [-d head_dim] [-n num_heads] [-t tasklets] [-p slots_per_dpu]\n"
+            "       [-k kernel] [-c] [-S] [-P batches] [-D steps] [-E] [-e embed_dim] [-O] [-T threads] [-q bits]\n"
+            "       [-B] [-H] [-I isa] [-L] [-r rows] [-x bits] [-F] [-A] [-R] [-Q rows] [-U table] [-J trace.json]\n"
+            "       [-Y profile] [-l min_len] [-g kv_heads] [-N dpus] [-K parts] [-V requests] [-j clients] [-i rate]\n"
+            "       [-w ms]\n"
+            "  defaults: -b %d -s %d -d %d -n %d -t %d -p %d (binary built for %d tasklets)\n"
+            "  -k: full (K/V resident in WRAM), tiled (online softmax over MRAM tiles) or auto\n"
+            "  -c: causal mask, query row i attends to keys 0..i only\n"
+            "  -S: serial per-DPU dpu_copy_to/dpu_copy_from instead of parallel push transfers\n"
+            "  -P: stream that many batches through %d DPU groups with asynchronous launches\n"
+            "  -E: send embeddings and resident W_q/W_k/W_v, project Q/K/V on the DPU\n"
+            "  -e: embedding width for -E (default %d)\n"
+            "  -O: concatenate heads and apply W_o on the host (EMBED_DIM outputs per token)\n"
+            "  -T: host threads for the CPU backend and -O (default: online CPUs)\n"
+            "  -q: output format, 32 (int32), 16 or 8 (requantized with a per-row shift)\n"
+            "  -B: run on the CPU backend only, no DPUs\n"
+            "  -H: hybrid, split the slots between DPUs and CPU threads by a calibrated model\n"
+            "  -I: CPU backend instruction set, scalar, avx2, avx512 or auto\n"
+            "  -L: DPU kernels reading one int8 per load instead of packed words\n"
+            "  -r: query rows per full-kernel micro-kernel block, 1 to %d (default by HEAD_DIM)\n"
+            "  -x: exp LUT resolution, 2^bits entries per unit of scaled logit (default 5, 256 entries span 8)\n"
+            "  -F: unfused softmax, a division per probability instead of one reciprocal per row\n"
+            "  -A: report the error of the outputs against a float softmax\n"
+            "  -R: full kernel hands each tasklet a fixed row range instead of sharing a work counter\n"
+            "  -Q: Q_BLOCK_ROWS of the DPU binary, %d loads %s and others dpus_q<rows>.mpo\n"
+            "  -U: tuning table picking -Q, -t, -p, -r and -k per shape (default %s, 'none' to skip)\n"
+            "  -J: write the host timeline of the run as Chrome trace JSON\n"
+            "  -Y: dpu_alloc profile, e.g. backend=simulator to run without DPU hardware\n"
+            "  -l: ragged batch, entry lengths drawn from min_len..SEQ_LEN and sent without padding\n"
+            "  -g: grouped-query attention, NUM_HEADS/kv_heads query heads share each K/V head (1 for MQA)\n"
+            "  -N: DPUs to allocate, or all; short of DPUs for the batch, slots per DPU grow and the rest runs in rounds\n"
+            "  -K: split every slot's K/V over up to that many DPUs, the partial softmaxes merged on the host\n"
+            "  -D: decode the last that many tokens one launch each, K/V cached in MRAM\n"
+            "  -V: serve that many requests of one batch entry each from client threads, launches batching up to -b\n"
+            "  -j: client threads for -V (default 4)\n"
+            "  -i: offered load for -V in requests/s with Poisson arrivals, 0 for clients awaiting each reply (default)\n"
+            "  -w: batching deadline for -V, ms the oldest queued request waits for its launch to fill (default 2)\n",
+            prog, BATCH_SIZE, SEQ_LEN, HEAD_DIM, NUM_HEADS, NR_TASKLETS, SLOTS_PER_DPU, NR_TASKLETS, PIPELINE_GROUPS,
+            EMBED_DIM, MAX_ROW_BLOCK, Q_BLOCK_ROWS, DPU_BINARY, TUNING_TABLE);
+}
+
+static int parse_args(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "b:s:d:n:t:p:k:cSP:D:Ee:OT:q:BHI:Lr:x:FARQ:U:J:Y:l:g:N:K:V:j:i:w:h")) != -1) {
+        if (opt > 0 && opt < 128) opt_given[opt] = true;
+        switch (opt) {
+        case 'b': cfg.batch_size = (uint32_t)atoi(optarg); break;
+        case 's': cfg.seq_len = (uint32_t)atoi(optarg); break;
+        case 'd': cfg.head_dim = (uint32_t)atoi(optarg); break;
+        case 'n': cfg.num_heads = (uint32_t)atoi(optarg); break;
+        case 't': cfg.nr_tasklets = (uint32_t)atoi(optarg); break;
+        case 'p': cfg.slots_per_dpu = (uint32_t)atoi(optarg); break;
+        case 'k':
+            if (strcmp(optarg, "full") == 0) cfg.kernel = MHA_KERNEL_FULL;
+            else if (strcmp(optarg, "tiled") == 0) cfg.kernel = MHA_KERNEL_TILED;
+            else if (strcmp(optarg, "auto") == 0) cfg.kernel = MHA_KERNEL_AUTO;
+            else { usage(argv[0]); return -1; }
+            break;
+        case 'c': cfg.causal = true; break;
+        case 'S': cfg.serial_xfer = true; break;
+        case 'P': cfg.stream_batches = (uint32_t)atoi(optarg); break;
+        case 'D': cfg.decode_steps = (uint32_t)atoi(optarg); break;
+        case 'E': cfg.project = true; break;
+        case 'e': cfg.embed_dim = (uint32_t)atoi(optarg); break;
+        case 'O': cfg.out_proj = true; break;
+        case 'T': cfg.host_threads = (uint32_t)atoi(optarg); break;
+        case 'B': cfg.cpu_only = true; break;
+        case 'H': cfg.hybrid = true; break;
+        case 'L': cfg.byte_kernels = true; break;
+        case 'r': cfg.row_block = (uint32_t)atoi(optarg); break;
+        case 'x': cfg.lut_bits = (uint32_t)atoi(optarg); break;
+        case 'F': cfg.div_softmax = true; break;
+        case 'A': cfg.accuracy = true; break;
+        case 'R': cfg.static_rows = true; break;
+        case 'Q': cfg.q_rows = (uint32_t)atoi(optarg); break;
+        case 'U': cfg.tuning = strcmp(optarg, "none") == 0 ? NULL : optarg; break;
+        case 'J': cfg.trace = optarg; break;
+        case 'Y': cfg.profile = optarg; break;
+        case 'l': cfg.min_len = (uint32_t)atoi(optarg); break;
+        case 'g': cfg.kv_heads = (uint32_t)atoi(optarg); break;
+        case 'K': cfg.kv_parts = (uint32_t)atoi(optarg); break;
+        case 'V': cfg.serve_requests = (uint32_t)atoi(optarg); break;
+        case 'j': cfg.serve_clients = (uint32_t)atoi(optarg); break;
+        case 'i': cfg.serve_rate = atof(optarg); break;
+        case 'w': cfg.serve_wait_ms = atof(optarg); break;
+        case 'N': cfg.dpus = strcmp(optarg, "all") == 0 ? DPU_ALLOCATE_ALL : (uint32_t)atoi(optarg); break;
+        case 'I':
+            if (strcmp(optarg, "scalar") == 0) cfg.cpu_isa = HOST_CPU_SCALAR;
+            else if (strcmp(optarg, "avx2") == 0) cfg.cpu_isa = HOST_CPU_AVX2;
+            else if (strcmp(optarg, "avx512") == 0) cfg.cpu_isa = HOST_CPU_AVX512;
+            else if (strcmp(optarg, "auto") == 0) cfg.cpu_isa = HOST_CPU_AUTO;
+            else { usage(argv[0]); return -1; }
+            break;
+        case 'q':
+            if (strcmp(optarg, "32") == 0) cfg.out_format = MHA_OUT_INT32;
+            else if (strcmp(optarg, "16") == 0) cfg.out_format = MHA_OUT_INT16;
+            else if (strcmp(optarg, "8") == 0) cfg.out_format = MHA_OUT_INT8;
+            else { usage(argv[0]); return -1; }
+            break;
+        default: usage(argv[0]); return -1;
+        }
+    }
+    return 0;
+}
+
+// Whether a tuning entry for a slots suits this run better than one for b:
+// the fewest slots at or above the run's, else the most below them.
+static bool closer_slots(uint64_t a, uint64_t b) {
+    const uint64_t slots = (uint64_t)cfg.batch_size * cfg.num_heads;
+    if ((a >= slots) != (b >= slots)) return a >= slots;
+    return a >= slots ? a < b : a > b;
+}
+
+// Tuning table lines are "seq_len head_dim causal slots q_rows tasklets
+// slots_per_dpu row_block kernel batch_ms", slots being BATCH*NUM_HEADS and
+// '#' starting a comment. A shape takes the entry of its HEAD_DIM and mask
+// with the smallest SEQ_LEN at or above its own: whatever fits that entry's
+// WRAM and MRAM budget fits a shorter sequence too. Among those it takes the
+// entry tuned for the slot count closest to its own, as packing trades DPUs
+// for slots per DPU differently for every count. Options given explicitly
+// keep their value.
+// Returns 1 when an entry was applied, 0 when none was, -1 on error.
+static int load_tuning(void) {
+    if (cfg.tuning == NULL || cfg.decode_steps > 0 || cfg.project || cfg.cpu_only) return 0;
+    FILE *f = fopen(cfg.tuning, "r");
+    if (f == NULL) {
+        if (opt_given['U']) {
+            fprintf(stderr, "Error: cannot open tuning table %s\n", cfg.tuning);
+            return -1;
+        }
+        return 0;
+    }
+
+    char line[256];
+    uint32_t best_seq = UINT32_MAX, best_slots = 0, q_rows = 0, tasklets = 0, slots = 0, row_block = 0, kernel = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        uint32_t e_seq, e_hd, e_causal, e_slots, e_q, e_t, e_p, e_r;
+        char e_kernel[16];
+        if (line[0] == '#' || sscanf(line, "%u %u %u %u %u %u %u %u %15s", &e_seq, &e_hd, &e_causal, &e_slots, &e_q,
+                                     &e_t, &e_p, &e_r, e_kernel) != 9)
+            continue;
+        if (e_hd != cfg.head_dim || (e_causal != 0) != cfg.causal || e_seq < cfg.seq_len || e_seq > best_seq ||
+            (e_seq == best_seq && !closer_slots(e_slots, best_slots)))
+            continue;
+        best_seq = e_seq;
+        best_slots = e_slots;
+        q_rows = e_q;
+        tasklets = e_t;
+        slots = e_p;
+        row_block = e_r;
+        kernel = strcmp(e_kernel, "tiled") == 0 ? MHA_KERNEL_TILED : MHA_KERNEL_FULL;
+    }
+    fclose(f);
+    if (best_seq == UINT32_MAX) return 0;
+
+    // An entry needing a DPU binary that was not built is no use here.
+    char binary[64];
+    snprintf(binary, sizeof(binary), "dpus_q%u.mpo", q_rows);
+    if (!opt_given['Q'] && q_rows != Q_BLOCK_ROWS && access(binary, R_OK) != 0) {
+        printf("Tuning: %s entry SEQ_LEN=%u HEAD_DIM=%u SLOTS=%u needs %s, using the defaults\n", cfg.tuning,
+               best_seq, cfg.head_dim, best_slots, binary);
+        return 0;
+    }
+
+    if (!opt_given['Q']) cfg.q_rows = q_rows;
+    if (!opt_given['t']) cfg.nr_tasklets = tasklets;
+    if (!opt_given['p']) cfg.slots_per_dpu = slots;
+    if (!opt_given['r'] && !opt_given['L']) cfg.row_block = row_block;
+    if (!opt_given['k']) cfg.kernel = kernel;
+    printf("Tuning: %s entry SEQ_LEN=%u HEAD_DIM=%u SLOTS=%u\n", cfg.tuning, best_seq, cfg.head_dim, best_slots);
+    return 1;
+}
+
+static int check_config(void) {
+    if (cfg.batch_size == 0 || cfg.seq_len == 0 || cfg.head_dim == 0 || cfg.num_heads == 0) {
+        fprintf(stderr, "Error: shape dimensions must be positive\n");
+        return -1;
+    }
+    if (cfg.head_dim % 8 != 0) {
+        fprintf(stderr, "Error: HEAD_DIM=%u must be a multiple of 8 for MRAM DMA\n", cfg.head_dim);
+        return -1;
+    }
+    if (cfg.nr_tasklets == 0 || cfg.nr_tasklets > NR_TASKLETS) {
+        fprintf(stderr, "Error: %u tasklets requested, binary has %d\n", cfg.nr_tasklets, NR_TASKLETS);
+        return -1;
+    }
+    // A group's query heads share a DPU, so a DPU holds whole groups; a
+    // default or tuned slot count is rounded up to one.
+    if (cfg.kv_heads > 0) {
+        if (cfg.kv_heads > cfg.num_heads || cfg.num_heads % cfg.kv_heads != 0 || cfg.project || cfg.hybrid) {
+            fprintf(stderr, "Error: -g needs kv_heads dividing NUM_HEADS=%u, and no -E or -H\n", cfg.num_heads);
+            return -1;
+        }
+        uint32_t group = cfg.num_heads / cfg.kv_heads;
+        if (cfg.slots_per_dpu % group != 0) {
+            if (opt_given['p']) {
+                fprintf(stderr, "Error: %u slots per DPU do not hold whole groups of %u query heads\n",
+                        cfg.slots_per_dpu, group);
+                return -1;
+            }
+            cfg.slots_per_dpu += group - cfg.slots_per_dpu % group;
+        }
+    }
+    if (cfg.slots_per_dpu == 0 || cfg.slots_per_dpu > MAX_SLOTS_PER_DPU ||
+        (size_t)cfg.slots_per_dpu * cfg.seq_len * cfg.head_dim > MRAM_TENSOR_BYTES) {
+        fprintf(stderr, "Error: %u slots of SEQ_LEN=%u HEAD_DIM=%u exceed MRAM capacity\n",
+                cfg.slots_per_dpu, cfg.seq_len, cfg.head_dim);
+        return -1;
+    }
+    if (cfg.q_rows == 0) {
+        fprintf(stderr, "Error: -Q takes a positive number of rows\n");
+        return -1;
+    }
+    if (cfg.q_rows != Q_BLOCK_ROWS) snprintf(dpu_binary, sizeof(dpu_binary), "dpus_q%u.mpo", cfg.q_rows);
+    if (cfg.hybrid && (cfg.stream_batches > 0 || cfg.decode_steps > 0 || cfg.project || cfg.out_proj)) {
+        fprintf(stderr, "Error: -H runs without -P, -D, -E or -O\n");
+        return -1;
+    }
+    if (cfg.out_proj && (cfg.embed_dim == 0 || cfg.stream_batches > 0 || cfg.decode_steps > 0)) {
+        fprintf(stderr, "Error: -O needs a positive EMBED_DIM and runs without -P or -D\n");
+        return -1;
+    }
+    if (ragged() && (cfg.min_len > cfg.seq_len || cfg.project || cfg.hybrid ||
+                     cfg.min_len < cfg.decode_steps)) {
+        fprintf(stderr, "Error: -l needs min_len <= SEQ_LEN, at least the -D steps, and no -E or -H\n");
+        return -1;
+    }
+    // Every part of a K/V split runs the tiled kernel over its windows of
+    // whole tiles.
+    if (kv_split()) {
+        uint32_t tiles = (cfg.seq_len + KV_TILE_ROWS - 1) / KV_TILE_ROWS;
+        if (cfg.kv_parts > tiles || ragged() || cfg.kv_heads > 0 || cfg.project || cfg.hybrid ||
+            cfg.stream_batches > 0 || cfg.decode_steps > 0 || cfg.out_format != MHA_OUT_INT32 ||
+            (opt_given['k'] && cfg.kernel != MHA_KERNEL_TILED)) {
+            fprintf(stderr, "Error: -K needs at most %u parts of %d-row tiles, the tiled kernel, int32 outputs, "
+                    "and no -l, -g, -E, -H, -P or -D\n", tiles, KV_TILE_ROWS);
+            return -1;
+        }
+        cfg.kernel = MHA_KERNEL_TILED;
+        if ((size_t)cfg.slots_per_dpu * cfg.seq_len * mha_out_row_bytes(cfg.head_dim, MHA_OUT_PARTIAL) >
+            MRAM_TENSOR_BYTES * sizeof(int32_t)) {
+            fprintf(stderr, "Error: partial rows of %u slots of SEQ_LEN=%u exceed MRAM capacity\n",
+                    cfg.slots_per_dpu, cfg.seq_len);
+            return -1;
+        }
+    }
+    // Serving packs whole requests, one batch entry's heads each, into
+    // positions of their own.
+    if (cfg.serve_requests > 0 &&
+        (cfg.serve_clients == 0 || cfg.serve_rate < 0.0 || cfg.serve_wait_ms < 0.0 || ragged() ||
+         cfg.kv_heads > 0 || kv_split() || cfg.project || cfg.out_proj || cfg.cpu_only || cfg.hybrid ||
+         cfg.stream_batches > 0 || cfg.decode_steps > 0)) {
+        fprintf(stderr, "Error: -V needs a client, a rate and deadline of at least 0, "
+                "and no -l, -g, -K, -E, -O, -B, -H, -P or -D\n");
+        return -1;
+    }
+    if (cfg.host_threads == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        cfg.host_threads = n > 0 ? (uint32_t)n : 1;
+    }
+    if (cfg.host_threads > cfg.batch_size * cfg.seq_len) cfg.host_threads = cfg.batch_size * cfg.seq_len;
+
+    // Score units per LUT entry: the power of two nearest to a logit's worth
+    // of score units over 2^lut_bits.
+    if (cfg.lut_bits > 16) {
+        fprintf(stderr, "Error: -x takes 0 to 16 bits\n");
+        return -1;
+    }
+    int units_log2 = (int)lrint(log2((double)QK_SCALE * QK_SCALE * sqrt((double)cfg.head_dim)));
+    lut_shift = units_log2 > (int)cfg.lut_bits ? (uint32_t)(units_log2 - (int)cfg.lut_bits) : 0;
+
+    host_cpu_isa_t best = host_cpu_best_isa();
+    if (cfg.cpu_isa == HOST_CPU_AUTO || cfg.cpu_isa > best) {
+        if (cfg.cpu_isa != HOST_CPU_AUTO)
+            fprintf(stderr, "Warning: %s not supported here, using %s\n", host_cpu_isa_name(cfg.cpu_isa), host_cpu_isa_name(best));
+        cfg.cpu_isa = best;
+    }
+
+    if (cfg.project) {
+        if (cfg.embed_dim == 0 || cfg.embed_dim % 8 != 0 || cfg.decode_steps > 0) {
+            fprintf(stderr, "Error: -E needs EMBED_DIM a positive multiple of 8 and no -D\n");
+            return -1;
+        }
+        if ((size_t)cfg.slots_per_dpu * cfg.seq_len * cfg.embed_dim > 2 * (size_t)MRAM_TENSOR_BYTES ||
+            (size_t)cfg.slots_per_dpu * 3 * cfg.head_dim * cfg.embed_dim > MRAM_TENSOR_BYTES) {
+            fprintf(stderr, "Error: %u slots of EMBED_DIM=%u exceed MRAM capacity\n", cfg.slots_per_dpu, cfg.embed_dim);
+            return -1;
+        }
+        if (mha_proj_group_cols(cfg.embed_dim, cfg.head_dim, cfg.nr_tasklets) == 0) {
+            fprintf(stderr, "Error: EMBED_DIM=%u with %u tasklets does not fit the WRAM heap\n",
+                    cfg.embed_dim, cfg.nr_tasklets);
+            return -1;
+        }
+        // X and W are uniform in [-127, 127]: the dot product has a standard
+        // deviation near 127*127/3*sqrt(EMBED_DIM), shifted down to about 40.
+        proj_shift = 7;
+        while ((1u << (2 * (proj_shift - 7))) < cfg.embed_dim) ++proj_shift;
+    }
+
+    // Decode is causal by construction and checks against the full kernel.
+    if (cfg.decode_steps > 0) {
+        if (cfg.decode_steps > cfg.seq_len || cfg.stream_batches > 0 || cfg.head_dim > MRAM_DMA_MAX) {
+            fprintf(stderr, "Error: -D needs steps <= SEQ_LEN, HEAD_DIM <= %d and no -P\n", MRAM_DMA_MAX);
+            return -1;
+        }
+        uint32_t wram = mha_decode_wram_bytes(cfg.seq_len, cfg.head_dim, cfg.nr_tasklets);
+        if (wram > WRAM_HEAP_BYTES) {
+            fprintf(stderr, "Error: decoding SEQ_LEN=%u HEAD_DIM=%u with %u tasklets needs %u B of WRAM heap, %d available\n",
+                    cfg.seq_len, cfg.head_dim, cfg.nr_tasklets, wram, WRAM_HEAP_BYTES);
+            return -1;
+        }
+        cfg.kernel = MHA_KERNEL_DECODE;
+        cfg.causal = true;
+        return 0;
+    }
+
+    // The row block is a WRAM trade: a default one shrinks until the full
+    // kernel fits, down to a row at a time, before tiling is considered.
+    bool auto_block = cfg.row_block == 0;
+    if (cfg.row_block > MAX_ROW_BLOCK) {
+        fprintf(stderr, "Error: -r takes 1 to %d rows\n", MAX_ROW_BLOCK);
+        return -1;
+    }
+    if (cfg.byte_kernels) cfg.row_block = 1;
+    else if (auto_block) cfg.row_block = mha_row_block(cfg.head_dim);
+    while (auto_block && cfg.row_block > 1 &&
+           mha_wram_bytes(cfg.seq_len, cfg.head_dim, cfg.nr_tasklets, cfg.slots_per_dpu, cfg.row_block,
+                          cfg.q_rows) > WRAM_HEAP_BYTES)
+        --cfg.row_block;
+
+    uint32_t full_wram = mha_wram_bytes(cfg.seq_len, cfg.head_dim, cfg.nr_tasklets, cfg.slots_per_dpu, cfg.row_block,
+                                        cfg.q_rows);
+    if (cfg.kernel == MHA_KERNEL_AUTO)
+        cfg.kernel = full_wram <= WRAM_HEAP_BYTES ? MHA_KERNEL_FULL : MHA_KERNEL_TILED;
+
+    if (cfg.kernel == MHA_KERNEL_FULL && (uint64_t)cfg.q_rows * cfg.head_dim > MRAM_DMA_MAX) {
+        fprintf(stderr, "Error: a Q block of %u rows of HEAD_DIM=%u exceeds one %d B MRAM transfer\n",
+                cfg.q_rows, cfg.head_dim, MRAM_DMA_MAX);
+        return -1;
+    }
+
+    uint32_t wram = cfg.kernel == MHA_KERNEL_TILED ? mha_tiled_wram_bytes(cfg.head_dim, cfg.nr_tasklets) : full_wram;
+    if (wram > WRAM_HEAP_BYTES) {
+        fprintf(stderr, "Error: SEQ_LEN=%u HEAD_DIM=%u with %u tasklets and %u slots/DPU needs %u B of WRAM heap, %d available\n",
+                cfg.seq_len, cfg.head_dim, cfg.nr_tasklets, cfg.slots_per_dpu, wram, WRAM_HEAP_BYTES);
+        return -1;
+    }
+    // The tiled kernel keeps an unnormalized int32 V accumulator per row,
+    // over a part's keys under a K/V split.
+    uint32_t acc_keys = cfg.seq_len;
+    if (kv_split()) {
+        acc_keys = 0;
+        for (uint32_t j = 0; j < kv_parts(); ++j)
+            if (part_rows(j, cfg.seq_len) > acc_keys) acc_keys = part_rows(j, cfg.seq_len);
+    }
+    if (cfg.kernel == MHA_KERNEL_TILED && (uint64_t)acc_keys * 255 * 128 > INT32_MAX) {
+        fprintf(stderr, "Error: SEQ_LEN=%u overflows the tiled kernel accumulator\n", cfg.seq_len);
+        return -1;
+    }
+    return 0;
+}
+
+// Allocates and loads count DPUs, or all available ones for
+// DPU_ALLOCATE_ALL; *got receives how many the set holds.
+static int alloc_dpus(struct dpu_set_t *set, uint32_t count, uint32_t *got) {
+    struct timespec ts0, ts1, ts2;
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
+    if (dpu_alloc(count, cfg.profile, set) != DPU_OK) {
+        if (count == DPU_ALLOCATE_ALL) fprintf(stderr, "Error: no DPU available\n");
+        else fprintf(stderr, "Error: could not allocate %u DPUs\n", count);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    DPU_ASSERT(dpu_load(*set, dpu_binary, NULL));
+    clock_gettime(CLOCK_MONOTONIC, &ts2);
+    trace_span("dpu_alloc", TRACE_LANE_HOST, &ts0, &ts1, 0);
+    trace_span("dpu_load", TRACE_LANE_HOST, &ts1, &ts2, 0);
+    alloc_ms = elapsed_ms(&ts0, &ts1);
+    load_ms = elapsed_ms(&ts1, &ts2);
+    stats.alloc_ms += alloc_ms;
+    stats.load_ms += load_ms;
+    DPU_ASSERT(dpu_get_nr_dpus(*set, got));
+    printf("DPUs allocated: %u\n", *got);
+    stats.nr_dpus += *got;
+    return 0;
+}
+
+// DPUs of a plain, decode, serving or hybrid run: the -N count, or as many
+// as the batch needs and all available ones when that many cannot be had,
+// faulty or busy ranks leaving fewer.
+static int alloc_dpu_set(struct dpu_set_t *set, uint32_t *got) {
+    if (cfg.dpus) return alloc_dpus(set, cfg.dpus, got);
+    if (alloc_dpus(set, nr_dpus, got) == 0) return 0;
+    fprintf(stderr, "Trying all available DPUs instead\n");
+    return alloc_dpus(set, DPU_ALLOCATE_ALL, got);
+}
+
+// Whether spd slots per DPU fit the MRAM tensors and the kernel's WRAM heap.
+static bool slots_fit(uint32_t spd) {
+    if (spd > MAX_SLOTS_PER_DPU || (size_t)spd * cfg.seq_len * cfg.head_dim > MRAM_TENSOR_BYTES) return false;
+    if (cfg.project && ((size_t)spd * cfg.seq_len * cfg.embed_dim > 2 * (size_t)MRAM_TENSOR_BYTES ||
+                        (size_t)spd * 3 * cfg.head_dim * cfg.embed_dim > MRAM_TENSOR_BYTES))
+        return false;
+    if (kv_split() && (size_t)spd * cfg.seq_len * mha_out_row_bytes(cfg.head_dim, MHA_OUT_PARTIAL) >
+                          MRAM_TENSOR_BYTES * sizeof(int32_t))
+        return false;
+    return cfg.kernel != MHA_KERNEL_FULL ||
+           mha_wram_bytes(cfg.seq_len, cfg.head_dim, cfg.nr_tasklets, spd, cfg.row_block, cfg.q_rows) <= WRAM_HEAP_BYTES;
+}
+
+// Maps the batch onto the got DPUs allocated. Short of DPUs, a slot count
+// not given with -p grows as far as a DPU holds, and whatever still does not
+// fit runs in further launch rounds; decoding and serving need every slot
+// resident.
+static int plan_rounds(uint32_t got) {
+    const uint32_t group = kv_group();
+    const uint32_t planned = cfg.slots_per_dpu;
+    if (dpus_needed(cfg.slots_per_dpu) > got && !opt_given['p']) {
+        uint32_t sets = got / kv_parts() ? got / kv_parts() : 1;
+        uint32_t want = (total_slots + sets - 1) / sets;
+        want += (group - want % group) % group;
+        while (want > cfg.slots_per_dpu && !slots_fit(want)) want -= group;
+        if (want > cfg.slots_per_dpu) cfg.slots_per_dpu = want;
+    }
+
+    uint32_t needed = dpus_needed(cfg.slots_per_dpu);
+    nr_rounds = (needed + got - 1) / got;
+    nr_dpus = nr_rounds * got;
+    if (nr_rounds > 1 && (cfg.decode_steps > 0 || cfg.serve_requests > 0)) {
+        fprintf(stderr, "Error: %s keeps every slot resident, but %u slots need %u DPUs and %u are allocated\n",
+                cfg.decode_steps > 0 ? "decoding" : "serving", total_slots, needed, got);
+        return -1;
+    }
+    if (got != needed || cfg.slots_per_dpu != planned)
+        printf("Slot map: %u slots, %u per DPU on %u DPUs, %u launch round%s\n", total_slots, cfg.slots_per_dpu,
+               got, nr_rounds, nr_rounds > 1 ? "s" : "");
+    return 0;
+}
+
+// CPU execution path: the whole batch on the CPU backend, checked against a
+// single-threaded scalar run of the same arithmetic.
+static int run_cpu(void) {
+    mha_results_t cpu_results;
+    cpu_results.out = malloc((size_t)total_slots * slot_elems * sizeof(int32_t));
+
+    double ms = host_cpu_run(cpu_results.out);
+    printf("CPU backend time: %.3f ms (%u threads, %s)\n", ms, cfg.host_threads, host_cpu_isa_name(cfg.cpu_isa));
+    printf("CPU throughput: %.1f sequences/s\n", (double)cfg.batch_size * 1000.0 / ms);
+    print_throughput("CPU end-to-end", 1, ms);
+
+    host_cpu_attention(input_Q, input_K, input_V, host_results.out, total_slots, cfg.seq_len, cpu_lens(),
+                       cfg.head_dim, cfg.kernel == MHA_KERNEL_TILED ? MHA_KERNEL_TILED : MHA_KERNEL_FULL,
+                       softmax_flags(), exp_lut, lut_shift, kv_split() ? kv_parts() : 0, 1, HOST_CPU_SCALAR);
+    bool equal = memcmp(cpu_results.out, host_results.out, (size_t)total_slots * slot_elems * sizeof(int32_t)) == 0;
+    printf(equal ? "CPU == scalar reference\n" : "CPU != scalar reference\n");
+    stats.ok = equal;
+    stats.host_ms = ms;
+    stats.e2e_ms = ms;
+    stats.tokens = batch_tokens();
+    stats.ops = batch_ops();
+    if (cfg.accuracy) report_accuracy(cpu_results.out);
+
+    free(cpu_results.out);
+    return 0;
+}
+
+// One pass over the batch on an allocated set, a launch per round. End to
+// end, it pays for allocating and loading the set, the transfers both ways
+// and the unpacking, not only the launch.
+static int run_once(struct dpu_set_t set) {
+    struct timespec ts_start, ts_end;
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    alloc_results(&dpu_results);
+
+    double weights_ms = 0.0, push_ms = 0.0, launch_ms = 0.0, pull_ms = 0.0;
+    for (uint32_t r = 0; r < nr_rounds; ++r) {
+        round_first = r * (nr_dpus / nr_rounds);
+        if (cfg.project) weights_ms += scatter_weights(set);
+        push_ms += scatter_inputs(set);
+
+        struct timespec ts0, ts1;
+        clock_gettime(CLOCK_MONOTONIC, &ts0);
+        DPU_ASSERT(dpu_launch(set, DPU_SYNCHRONOUS));
+        clock_gettime(CLOCK_MONOTONIC, &ts1);
+        trace_span("launch", TRACE_LANE_DPU, &ts0, &ts1, 0);
+        launch_ms += elapsed_ms(&ts0, &ts1);
+
+        pull_ms += gather_results(set, &dpu_results);
+    }
+    if (cfg.project) print_bandwidth("Weights Host->DPU", scatter_weights_bytes(), weights_ms);
+    double unpack_ms = unpack_results(&dpu_results);
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    double e2e_ms = alloc_ms + load_ms + elapsed_ms(&ts_start, &ts_end);
+
+    stats.push_ms = weights_ms + push_ms;
+    stats.launch_ms = launch_ms;
+    stats.pull_ms = pull_ms;
+    stats.unpack_ms = unpack_ms;
+    stats.e2e_ms = e2e_ms;
+    stats.push_bytes = scatter_bytes() + (cfg.project ? scatter_weights_bytes() : 0);
+    stats.pull_bytes = gather_bytes();
+    stats.tokens = batch_tokens();
+    stats.ops = batch_ops();
+
+    print_bandwidth("Host->DPU", scatter_bytes(), push_ms);
+    print_bandwidth("DPU->Host", gather_bytes(), pull_ms);
+    printf("Output format: %s, %u B per row, %s in %.3f ms\n", out_format_name(dpu_out_format()),
+           mha_out_row_bytes(cfg.head_dim, dpu_out_format()), kv_split() ? "merged" : "unpacked", unpack_ms);
+    if (nr_rounds > 1) printf("DPU launch time: %.3f ms over %u rounds\n", launch_ms, nr_rounds);
+    else printf("DPU launch time: %.3f ms\n", launch_ms);
+
+    size_t xfer_bytes = scatter_bytes() + gather_bytes() + (cfg.project ? scatter_weights_bytes() : 0);
+    printf("\n--- End-to-end ---\n");
+    printf("End-to-end DPU time: %.3f ms (alloc %.3f, load %.3f, push %.3f, launch %.3f, pull %.3f, unpack %.3f)\n",
+           e2e_ms, alloc_ms, load_ms, weights_ms + push_ms, launch_ms, pull_ms, unpack_ms);
+    printf("Host<->DPU traffic: %.3f MB, %.1f MB/s over the end-to-end time\n",
+           xfer_bytes / 1e6, e2e_ms > 0.0 ? xfer_bytes / 1e3 / e2e_ms : 0.0);
+    print_throughput("DPU launch", 1, launch_ms);
+    print_throughput("DPU end-to-end", 1, e2e_ms);
+
+    host_compute_reference();
+    compare_and_print();
+    print_tasklet_balance(set);
+#ifdef MHA_PROFILE
+    print_profile(set);
+#endif
+
+    if (cfg.out_proj) {
+        size_t rows = (size_t)cfg.batch_size * cfg.seq_len;
+        int8_t *concat = malloc(rows * cfg.num_heads * cfg.head_dim);
+        int32_t *y = malloc(rows * cfg.embed_dim * sizeof(int32_t));
+        int32_t *y_ref = malloc(rows * cfg.embed_dim * sizeof(int32_t));
+
+        double out_ms = host_output_projection_mt(dpu_results.out, concat, y);
+        host_output_projection(dpu_results.out, concat, y_ref, input_Wo, 0, (uint32_t)rows);
+
+        printf("\n--- Output stage ---\n");
+        printf("Output projection time: %.3f ms (%u threads, %u x %u per batch entry)\n",
+               out_ms, cfg.host_threads, cfg.seq_len, cfg.embed_dim);
+        printf("End-to-end MHA time: %.3f ms\n", push_ms + launch_ms + pull_ms + unpack_ms + out_ms);
+        printf(memcmp(y, y_ref, rows * cfg.embed_dim * sizeof(int32_t)) == 0 ?
+               "Output projection threaded == serial\n" : "Output projection threaded != serial\n");
+
+        free(concat);
+        free(y);
+        free(y_ref);
+    }
+
+    free_results(&dpu_results);
+    struct timespec ts0, ts1;
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
+    DPU_ASSERT(dpu_free(set));
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    trace_span("dpu_free", TRACE_LANE_HOST, &ts0, &ts1, 0);
+    return 0;
+}
+
+// Streaming mode: the DPUs are split into PIPELINE_GROUPS sets, each holding a
+// whole batch. Batch i runs on group i % PIPELINE_GROUPS; while it computes,
+// the host drains the previous batch of the next group and refills it.
+static int run_stream(void) {
+    struct dpu_set_t groups[PIPELINE_GROUPS];
+    mha_results_t group_results[PIPELINE_GROUPS];
+    const uint32_t nbatches = cfg.stream_batches;
+
+    for (uint32_t g = 0; g < PIPELINE_GROUPS; ++g) {
+        uint32_t got;
+        if (alloc_dpus(&groups[g], nr_dpus, &got) != 0) {
+            while (g-- > 0) DPU_ASSERT(dpu_free(groups[g]));
+            return 1;
+        }
+        alloc_results(&group_results[g]);
+        if (cfg.project) print_bandwidth("Weights Host->DPU", scatter_weights_bytes(), scatter_weights(groups[g]));
+    }
+
+    host_compute_reference();
+
+    double push_ms = 0.0, pull_ms = 0.0;
+
+    struct timespec ts0, ts1;
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
+
+    // A group's lane spans a batch from its launch to the end of dpu_sync.
+    struct timespec launched[PIPELINE_GROUPS];
+    for (uint32_t i = 0; i < nbatches + PIPELINE_GROUPS; ++i) {
+        uint32_t g = i % PIPELINE_GROUPS;
+
+        if (i >= PIPELINE_GROUPS && i - PIPELINE_GROUPS < nbatches) {
+            DPU_ASSERT(dpu_sync(groups[g]));
+            struct timespec synced;
+            clock_gettime(CLOCK_MONOTONIC, &synced);
+            char name[32];
+            snprintf(name, sizeof(name), "batch %u", i - PIPELINE_GROUPS);
+            trace_span(name, TRACE_LANE_DPU + g, &launched[g], &synced, 0);
+            pull_ms += gather_results(groups[g], &group_results[g]);
+        }
+        if (i < nbatches) {
+            push_ms += scatter_inputs(groups[g]);
+            clock_gettime(CLOCK_MONOTONIC, &launched[g]);
+            DPU_ASSERT(dpu_launch(groups[g], DPU_ASYNCHRONOUS));
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    double total_ms = elapsed_ms(&ts0, &ts1);
+
+    printf("\n--- Pipeline summary ---\n");
+    printf("Batches: %u x %u sequences on %d groups of %u DPUs\n",
+           nbatches, cfg.batch_size, PIPELINE_GROUPS, nr_dpus);
+    printf("Stream time: %.3f ms (%.3f ms per batch)\n", total_ms, total_ms / nbatches);
+    print_bandwidth("Host->DPU", scatter_bytes() * nbatches, push_ms);
+    print_bandwidth("DPU->Host", gather_bytes() * nbatches, pull_ms);
+    printf("Output format: %s, %u B per row\n", out_format_name(cfg.out_format), mha_out_row_bytes(cfg.head_dim, cfg.out_format));
+    printf("Sustained throughput: %.1f sequences/s\n", (double)nbatches * cfg.batch_size * 1000.0 / total_ms);
+    print_throughput("Stream", nbatches, total_ms);
+
+    stats.push_ms = push_ms;
+    stats.pull_ms = pull_ms;
+    stats.e2e_ms = total_ms;
+    stats.push_bytes = scatter_bytes() * nbatches;
+    stats.pull_bytes = gather_bytes() * nbatches;
+    stats.tokens = nbatches * batch_tokens();
+    stats.ops = nbatches * batch_ops();
+
+    // Every batch carries the same inputs; the last batch of each group is
+    // checked once the stream is over so validation stays out of the timing.
+    bool equal = true;
+    for (uint32_t g = 0; g < PIPELINE_GROUPS && g < nbatches; ++g) {
+        unpack_results(&group_results[g]);
+        equal = equal && results_match(&group_results[g]);
+    }
+    printf(equal ? "Host == DPU\n" : "Host != DPU\n");
+    stats.ok = equal;
+
+    for (uint32_t g = 0; g < PIPELINE_GROUPS; ++g) {
+        free_results(&group_results[g]);
+        DPU_ASSERT(dpu_free(groups[g]));
+    }
+    return 0;
+}
+
+// Decode mode: the first SEQ_LEN - steps rows of every K/V cache are
+// prefilled once, then each launch appends one token per slot and returns
+// its attention row. Only the new q/k/v rows travel per token.
+static int run_decode(struct dpu_set_t set) {
+    alloc_results(&dpu_results);
+    size_t padded_slots = (size_t)nr_dpus * cfg.slots_per_dpu;
+    int32_t *step_out = malloc(padded_slots * cfg.head_dim * sizeof(int32_t));
+    uint8_t *step_raw = cfg.out_format != MHA_OUT_INT32 ?
+                        malloc(padded_slots * mha_out_row_bytes(cfg.head_dim, cfg.out_format)) : (uint8_t*)step_out;
+    uint64_t *step_cycles = malloc(padded_slots * sizeof(uint64_t));
+    step_payload = calloc(padded_slots * 3, cfg.head_dim);
+
+    // Rows the steps will append are cleared so the cache only holds them
+    // once the DPU has written them. Every slot decodes its last steps rows.
+    const uint32_t prefill = cfg.seq_len - cfg.decode_steps;
+    const uint32_t steps = cfg.decode_steps;
+    for (size_t p = 0; p < padded_slots; p += kv_group()) {
+        uint32_t slot = pos_slot[p];
+        if (slot == NO_SLOT) continue;
+        uint32_t len = slot_len[slot];
+        int8_t *kv = dpu_payload + (p / cfg.slots_per_dpu) * payload_bytes_per_dpu() + (size_t)pos_k_row0[p] * cfg.head_dim;
+        for (int t = 0; t < 2; ++t)
+            memset(kv + ((size_t)t * len + len - steps) * cfg.head_dim, 0, (size_t)steps * cfg.head_dim);
+    }
+
+    double prefill_ms = scatter_inputs(set);
+    print_bandwidth("Prefill Host->DPU", scatter_bytes(), prefill_ms);
+
+    double push_ms = 0.0, launch_ms = 0.0, pull_ms = 0.0, total_ms = 0.0, max_ms = 0.0;
+    uint64_t total_cycles = 0;
+
+    for (uint32_t pos = prefill; pos < cfg.seq_len; ++pos) {
+        pack_step(pos);
+
+        struct timespec ts0, ts1;
+        clock_gettime(CLOCK_MONOTONIC, &ts0);
+        push_ms += scatter_step(set);
+        struct timespec tl0, tl1;
+        clock_gettime(CLOCK_MONOTONIC, &tl0);
+        DPU_ASSERT(dpu_launch(set, DPU_SYNCHRONOUS));
+        clock_gettime(CLOCK_MONOTONIC, &tl1);
+        trace_span("decode step", TRACE_LANE_DPU, &tl0, &tl1, 0);
+        launch_ms += elapsed_ms(&tl0, &tl1);
+        pull_ms += gather_step(set, step_raw, step_cycles);
+        if (cfg.out_format != MHA_OUT_INT32) unpack_rows(step_raw, step_out, padded_slots);
+        clock_gettime(CLOCK_MONOTONIC, &ts1);
+
+        double ms = elapsed_ms(&ts0, &ts1);
+        total_ms += ms;
+        if (ms > max_ms) max_ms = ms;
+
+        uint64_t max_dpu_cycles = 0;
+        for (uint32_t i = 0; i < nr_dpus; ++i) {
+            uint64_t c = 0;
+            for (uint32_t ls = 0; ls < dpu_shapes[i].nslots; ++ls)
+                c += step_cycles[(size_t)i * cfg.slots_per_dpu + ls];
+            if (c > max_dpu_cycles) max_dpu_cycles = c;
+        }
+        total_cycles += max_dpu_cycles;
+
+        for (size_t p = 0; p < padded_slots; ++p) {
+            uint32_t slot = pos_slot[p];
+            if (slot == NO_SLOT) continue;
+            memcpy(dpu_results.out + (size_t)slot * slot_elems + (size_t)slot_pos(slot, pos) * cfg.head_dim,
+                   step_out + p * cfg.head_dim, cfg.head_dim * sizeof(int32_t));
+        }
+    }
+
+    printf("\n--- Decode summary ---\n");
+    printf("Tokens: %u per slot after a prefill of %u, %u slots\n", steps, prefill, total_slots);
+    print_bandwidth("Per-token Host->DPU", scatter_step_bytes(), push_ms / steps);
+    print_bandwidth("Per-token DPU->Host", gather_step_bytes(), pull_ms / steps);
+    printf("Per-token latency: %.3f ms average, %.3f ms max\n", total_ms / steps, max_ms);
+    printf("Average cycles per token: %.0f (%.3f ms)\n",
+           (double)total_cycles / steps, (double)total_cycles / steps / 350000.0);
+
+    // A step at cache row pos attends pos + 1 keys of its slot.
+    stats.push_ms = prefill_ms + push_ms;
+    stats.launch_ms = launch_ms;
+    stats.pull_ms = pull_ms;
+    stats.e2e_ms = total_ms;
+    stats.dpu_ms = (double)total_cycles / 350000.0;
+    stats.push_bytes = scatter_bytes() + scatter_step_bytes() * steps;
+    stats.pull_bytes = gather_step_bytes() * steps;
+    stats.tokens = (double)steps * cfg.batch_size;
+    for (uint32_t slot = 0; slot < total_slots; ++slot)
+        stats.ops += 4.0 * cfg.head_dim * ((double)steps * (slot_len[slot] - steps + 1) + (double)steps * (steps - 1) / 2);
+
+    host_compute_reference();
+
+    // The decoded rows are the last steps causal rows of each slot under the
+    // full kernel.
+    bool equal = true;
+    for (uint32_t slot = 0; slot < total_slots; ++slot) {
+        size_t row0 = (size_t)slot * slot_elems + (size_t)(slot_len[slot] - steps) * cfg.head_dim;
+        equal = rows_match(dpu_results.out + row0, host_results.out + row0, steps) && equal;
+    }
+    printf(equal ? "Host == DPU\n" : "Host != DPU\n");
+    stats.ok = equal;
+#ifdef MHA_PROFILE
+    print_profile(set);  // the last token's launch
+#endif
+
+    if (step_raw != (uint8_t*)step_out) free(step_raw);
+    free(step_out);
+    free(step_cycles);
+    free(step_payload);
+    free_results(&dpu_results);
+    DPU_ASSERT(dpu_free(set));
+    return 0;
+}
+
+// Serving mode: the DPU set stays loaded while client threads submit
+// requests, each the NUM_HEADS slots of one batch entry, to a queue. The
+// executor packs up to BATCH_SIZE queued requests into one launch, entry b's
+// head h at position b*NUM_HEADS + h, and launches once the batch is full,
+// its oldest request has waited serve_wait_ms or no other request can come.
+// Request i carries the inputs of batch entry i % BATCH_SIZE, which the
+// reference of the batch checks.
+typedef struct serve_req {
+    struct serve_req *next;
+    uint32_t entry;
+    struct timespec t_submit;  // due time of an open-loop request, else its submission
+    struct timespec t_done;
+    bool done;
+    bool ok;
+} serve_req_t;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t queued_cond;  // a request was queued or a client left
+    pthread_cond_t done_cond;
+    serve_req_t *reqs;
+    serve_req_t *head, *tail;
+    uint32_t queued;
+    uint32_t issued;     // requests handed to clients
+    uint32_t submitted;  // requests queued so far
+    uint32_t clients;    // clients still submitting
+    bool stop;           // serving was aborted, clients leave
+} serve;
+
+static void add_ms(struct timespec *t, double ms) {
+    long long ns = t->tv_nsec + (long long)(ms * 1e6);
+    t->tv_sec += (time_t)(ns / 1000000000);
+    t->tv_nsec = (long)(ns % 1000000000);
+}
+
+// Waits on cond for at most ms; timed waits run on the realtime clock.
+static void cond_wait_ms(pthread_cond_t *cond, pthread_mutex_t *lock, double ms) {
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    add_ms(&t, ms);
+    pthread_cond_timedwait(cond, lock, &t);
+}
+
+// xorshift64* uniform in [0, 1), one state per client as rand() is shared.
+static double serve_uniform(uint64_t *s) {
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return (double)((*s * 2685821657736338717ull) >> 11) / 9007199254740992.0;
+}
+
+// A closed-loop client waits for each reply before the next request; an
+// open-loop one submits on Poisson arrivals at its share of serve_rate and
+// counts latency from the due time, so a late client does not hide a stall.
+static void *serve_client(void *arg) {
+    uint64_t seed = 0x9e3779b97f4a7c15ull * ((uintptr_t)arg + 1);
+    const double rate = cfg.serve_rate / cfg.serve_clients;
+    struct timespec due;
+    clock_gettime(CLOCK_MONOTONIC, &due);
+
+    pthread_mutex_lock(&serve.lock);
+    while (!serve.stop && serve.issued < cfg.serve_requests) {
+        serve_req_t *req = &serve.reqs[serve.issued++];
+        pthread_mutex_unlock(&serve.lock);
+
+        req->entry = (uint32_t)(req - serve.reqs) % cfg.batch_size;
+        if (rate > 0.0) {
+            add_ms(&due, -log(1.0 - serve_uniform(&seed)) / rate * 1000.0);
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double ms = elapsed_ms(&now, &due);
+            if (ms > 0.0) {
+                struct timespec nap = { 0, 0 };
+                add_ms(&nap, ms);
+                nanosleep(&nap, NULL);
+            }
+            req->t_submit = due;
+        } else {
+            clock_gettime(CLOCK_MONOTONIC, &req->t_submit);
+        }
+
+        pthread_mutex_lock(&serve.lock);
+        if (serve.tail) serve.tail->next = req;
+        else serve.head = req;
+        serve.tail = req;
+        ++serve.queued;
+        ++serve.submitted;
+        pthread_cond_signal(&serve.queued_cond);
+        while (rate == 0.0 && !req->done && !serve.stop) pthread_cond_wait(&serve.done_cond, &serve.lock);
+    }
+    --serve.clients;
+    pthread_cond_signal(&serve.queued_cond);
+    pthread_mutex_unlock(&serve.lock);
+    return NULL;
+}
+
+// Frees what run_serve allocated, and the DPU set.
+static void end_serve(struct dpu_set_t set, serve_req_t **batch, pthread_t *clients) {
+    free(clients);
+    free(batch);
+    free(serve.reqs);
+    pthread_cond_destroy(&serve.done_cond);
+    pthread_cond_destroy(&serve.queued_cond);
+    pthread_mutex_destroy(&serve.lock);
+    free_results(&dpu_results);
+    DPU_ASSERT(dpu_free(set));
+}
+
+static int run_serve(struct dpu_set_t set) {
+    const uint32_t nreqs = cfg.serve_requests;
+    const uint32_t cap = cfg.batch_size;
+    const uint32_t heads = cfg.num_heads;
+    alloc_results(&dpu_results);
+    host_compute_reference();
+
+    memset(&serve, 0, sizeof(serve));
+    pthread_mutex_init(&serve.lock, NULL);
+    pthread_cond_init(&serve.queued_cond, NULL);
+    pthread_cond_init(&serve.done_cond, NULL);
+    serve.reqs = calloc(nreqs, sizeof(serve_req_t));
+    serve.clients = cfg.serve_clients;
+    serve_req_t **batch = malloc(cap * sizeof(serve_req_t*));
+    pthread_t *clients = malloc(cfg.serve_clients * sizeof(pthread_t));
+
+    struct timespec ts0, ts1;
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
+    // Without all its clients the run would wait for requests that never
+    // come, so a client that cannot start stops the others.
+    uint32_t started = 0;
+    while (started < cfg.serve_clients &&
+           pthread_create(&clients[started], NULL, serve_client, (void*)(uintptr_t)started) == 0)
+        ++started;
+    if (started < cfg.serve_clients) {
+        fprintf(stderr, "Error: cannot start serving client %u of %u\n", started + 1, cfg.serve_clients);
+        pthread_mutex_lock(&serve.lock);
+        serve.stop = true;
+        pthread_cond_broadcast(&serve.done_cond);
+        pthread_mutex_unlock(&serve.lock);
+        for (uint32_t c = 0; c < started; ++c) pthread_join(clients[c], NULL);
+        end_serve(set, batch, clients);
+        return 1;
+    }
+
+    double push_ms = 0.0, launch_ms = 0.0, pull_ms = 0.0;
+    uint64_t total_cycles = 0;
+    uint32_t served = 0, launches = 0;
+    bool equal = true;
+    pthread_mutex_lock(&serve.lock);
+    while (served < nreqs) {
+        // Closed-loop clients each have a request queued or on its way.
+        for (;;) {
+            bool more = serve.submitted < nreqs && (cfg.serve_rate > 0.0 || serve.queued < serve.clients);
+            if (serve.queued >= cap || (serve.queued > 0 && !more)) break;
+            if (serve.queued == 0) {
+                pthread_cond_wait(&serve.queued_cond, &serve.lock);
+                continue;
+            }
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double left = cfg.serve_wait_ms - elapsed_ms(&serve.head->t_submit, &now);
+            if (left <= 0.0) break;
+            cond_wait_ms(&serve.queued_cond, &serve.lock, left);
+        }
+        uint32_t n = 0;
+        for (; n < cap && serve.head; ++n) {
+            batch[n] = serve.head;
+            serve.head = serve.head->next;
+        }
+        if (!serve.head) serve.tail = NULL;
+        serve.queued -= n;
+        pthread_mutex_unlock(&serve.lock);
+
+        for (uint32_t b = 0; b < n; ++b) {
+            for (uint32_t h = 0; h < heads; ++h) {
+                size_t off = ((size_t)h * cfg.batch_size + batch[b]->entry) * slot_elems;
+                pack_slot((size_t)b * heads + h, input_Q + off, input_K + off, input_V + off, cfg.seq_len);
+            }
+        }
+        pack_shapes(n * heads);
+        push_ms += scatter_inputs(set);
+        struct timespec tl0, tl1;
+        clock_gettime(CLOCK_MONOTONIC, &tl0);
+        DPU_ASSERT(dpu_launch(set, DPU_SYNCHRONOUS));
+        clock_gettime(CLOCK_MONOTONIC, &tl1);
+        trace_span("launch", TRACE_LANE_DPU, &tl0, &tl1, 0);
+        launch_ms += elapsed_ms(&tl0, &tl1);
+        pull_ms += gather_results(set, &dpu_results);
+        if (cfg.out_format != MHA_OUT_INT32)
+            unpack_rows(dpu_results.packed, dpu_results.out, (size_t)n * heads * cfg.seq_len);
+        struct timespec done;
+        clock_gettime(CLOCK_MONOTONIC, &done);
+
+        uint64_t max_dpu_cycles = 0;
+        for (uint32_t i = 0; i < nr_dpus; ++i) {
+            uint64_t c = 0;
+            for (uint32_t ls = 0; ls < dpu_shapes[i].nslots; ++ls)
+                c += dpu_results.cycles[(size_t)i * cfg.slots_per_dpu + ls];
+            if (c > max_dpu_cycles) max_dpu_cycles = c;
+        }
+        total_cycles += max_dpu_cycles;
+
+        for (uint32_t b = 0; b < n; ++b) {
+            batch[b]->ok = true;
+            for (uint32_t h = 0; h < heads; ++h) {
+                size_t slot = (size_t)h * cfg.batch_size + batch[b]->entry;
+                batch[b]->ok = rows_match(dpu_results.out + ((size_t)b * heads + h) * slot_elems,
+                                          host_results.out + slot * slot_elems, cfg.seq_len) && batch[b]->ok;
+            }
+            equal = equal && batch[b]->ok;
+        }
+
+        pthread_mutex_lock(&serve.lock);
+        for (uint32_t b = 0; b < n; ++b) {
+            batch[b]->t_done = done;
+            batch[b]->done = true;
+        }
+        pthread_cond_broadcast(&serve.done_cond);
+        served += n;
+        ++launches;
+    }
+    pthread_mutex_unlock(&serve.lock);
+
+    for (uint32_t c = 0; c < cfg.serve_clients; ++c) pthread_join(clients[c], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    double total_ms = elapsed_ms(&ts0, &ts1);
+
+    double *lat = malloc(nreqs * sizeof(double));
+    for (uint32_t i = 0; i < nreqs; ++i) lat[i] = elapsed_ms(&serve.reqs[i].t_submit, &serve.reqs[i].t_done);
+    mha_sort_samples(lat, nreqs);
+
+    printf("\n--- Serving summary ---\n");
+    if (cfg.serve_rate > 0.0)
+        printf("Requests: %u from %u clients at %.1f requests/s offered\n", nreqs, cfg.serve_clients, cfg.serve_rate);
+    else
+        printf("Requests: %u from %u clients awaiting each reply\n", nreqs, cfg.serve_clients);
+    printf("DPU set loaded once: alloc %.3f ms, load %.3f ms\n", alloc_ms, load_ms);
+    printf("Launches: %u of up to %u requests, %.1f on average, %.3f ms batching deadline\n",
+           launches, cap, (double)nreqs / launches, cfg.serve_wait_ms);
+    printf("Request latency: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+           mha_percentile(lat, nreqs, 50.0), mha_percentile(lat, nreqs, 90.0), mha_percentile(lat, nreqs, 99.0),
+           lat[nreqs - 1]);
+    printf("Throughput: %.1f requests/s, %.1f tokens/s over %.3f ms\n",
+           nreqs * 1000.0 / total_ms, (double)nreqs * cfg.seq_len * 1000.0 / total_ms, total_ms);
+    print_bandwidth("Host->DPU", scatter_bytes() * launches, push_ms);
+    print_bandwidth("DPU->Host", gather_bytes() * launches, pull_ms);
+    printf("DPU launch time: %.3f ms over %u launches\n", launch_ms, launches);
+
+    stats.push_ms = push_ms;
+    stats.launch_ms = launch_ms;
+    stats.pull_ms = pull_ms;
+    stats.e2e_ms = total_ms;
+    stats.dpu_ms = (double)total_cycles / 350000.0;
+    stats.push_bytes = scatter_bytes() * launches;
+    stats.pull_bytes = gather_bytes() * launches;
+    stats.tokens = batch_tokens() / cfg.batch_size * nreqs;
+    stats.ops = batch_ops() / cfg.batch_size * nreqs;
+
+    printf(equal ? "Host == DPU\n" : "Host != DPU\n");
+    stats.ok = equal;
+
+    free(lat);
+    end_serve(set, batch, clients);
+    return 0;
+}
+
+// Lays the batch out again with per_dpu slots on each of the nr_dpus DPUs,
+// which hold its first nr_dpus * per_dpu slots.
+static void relayout(uint32_t per_dpu) {
+    cfg.slots_per_dpu = per_dpu;
+    free_layout();
+    layout_batch();
+}
+
+// One synchronous DPU round of the first dpu_slots slots, per_dpu on every
+// DPU: push, launch, pull and unpack, wall time.
+static double dpu_round_ms(struct dpu_set_t set, uint32_t per_dpu, uint32_t dpu_slots) {
+    relayout(per_dpu);
+    pack_shapes(dpu_slots);
+
+    struct timespec ts0, ts1;
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
+    scatter_inputs(set);
+    DPU_ASSERT(dpu_launch(set, DPU_SYNCHRONOUS));
+    gather_results(set, &dpu_results);
+    unpack_results(&dpu_results);
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    return elapsed_ms(&ts0, &ts1);
+}
+
+// Mean of HYBRID_PROBES DPU rounds, after one that pays the one-off costs
+// of the set.
+static double dpu_probe_ms(struct dpu_set_t set, uint32_t per_dpu, uint32_t dpu_slots) {
+    dpu_round_ms(set, per_dpu, dpu_slots);
+    double ms = 0.0;
+    for (uint32_t r = 0; r < HYBRID_PROBES; ++r) ms += dpu_round_ms(set, per_dpu, dpu_slots);
+    return ms / HYBRID_PROBES;
+}
+
+static double cpu_slots_ms(int32_t *out, size_t first, uint32_t nslots) {
+    struct timespec ts0, ts1;
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
+    size_t off = first * slot_elems;
+    host_cpu_attention(input_Q + off, input_K + off, input_V + off, out + off, nslots, cfg.seq_len, NULL,
+                       cfg.head_dim, cfg.kernel == MHA_KERNEL_TILED ? MHA_KERNEL_TILED : MHA_KERNEL_FULL,
+                       softmax_flags(), exp_lut, lut_shift, 0, cfg.host_threads, cfg.cpu_isa);
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    return elapsed_ms(&ts0, &ts1);
+}
+
+// Hybrid mode: the first n slots run on the DPUs while host threads compute
+// the rest. A DPU round is modeled as dpu_a + dpu_b * slots_per_dpu from two
+// calibration rounds, the CPU as cpu_slot per slot from a short probe, each
+// the mean of HYBRID_PROBES runs, and n is chosen so both sides finish
+// together. The set holds whatever DPUs could be allocated, up to
+// slots_per_dpu slots each; the CPU takes the slots they cannot hold. The
+// same batch then runs CPU only, DPU only when the DPUs hold it, and hybrid,
+// all three timed.
+static int run_hybrid(struct dpu_set_t set) {
+    const uint32_t max_per_dpu = cfg.slots_per_dpu;
+    const uint32_t dpu_capacity = nr_dpus * max_per_dpu < total_slots ? nr_dpus * max_per_dpu : total_slots;
+    alloc_results(&dpu_results);
+    int32_t *cpu_out = malloc((size_t)total_slots * slot_elems * sizeof(int32_t));
+
+    uint32_t probe1 = nr_dpus < total_slots ? nr_dpus : total_slots;
+    double t1 = dpu_probe_ms(set, 1, probe1);
+    double dpu_a = 0.0, dpu_b = t1;
+    if (max_per_dpu > 1 && dpu_capacity > probe1) {
+        uint32_t probe2 = 2 * nr_dpus < total_slots ? 2 * nr_dpus : total_slots;
+        double t2 = dpu_probe_ms(set, 2, probe2);
+        dpu_b = t2 > t1 ? t2 - t1 : 0.0;
+        dpu_a = t1 - dpu_b;
+    }
+
+    uint32_t cpu_probe = cfg.host_threads < total_slots ? cfg.host_threads : total_slots;
+    double cpu_slot = 0.0;
+    for (uint32_t r = 0; r < HYBRID_PROBES; ++r) cpu_slot += cpu_slots_ms(cpu_out, 0, cpu_probe);
+    cpu_slot /= (double)HYBRID_PROBES * cpu_probe;
+
+    // n = 0 is CPU only; n = dpu_capacity is as much as the DPUs hold.
+    uint32_t best_n = 0;
+    double best_ms = total_slots * cpu_slot;
+    for (uint32_t n = 1; n <= dpu_capacity; ++n) {
+        uint32_t per_dpu = (n + nr_dpus - 1) / nr_dpus;
+        double dpu_ms = dpu_a + dpu_b * per_dpu;
+        double cpu_ms = (total_slots - n) * cpu_slot;
+        double ms = dpu_ms > cpu_ms ? dpu_ms : cpu_ms;
+        if (ms < best_ms) {
+            best_ms = ms;
+            best_n = n;
+        }
+    }
+    const uint32_t per_dpu = best_n ? (best_n + nr_dpus - 1) / nr_dpus : 1;
+
+    printf("\n--- Hybrid schedule ---\n");
+    printf("Model: DPU round %.3f + %.3f ms per slot/DPU on %u DPUs, CPU %.3f ms per slot on %u threads "
+           "(mean of %d probes)\n", dpu_a, dpu_b, nr_dpus, cpu_slot, cfg.host_threads, HYBRID_PROBES);
+    printf("Predicted: CPU only %.3f ms, DPU only %s%.3f ms, hybrid %.3f ms\n", total_slots * cpu_slot,
+           dpu_capacity < total_slots ? "(too few DPUs) " : "",
+           dpu_a + dpu_b * ((dpu_capacity + nr_dpus - 1) / nr_dpus), best_ms);
+    printf("Split: %u slots on DPUs (%u per DPU), %u on CPU\n", best_n, per_dpu, total_slots - best_n);
+
+    // Measured baselines of the same batch: all of it on the host threads,
+    // the reference as well, and all of it on the DPUs if they hold it.
+    double cpu_only_ms = host_cpu_run(host_results.out);
+    memset(host_results.cycles, 0, total_slots * sizeof(uint64_t));
+    stats.host_ms = cpu_only_ms;
+    double dpu_only_ms = 0.0;
+    if (dpu_capacity == total_slots) dpu_only_ms = dpu_round_ms(set, (total_slots + nr_dpus - 1) / nr_dpus, total_slots);
+
+    // The DPUs get their slots asynchronously; the host computes its share
+    // meanwhile, then collects the DPU share.
+    relayout(per_dpu);
+    pack_shapes(best_n);
+
+    struct timespec ts0, ts1;
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
+    struct timespec launched = ts0, synced;
+    if (best_n > 0) {
+        scatter_inputs(set);
+        clock_gettime(CLOCK_MONOTONIC, &launched);
+        DPU_ASSERT(dpu_launch(set, DPU_ASYNCHRONOUS));
+    }
+    if (best_n < total_slots) cpu_slots_ms(cpu_out, best_n, total_slots - best_n);
+    if (best_n > 0) {
+        DPU_ASSERT(dpu_sync(set));
+        clock_gettime(CLOCK_MONOTONIC, &synced);
+        trace_span("launch", TRACE_LANE_DPU, &launched, &synced, 0);
+        gather_results(set, &dpu_results);
+        unpack_results(&dpu_results);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    double total_ms = elapsed_ms(&ts0, &ts1);
+
+    size_t cpu_first = (size_t)best_n * slot_elems;
+    memcpy(dpu_results.out + cpu_first, cpu_out + cpu_first, (total_slots - best_n) * slot_elems * sizeof(int32_t));
+    double faster_ms = dpu_only_ms > 0.0 && dpu_only_ms < cpu_only_ms ? dpu_only_ms : cpu_only_ms;
+    if (dpu_only_ms > 0.0)
+        printf("Measured: CPU only %.3f ms, DPU only %.3f ms, hybrid %.3f ms\n", cpu_only_ms, dpu_only_ms, total_ms);
+    else
+        printf("Measured: CPU only %.3f ms, DPU only n/a (DPUs hold %u of %u slots), hybrid %.3f ms\n",
+               cpu_only_ms, dpu_capacity, total_slots, total_ms);
+    printf("Hybrid time: %.3f ms (%.1f sequences/s), %.2fx the faster single side\n", total_ms,
+           (double)cfg.batch_size * 1000.0 / total_ms, faster_ms / total_ms);
+    print_throughput("CPU only", 1, cpu_only_ms);
+    if (dpu_only_ms > 0.0) print_throughput("DPU only", 1, dpu_only_ms);
+    print_throughput("Hybrid", 1, total_ms);
+    stats.e2e_ms = total_ms;
+    stats.tokens = batch_tokens();
+    stats.ops = batch_ops();
+
+    stats.ok = results_match(&dpu_results);
+    printf(stats.ok ? "Host == DPU\n" : "Host != DPU\n");
+    if (cfg.accuracy) report_accuracy(dpu_results.out);
+
+    free(cpu_out);
+    free_results(&dpu_results);
+    DPU_ASSERT(dpu_free(set));
+    return 0;
+}
+
+int mha_run(int argc, char **argv, mha_stats_t *out) {
+    cfg = cfg_defaults;
+    memset(opt_given, 0, sizeof(opt_given));
+    snprintf(dpu_binary, sizeof(dpu_binary), "%s", DPU_BINARY);
+    memset(&stats, 0, sizeof(stats));
+    optind = 1;
+
+    trace_start();
+    if (parse_args(argc, argv) != 0) return 1;
+
+    // A tuning entry that does not fit this run, e.g. with options the
+    // tuner did not try, gives way to the defaults.
+    const mha_config_t given = cfg;
+    int tuned = load_tuning();
+    if (tuned < 0) return 1;
+    if (check_config() != 0) {
+        if (tuned == 0) return 1;
+        fprintf(stderr, "Tuning entry does not fit this run, using the defaults\n");
+        cfg = given;
+        snprintf(dpu_binary, sizeof(dpu_binary), "%s", DPU_BINARY);
+        if (check_config() != 0) return 1;
+    }
+
+    total_slots = cfg.num_heads * cfg.batch_size;
+    slot_elems = (size_t)cfg.seq_len * cfg.head_dim;
+    nr_dpus = dpus_needed(cfg.slots_per_dpu);
+    nr_rounds = 1;
+    round_first = 0;
+
+    slot_len = malloc(total_slots * sizeof(uint32_t));
+    init_slot_lengths();
+
+    const char *kernel_name = cfg.kernel == MHA_KERNEL_TILED ? "tiled" : cfg.kernel == MHA_KERNEL_DECODE ? "decode" : "full";
+    stats.batch_size = cfg.batch_size;
+    stats.seq_len = cfg.seq_len;
+    stats.head_dim = cfg.head_dim;
+    stats.num_heads = cfg.num_heads;
+    stats.nr_tasklets = cfg.nr_tasklets;
+    stats.kernel = kernel_name;
+
+    printf("Shape: BATCH=%u SEQ_LEN=%u HEAD_DIM=%u NUM_HEADS=%u TASKLETS=%u SLOTS_PER_DPU=%u KERNEL=%s%s",
+           cfg.batch_size, cfg.seq_len, cfg.head_dim, cfg.num_heads, cfg.nr_tasklets, cfg.slots_per_dpu,
+           kernel_name, cfg.causal ? " CAUSAL" : "");
+    if (cfg.project) printf(" EMBED_DIM=%u PROJECT", cfg.embed_dim);
+    if (ragged()) printf(" RAGGED=%u..%u", cfg.min_len, cfg.seq_len);
+    if (kv_group() > 1) printf(" KV_HEADS=%u", cfg.kv_heads);
+    if (kv_split()) printf(" KV_PARTS=%u", cfg.kv_parts);
+    if (cfg.kernel == MHA_KERNEL_FULL) printf(" ROW_BLOCK=%u Q_BLOCK_ROWS=%u", cfg.row_block, cfg.q_rows);
+    printf(" OPERANDS=%s\n", cfg.byte_kernels ? "byte" : v_tiled() ? "packed,v-tiled" : "packed");
+
+    size_t total_elems = (size_t)total_slots * slot_elems;
+    input_Q = malloc(total_elems);
+    input_K = malloc(total_elems);
+    input_V = malloc(total_elems);
+    host_results.out = calloc(total_elems, sizeof(int32_t));
+    host_results.cycles = malloc(total_slots * sizeof(uint64_t));
+
+    if (cfg.project) {
+        size_t x_bytes = (size_t)cfg.seq_len * cfg.embed_dim;
+        size_t w_bytes = (size_t)3 * cfg.head_dim * cfg.embed_dim;
+        input_X = malloc(cfg.batch_size * x_bytes);
+        input_W = malloc(cfg.num_heads * w_bytes);
+        for (uint32_t b = 0; b < cfg.batch_size; ++b)
+            init_input_data(input_X + b * x_bytes, (int)x_bytes, 300 + (int)b);
+        for (uint32_t h = 0; h < cfg.num_heads; ++h)
+            init_input_data(input_W + h * w_bytes, (int)w_bytes, 400 + (int)h);
+
+        // The host still needs Q/K/V for its reference.
+        struct timespec ts0, ts1;
+        clock_gettime(CLOCK_MONOTONIC, &ts0);
+        for (uint32_t h = 0; h < cfg.num_heads; ++h) {
+            for (uint32_t b = 0; b < cfg.batch_size; ++b) {
+                size_t slot = (size_t)h * cfg.batch_size + b;
+                host_project_int8(input_X + b * x_bytes, input_W + h * w_bytes,
+                                  input_Q + slot * slot_elems, input_K + slot * slot_elems, input_V + slot * slot_elems,
+                                  (int)cfg.seq_len, (int)cfg.head_dim, (int)cfg.embed_dim, proj_shift);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &ts1);
+        printf("Host projection time: %.3f ms\n", elapsed_ms(&ts0, &ts1));
+    } else {
+        for (uint32_t h = 0; h < cfg.num_heads; ++h) {
+            for (uint32_t b = 0; b < cfg.batch_size; ++b) {
+                size_t slot = (size_t)h * cfg.batch_size + b;
+                init_input_data(input_Q + slot * slot_elems, (int)slot_elems, 1 + (int)slot);
+                init_input_data(input_K + slot * slot_elems, (int)slot_elems, 100 + (int)kv_slot(slot));
+                init_input_data(input_V + slot * slot_elems, (int)slot_elems, 200 + (int)kv_slot(slot));
+            }
+        }
+    }
+
+    if (cfg.out_proj) {
+        size_t wo_bytes = (size_t)cfg.embed_dim * cfg.num_heads * cfg.head_dim;
+        input_Wo = malloc(wo_bytes);
+        init_input_data(input_Wo, (int)wo_bytes, 700);
+    }
+
+    init_exp_lut(exp_lut);
+
+    // Plain, decode, serving and hybrid runs take whatever DPUs they can get
+    // and lay the batch out for those, a hybrid run leaving the slots they
+    // cannot hold to the CPU; the other modes lay it out for as many DPUs as
+    // it needs.
+    int rc;
+    struct dpu_set_t set;
+    uint32_t got;
+    if (cfg.cpu_only || cfg.stream_batches > 0) {
+        layout_batch();
+        rc = cfg.cpu_only ? run_cpu() : run_stream();
+    } else if (alloc_dpu_set(&set, &got) != 0) {
+        if (cfg.decode_steps > 0 || cfg.serve_requests > 0) {
+            rc = 1;
+        } else {
+            fprintf(stderr, "Falling back to the CPU backend\n");
+            rc = run_cpu();
+        }
+    } else if (cfg.hybrid) {
+        nr_dpus = got;
+        layout_batch();
+        rc = run_hybrid(set);
+    } else if (plan_rounds(got) != 0) {
+        DPU_ASSERT(dpu_free(set));
+        rc = 1;
+    } else {
+        layout_batch();
+        rc = cfg.decode_steps > 0 ? run_decode(set) : cfg.serve_requests > 0 ? run_serve(set) : run_once(set);
+    }
+
+    free(input_Q);
+    free(input_K);
+    free(input_V);
+    free(input_X);
+    free(input_W);
+    free(input_Wo);
+    free(host_results.out);
+    free(host_results.cycles);
+    free(slot_len);
+    free_layout();
+    // Buffers only some modes allocate must not be freed twice by a later run.
+    input_X = input_W = input_Wo = NULL;
+
+    if (out) *out = stats;
+    if (cfg.trace) {
+        int n = trace_write(cfg.trace);
+        if (n < 0) {
+            fprintf(stderr, "Error: cannot write %s\n", cfg.trace);
+            return 1;
+        }
+        printf("Timeline: %d spans written to %s\n", n, cfg.trace);
+    }
+    return rc;
+}
+
+// The benchmark harness links this file with -DMHA_NO_MAIN and calls mha_run.
+#ifndef MHA_NO_MAIN
+int main(int argc, char **argv) {
+    return mha_run(argc, argv, NULL);
+}
+#endif
@@ -0,0 +1,61 @@
+#ifndef __MHA_HOST_H__
+#define __MHA_HOST_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Measurements of one host run, for the benchmark harness. Stages a mode
+// does not have stay 0; streaming, decode and serving sum theirs over
+// batches, steps and launches.
+typedef struct {
+    bool ok;              // the checked outputs match the host reference
+    uint32_t batch_size;  // shape actually run, after the tuning table
+    uint32_t seq_len;
+    uint32_t head_dim;
+    uint32_t num_heads;
+    uint32_t nr_tasklets;
+    uint32_t slots_per_dpu;
+    const char *kernel;
+    uint32_t nr_dpus;
+    double alloc_ms;
+    double load_ms;
+    double push_ms;       // inputs, weights and launch descriptors
+    double launch_ms;
+    double pull_ms;
+    double unpack_ms;
+    double e2e_ms;        // the whole DPU (or CPU backend) path of the mode
+    double host_ms;       // CPU reference, or the CPU backend itself with -B
+    double dpu_ms;        // slowest DPU's cycles at 350 MHz, summed over launches
+    size_t push_bytes;
+    size_t pull_bytes;
+    double tokens;        // sequence positions computed
+    double ops;           // integer operations, a multiply-add counting two
+} mha_stats_t;
+
+// Runs the host on a command line, argv[0] being the program name, exactly
+// like the host executable. Every call starts from the default
+// configuration; stats, when not NULL, receives the run's measurements.
+int mha_run(int argc, char **argv, mha_stats_t *stats);
+
+static inline int mha_cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Sorts n samples in place for mha_percentile.
+static inline void mha_sort_samples(double *samples, uint32_t n) {
+    qsort(samples, n, sizeof(double), mha_cmp_double);
+}
+
+// Percentile p of n sorted samples, interpolating between closest ranks.
+static inline double mha_percentile(const double *sorted, uint32_t n, double p) {
+    if (n == 0) return 0.0;
+    double pos = p / 100.0 * (n - 1);
+    uint32_t lo = (uint32_t)pos;
+    if (lo + 1 >= n) return sorted[n - 1];
+    return sorted[lo] + (pos - lo) * (sorted[lo + 1] - sorted[lo]);
+}
+
+#endif
@@ -0,0 +1,388 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "host_cpu.h"
+
+// Every ISA provides the same two row primitives; only they are vectorized,
+// the softmax arithmetic around them is shared, so all paths agree bit for
+// bit. Weights are LUT exponentials or probabilities, both at most 255, so
+// weight*v fits int16 and pairs of products can go through madd.
+typedef void (*dot_rows_fn)(const int8_t *q, const int8_t *k, int32_t *score, int n, int dim);
+typedef void (*acc_rows_fn)(const uint8_t *w, const int8_t *v, int32_t *acc, int n, int dim);
+
+// score[j] = q . k[j] for n key rows.
+static void dot_rows_scalar(const int8_t *q, const int8_t *k, int32_t *score, int n, int dim) {
+    for (int j = 0; j < n; ++j) {
+        int32_t s = 0;
+        for (int d = 0; d < dim; ++d) s += (int32_t)q[d] * (int32_t)k[(size_t)j*dim + d];
+        score[j] = s;
+    }
+}
+
+// acc[d] += sum_j w[j] * v[j][d] for n value rows.
+static void acc_rows_scalar(const uint8_t *w, const int8_t *v, int32_t *acc, int n, int dim) {
+    for (int j = 0; j < n; ++j)
+        for (int d = 0; d < dim; ++d) acc[d] += (int32_t)w[j] * (int32_t)v[(size_t)j*dim + d];
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static void dot_rows_avx2(const int8_t *q, const int8_t *k, int32_t *score, int n, int dim) {
+    for (int j = 0; j < n; ++j) {
+        const int8_t *kr = k + (size_t)j*dim;
+        __m256i acc = _mm256_setzero_si256();
+        int d = 0;
+        for (; d + 16 <= dim; d += 16) {
+            __m256i a = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(q + d)));
+            __m256i b = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(kr + d)));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(a, b));
+        }
+        __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        if (d < dim) {
+            __m128i a = _mm_cvtepi8_epi16(_mm_loadl_epi64((const __m128i*)(q + d)));
+            __m128i b = _mm_cvtepi8_epi16(_mm_loadl_epi64((const __m128i*)(kr + d)));
+            s = _mm_add_epi32(s, _mm_madd_epi16(a, b));
+        }
+        s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+        s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+        score[j] = _mm_cvtsi128_si32(s);
+    }
+}
+
+// Rows j and j+1 are interleaved byte by byte so one madd applies both
+// weights; dim is a multiple of 8.
+__attribute__((target("avx2")))
+static void acc_rows_avx2(const uint8_t *w, const int8_t *v, int32_t *acc, int n, int dim) {
+    for (int d = 0; d < dim; d += 8) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(acc + d));
+        for (int j = 0; j < n; j += 2) {
+            bool pair = j + 1 < n;
+            __m128i v0 = _mm_loadl_epi64((const __m128i*)(v + (size_t)j*dim + d));
+            __m128i v1 = pair ? _mm_loadl_epi64((const __m128i*)(v + (size_t)(j + 1)*dim + d)) : _mm_setzero_si128();
+            __m256i vv = _mm256_cvtepi8_epi16(_mm_unpacklo_epi8(v0, v1));
+            __m256i ww = _mm256_set1_epi32((int32_t)w[j] | ((int32_t)(pair ? w[j + 1] : 0) << 16));
+            a = _mm256_add_epi32(a, _mm256_madd_epi16(vv, ww));
+        }
+        _mm256_storeu_si256((__m256i*)(acc + d), a);
+    }
+}
+
+#define AVX512_TARGET __attribute__((target("avx2,avx512f,avx512bw,avx512vl,avx512vnni")))
+
+AVX512_TARGET
+static void dot_rows_avx512(const int8_t *q, const int8_t *k, int32_t *score, int n, int dim) {
+    for (int j = 0; j < n; ++j) {
+        const int8_t *kr = k + (size_t)j*dim;
+        __m512i acc = _mm512_setzero_si512();
+        for (int d = 0; d < dim; d += 32) {
+            __mmask32 m = dim - d >= 32 ? 0xffffffffu : (1u << (dim - d)) - 1;
+            __m512i a = _mm512_cvtepi8_epi16(_mm256_maskz_loadu_epi8(m, q + d));
+            __m512i b = _mm512_cvtepi8_epi16(_mm256_maskz_loadu_epi8(m, kr + d));
+            acc = _mm512_dpwssd_epi32(acc, a, b);
+        }
+        score[j] = _mm512_reduce_add_epi32(acc);
+    }
+}
+
+AVX512_TARGET
+static void acc_rows_avx512(const uint8_t *w, const int8_t *v, int32_t *acc, int n, int dim) {
+    for (int d = 0; d < dim; d += 16) {
+        __mmask16 m = dim - d >= 16 ? 0xffff : (1u << (dim - d)) - 1;
+        __m512i a = _mm512_maskz_loadu_epi32(m, acc + d);
+        for (int j = 0; j < n; j += 2) {
+            bool pair = j + 1 < n;
+            __m128i v0 = _mm_maskz_loadu_epi8(m, v + (size_t)j*dim + d);
+            __m128i v1 = pair ? _mm_maskz_loadu_epi8(m, v + (size_t)(j + 1)*dim + d) : _mm_setzero_si128();
+            __m256i vv = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi8(v0, v1)),
+                                                 _mm_unpackhi_epi8(v0, v1), 1);
+            __m512i ww = _mm512_set1_epi32((int32_t)w[j] | ((int32_t)(pair ? w[j + 1] : 0) << 16));
+            a = _mm512_dpwssd_epi32(a, _mm512_cvtepi8_epi16(vv), ww);
+        }
+        _mm512_mask_storeu_epi32(acc + d, m, a);
+    }
+}
+#endif
+
+host_cpu_isa_t host_cpu_best_isa(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl") &&
+        __builtin_cpu_supports("avx512vnni"))
+        return HOST_CPU_AVX512;
+    if (__builtin_cpu_supports("avx2")) return HOST_CPU_AVX2;
+#endif
+    return HOST_CPU_SCALAR;
+}
+
+const char *host_cpu_isa_name(host_cpu_isa_t isa) {
+    switch (isa) {
+    case HOST_CPU_AVX2: return "avx2";
+    case HOST_CPU_AVX512: return "avx512-vnni";
+    default: return "scalar";
+    }
+}
+
+typedef struct {
+    const int8_t *q, *k, *v;
+    int32_t *out;
+    size_t row0, row1;   // flattened slot*len + row
+    uint32_t len, dim, kernel, flags;
+    const uint32_t *lens;  // rows of each slot, NULL when all have len
+    const uint8_t *lut;
+    uint32_t lut_shift;
+    uint32_t kv_parts;     // partials of a K/V split, 0 for none
+    dot_rows_fn dot;
+    acc_rows_fn acc;
+} cpu_task_t;
+
+typedef struct {
+    cpu_task_t task;
+    pthread_t thread;
+    bool started;
+} cpu_thread_t;
+
+static inline uint8_t lut_exp(const cpu_task_t *t, int32_t v) {
+    return mha_lut_exp(t->lut, -v, t->lut_shift);
+}
+
+// Full kernel row: max, LUT exponentials and their sum, then the weighted V
+// sum normalized by one reciprocal. The unfused softmax instead rescales
+// every probability to 255 by a division before the V sum.
+static void full_row(const cpu_task_t *t, const int8_t *q, const int8_t *k, const int8_t *v, int32_t *out,
+                     int cols, int32_t *score, uint8_t *p) {
+    t->dot(q, k, score, cols, t->dim);
+
+    int32_t row_max = score[0];
+    for (int j = 1; j < cols; ++j)
+        if (score[j] > row_max) row_max = score[j];
+
+    int32_t sum = 0;
+    for (int j = 0; j < cols; ++j) {
+        p[j] = lut_exp(t, score[j] - row_max);
+        sum += p[j];
+    }
+    const bool div_softmax = (t->flags & MHA_FLAG_DIV_SOFTMAX) != 0;
+    if (div_softmax) {
+        if (sum == 0) sum = 1;
+        for (int j = 0; j < cols; ++j) p[j] = (uint8_t)((p[j] * 255) / sum);
+    }
+
+    memset(out, 0, t->dim * sizeof(int32_t));
+    t->acc(p, v, out, cols, t->dim);
+
+    if (!div_softmax) {
+        uint32_t recip = mha_softmax_recip(sum);
+        for (uint32_t d = 0; d < t->dim; ++d) out[d] = mha_softmax_norm(out[d], recip);
+    }
+}
+
+// Tiled kernel over keys rows: KV_TILE_ROWS tiles with the online-softmax
+// rescaling of dpu_online_softmax_tile, out left unnormalized. With resume,
+// out, *max_out and *sum_out carry on from keys seen before.
+static void online_part(const cpu_task_t *t, const int8_t *q, const int8_t *k, const int8_t *v, int32_t *out,
+                        int keys, int32_t *score, uint8_t *e, int32_t *max_out, int32_t *sum_out, bool resume) {
+    const int dim = (int)t->dim;
+    const int32_t one = t->lut[0] ? t->lut[0] : 1;
+    int32_t row_max = resume ? *max_out : 0, row_sum = resume ? *sum_out : 0;
+
+    for (int t0 = 0; t0 < keys; t0 += KV_TILE_ROWS) {
+        int rows = keys - t0 < KV_TILE_ROWS ? keys - t0 : KV_TILE_ROWS;
+        t->dot(q, k + (size_t)t0 * dim, score, rows, dim);
+
+        int32_t tile_max = score[0];
+        for (int j = 1; j < rows; ++j)
+            if (score[j] > tile_max) tile_max = score[j];
+
+        if (t0 == 0 && !resume) {
+            row_max = tile_max;
+            row_sum = 0;
+            memset(out, 0, dim * sizeof(int32_t));
+        } else if (tile_max > row_max) {
+            int32_t f = lut_exp(t, row_max - tile_max);
+            row_sum = (int32_t)(((int64_t)row_sum * f) / one);
+            for (int d = 0; d < dim; ++d) out[d] = (int32_t)(((int64_t)out[d] * f) / one);
+            row_max = tile_max;
+        }
+
+        for (int j = 0; j < rows; ++j) {
+            e[j] = lut_exp(t, score[j] - row_max);
+            row_sum += e[j];
+        }
+        t->acc(e, v + (size_t)t0 * dim, out, rows, dim);
+    }
+    *max_out = row_max;
+    *sum_out = row_sum;
+}
+
+// Tiled kernel row: online_part and the final normalization of
+// dpu_online_softmax_finish.
+static void online_row(const cpu_task_t *t, const int8_t *q, const int8_t *k, const int8_t *v, int32_t *out,
+                       int keys, int32_t *score, uint8_t *e) {
+    const int dim = (int)t->dim;
+    int32_t row_max, row_sum;
+    online_part(t, q, k, v, out, keys, score, e, &row_max, &row_sum, false);
+
+    if (!(t->flags & MHA_FLAG_DIV_SOFTMAX)) {
+        uint32_t recip = mha_softmax_recip(row_sum);
+        for (int d = 0; d < dim; ++d) out[d] = mha_softmax_norm(out[d], recip);
+        return;
+    }
+    for (int d = 0; d < dim; ++d)
+        out[d] = row_sum ? (int32_t)(((int64_t)out[d] * 255) / row_sum) : 0;
+}
+
+void host_cpu_merge_partials(const int32_t *parts, size_t stride, uint32_t nparts, uint32_t dim, int32_t *out) {
+    const double units = (double)QK_SCALE * QK_SCALE * sqrt((double)dim);
+    int32_t row_max = INT32_MIN;
+    for (uint32_t j = 0; j < nparts; ++j) {
+        const int32_t *rec = parts + j * stride;
+        if (rec[dim + 1] > 0 && rec[dim] > row_max) row_max = rec[dim];
+    }
+
+    double sum = 0.0, acc[dim];
+    for (uint32_t d = 0; d < dim; ++d) acc[d] = 0.0;
+    for (uint32_t j = 0; j < nparts; ++j) {
+        const int32_t *rec = parts + j * stride;
+        if (rec[dim + 1] == 0) continue;
+        double w = exp((double)(rec[dim] - row_max) / units);
+        sum += w * rec[dim + 1];
+        for (uint32_t d = 0; d < dim; ++d) acc[d] += w * rec[d];
+    }
+    for (uint32_t d = 0; d < dim; ++d) out[d] = sum > 0.0 ? (int32_t)lrint(255.0 * acc[d] / sum) : 0;
+}
+
+// K/V split row: one partial per part of the split, each with one online
+// softmax over the part's two windows (mha_kv_windows) as the DPU holding
+// them computes it, then merged as the host merges the DPUs' partials. A
+// part past the causal limit is an empty partial.
+static void split_row(const cpu_task_t *t, const int8_t *q, const int8_t *k, const int8_t *v, int32_t *out,
+                      int cols, int slot_len, int32_t *score, uint8_t *e, int32_t *parts) {
+    const uint32_t dim = t->dim, rec = dim + 2;
+    for (uint32_t j = 0; j < t->kv_parts; ++j) {
+        int32_t *part = parts + (size_t)j * rec;
+        uint32_t row0[2], rows[2];
+        mha_kv_windows(j, t->kv_parts, (uint32_t)slot_len, row0, rows);
+        bool seen = false;
+        for (int w = 0; w < 2; ++w) {
+            int end = (int)(row0[w] + rows[w]);
+            int keys = (end < cols ? end : cols) - (int)row0[w];
+            if (keys <= 0) break;
+            online_part(t, q, k + (size_t)row0[w] * dim, v + (size_t)row0[w] * dim, part, keys, score, e,
+                        &part[dim], &part[dim + 1], seen);
+            seen = true;
+        }
+        if (!seen) {
+            memset(part, 0, dim * sizeof(int32_t));
+            part[dim] = INT32_MIN;
+            part[dim + 1] = 0;
+        }
+    }
+    host_cpu_merge_partials(parts, rec, t->kv_parts, dim, out);
+}
+
+static void *cpu_worker(void *arg) {
+    const cpu_task_t *t = arg;
+    const size_t slot_elems = (size_t)t->len * t->dim;
+    int32_t *score = malloc(t->len * sizeof(int32_t));
+    uint8_t *w = malloc(t->len);
+    int32_t *parts = t->kv_parts ? malloc((size_t)t->kv_parts * (t->dim + 2) * sizeof(int32_t)) : NULL;
+
+    for (size_t r = t->row0; r < t->row1; ++r) {
+        size_t slot = r / t->len;
+        int i = (int)(r % t->len);
+        int slot_len = t->lens ? (int)t->lens[slot] : (int)t->len;
+        int cols = (t->flags & MHA_FLAG_CAUSAL) ? i + 1 : slot_len;
+        const int8_t *q = t->q + slot * slot_elems + (size_t)i * t->dim;
+        const int8_t *k = t->k + slot * slot_elems;
+        const int8_t *v = t->v + slot * slot_elems;
+        int32_t *out = t->out + slot * slot_elems + (size_t)i * t->dim;
+        if (i >= slot_len) {
+            memset(out, 0, t->dim * sizeof(int32_t));
+            continue;
+        }
+
+        if (t->kv_parts)
+            split_row(t, q, k, v, out, cols, slot_len, score, w, parts);
+        else if (t->kernel == MHA_KERNEL_TILED)
+            online_row(t, q, k, v, out, cols, score, w);
+        else
+            full_row(t, q, k, v, out, cols, score, w);
+    }
+
+    free(score);
+    free(w);
+    free(parts);
+    return NULL;
+}
+
+// Keys flattened row r attends: its position plus one under a causal mask,
+// its slot's length otherwise, none for a padding row past that length.
+static uint64_t row_keys(size_t r, uint32_t len, const uint32_t *lens, bool causal) {
+    uint32_t slot_len = lens ? lens[r / len] : len;
+    uint32_t i = (uint32_t)(r % len);
+    if (i >= slot_len) return 0;
+    return causal ? i + 1 : slot_len;
+}
+
+// The rows of all slots are flattened and split into contiguous ranges, one
+// per thread, so a handful of long slots still spreads over every core. The
+// ranges hold about the same attended (query, key) pairs, as tasklet_rows
+// splits a causal slot between tasklets.
+void host_cpu_attention(const int8_t *q, const int8_t *k, const int8_t *v, int32_t *out,
+                        uint32_t nslots, uint32_t len, const uint32_t *lens, uint32_t dim, uint32_t kernel,
+                        uint32_t flags, const uint8_t *lut, uint32_t lut_shift, uint32_t kv_parts, uint32_t nthreads,
+                        host_cpu_isa_t isa) {
+    const size_t rows = (size_t)nslots * len;
+    if (isa == HOST_CPU_AUTO) isa = host_cpu_best_isa();
+    if (nthreads == 0) nthreads = 1;
+    if (nthreads > rows) nthreads = (uint32_t)rows;
+
+    dot_rows_fn dot = dot_rows_scalar;
+    acc_rows_fn acc = acc_rows_scalar;
+#if defined(__x86_64__)
+    if (isa == HOST_CPU_AVX2) {
+        dot = dot_rows_avx2;
+        acc = acc_rows_avx2;
+    } else if (isa == HOST_CPU_AVX512) {
+        dot = dot_rows_avx512;
+        acc = acc_rows_avx512;
+    }
+#endif
+
+    const bool causal = (flags & MHA_FLAG_CAUSAL) != 0;
+    uint64_t total = 0;
+    for (size_t r = 0; r < rows; ++r) total += row_keys(r, len, lens, causal);
+
+    cpu_thread_t one, *workers = nthreads > 1 ? malloc(nthreads * sizeof(cpu_thread_t)) : NULL;
+    if (workers == NULL) {
+        workers = &one;
+        nthreads = 1;
+    }
+    size_t r = 0;
+    uint64_t work = 0;
+    for (uint32_t t = 0; t < nthreads; ++t) {
+        size_t row0 = r;
+        uint64_t hi = total * (t + 1) / nthreads;
+        while (r < rows && work < hi) work += row_keys(r++, len, lens, causal);
+        if (t == nthreads - 1) r = rows;
+        workers[t].task = (cpu_task_t){ q, k, v, out, row0, r, len, dim, kernel, flags, lens, lut, lut_shift,
+                                        kv_parts, dot, acc };
+    }
+
+    // The calling thread takes the first range, and any range whose thread
+    // could not be started.
+    for (uint32_t t = 1; t < nthreads; ++t)
+        workers[t].started = pthread_create(&workers[t].thread, NULL, cpu_worker, &workers[t].task) == 0;
+    cpu_worker(&workers[0].task);
+    for (uint32_t t = 1; t < nthreads; ++t)
+        if (!workers[t].started) cpu_worker(&workers[t].task);
+    for (uint32_t t = 1; t < nthreads; ++t)
+        if (workers[t].started) pthread_join(workers[t].thread, NULL);
+    if (workers != &one) free(workers);
+}
@@ -0,0 +1,37 @@
+#ifndef __MHA_HOST_CPU_H__
+#define __MHA_HOST_CPU_H__
+
+#include "common.h"
+
+// Instruction sets of the CPU backend, picked at run time.
+typedef enum {
+    HOST_CPU_SCALAR = 0,
+    HOST_CPU_AVX2,
+    HOST_CPU_AVX512,   // AVX-512BW with VNNI dot products
+    HOST_CPU_AUTO,
+} host_cpu_isa_t;
+
+host_cpu_isa_t host_cpu_best_isa(void);
+const char *host_cpu_isa_name(host_cpu_isa_t isa);
+
+// Attention of nslots slot-major slots of len x dim int8 Q/K/V on nthreads
+// threads. lens, when not NULL, gives each slot its own length of at most
+// len rows, the rows past it being zeroed in out. kernel selects the
+// arithmetic to reproduce, MHA_KERNEL_FULL or MHA_KERNEL_TILED, and flags
+// the MHA_FLAG_CAUSAL and MHA_FLAG_DIV_SOFTMAX bits of the launch; every
+// ISA gives the same bits as the DPU kernel. A nonzero kv_parts reproduces
+// a K/V split over that many DPUs: tiled partials over the windows of every
+// part, merged.
+void host_cpu_attention(const int8_t *q, const int8_t *k, const int8_t *v, int32_t *out,
+                        uint32_t nslots, uint32_t len, const uint32_t *lens, uint32_t dim, uint32_t kernel,
+                        uint32_t flags, const uint8_t *lut, uint32_t lut_shift, uint32_t kv_parts, uint32_t nthreads,
+                        host_cpu_isa_t isa);
+
+// Merges the nparts MHA_OUT_PARTIAL rows of one query row, row j at
+// parts + j*stride int32s, into out: each part is weighted by the
+// exponential of its max below the largest, in double, and the V sums are
+// divided by the weighted exp sums, 255 times the softmax average like the
+// kernels' rows. Parts with an exp sum of 0 saw no key.
+void host_cpu_merge_partials(const int32_t *parts, size_t stride, uint32_t nparts, uint32_t dim, int32_t *out);
+
+#endif
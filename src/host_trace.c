@@ -0,0 +1,83 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host_trace.h"
+
+#define TRACE_NAME_LEN 32
+
+typedef struct {
+    char name[TRACE_NAME_LEN];
+    uint32_t lane;
+    double ts_us;
+    double dur_us;
+    size_t bytes;
+} trace_event_t;
+
+static struct timespec origin;
+static bool started;
+static trace_event_t *events;
+static size_t nevents, capacity;
+
+static double us_since_origin(const struct timespec *t) {
+    return (t->tv_sec - origin.tv_sec) * 1e6 + (t->tv_nsec - origin.tv_nsec) / 1e3;
+}
+
+void trace_start(void) {
+    clock_gettime(CLOCK_MONOTONIC, &origin);
+    started = true;
+    nevents = 0;
+}
+
+void trace_span(const char *name, uint32_t lane, const struct timespec *t0, const struct timespec *t1, size_t bytes) {
+    if (!started || us_since_origin(t0) < 0.0) return;
+    if (nevents == capacity) {
+        size_t grown = capacity ? 2 * capacity : 256;
+        trace_event_t *e = realloc(events, grown * sizeof(trace_event_t));
+        if (e == NULL) return;
+        events = e;
+        capacity = grown;
+    }
+    trace_event_t *e = &events[nevents++];
+    snprintf(e->name, sizeof(e->name), "%s", name);
+    e->lane = lane;
+    e->ts_us = us_since_origin(t0);
+    e->dur_us = us_since_origin(t1) - e->ts_us;
+    e->bytes = bytes;
+}
+
+// Complete ("X") events in microseconds, preceded by a thread_name record
+// per lane so the viewer labels the rows.
+int trace_write(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) return -1;
+
+    uint32_t max_lane = 0;
+    for (size_t i = 0; i < nevents; ++i)
+        if (events[i].lane > max_lane) max_lane = events[i].lane;
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (uint32_t lane = 0; lane <= max_lane; ++lane) {
+        char lane_name[32];
+        if (lane == TRACE_LANE_HOST) snprintf(lane_name, sizeof(lane_name), "host");
+        else if (max_lane == TRACE_LANE_DPU) snprintf(lane_name, sizeof(lane_name), "DPUs");
+        else snprintf(lane_name, sizeof(lane_name), "DPU group %u", lane - TRACE_LANE_DPU);
+        fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                lane ? "," : "", lane, lane_name);
+    }
+    for (size_t i = 0; i < nevents; ++i) {
+        const trace_event_t *e = &events[i];
+        fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+                e->name, e->lane, e->ts_us, e->dur_us);
+        if (e->bytes)
+            fprintf(f, ",\"args\":{\"bytes\":%zu,\"MB/s\":%.1f}", e->bytes,
+                    e->dur_us > 0.0 ? (double)e->bytes / e->dur_us : 0.0);
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n]}\n");
+
+    int rc = ferror(f) ? -1 : (int)nevents;
+    if (fclose(f) != 0) rc = -1;
+    return rc;
+}
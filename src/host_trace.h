@@ -0,0 +1,24 @@
+#ifndef __MHA_HOST_TRACE_H__
+#define __MHA_HOST_TRACE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Host timeline. Every stage is a span between two CLOCK_MONOTONIC stamps on
+// a lane, one row of the viewer; the run is exported as Chrome trace JSON for
+// chrome://tracing or Perfetto.
+#define TRACE_LANE_HOST 0
+#define TRACE_LANE_DPU 1   // plus the group index when streaming
+
+// Origin of the timeline; spans recorded before it are dropped.
+void trace_start(void);
+
+// Records [t0, t1] under name, which is copied. Transfers pass the bytes they
+// moved, other stages 0.
+void trace_span(const char *name, uint32_t lane, const struct timespec *t0, const struct timespec *t1, size_t bytes);
+
+// Writes the spans recorded so far; returns their count, or -1 on error.
+int trace_write(const char *path);
+
+#endif